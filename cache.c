@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+
+#include <stdlib.h>
+#include <err.h>
+
+/*
+ * A small LRU cache of fixed size buffers, keyed by frame index. It holds few
+ * enough entries that a linear scan is nothing next to decoding a frame.
+ */
+struct frame_cache {
+	int nr;
+	size_t len;
+	uint64_t clock;
+	uint8_t *mem;
+	struct {
+		int key;
+		uint64_t used;
+	} slots[];
+};
+
+/**
+ * frame_cache_create() - Create a frame cache.
+ * @param nr Number of frames to cache.
+ * @param len Size of each frame.
+ *
+ * Return: Cache handle.
+ */
+struct frame_cache *frame_cache_create(int nr, size_t len)
+{
+	struct frame_cache *c;
+	int i;
+
+	c = calloc(1, sizeof(*c) + nr * sizeof(c->slots[0]));
+	if (!c)
+		errx(1, "can't allocate frame cache");
+
+	c->mem = malloc(nr * len);
+	if (!c->mem)
+		errx(1, "can't allocate frame cache memory");
+
+	c->nr = nr;
+	c->len = len;
+	for (i = 0; i < nr; i++)
+		c->slots[i].key = -1;
+
+	return c;
+}
+
+/**
+ * frame_cache_lookup() - Find a frame in the cache.
+ * @param c Cache handle.
+ * @param key Frame index.
+ *
+ * Return: Cached frame, valid until the next frame_cache_insert(), or NULL if
+ *	   the frame isn't cached.
+ */
+const uint8_t *frame_cache_lookup(struct frame_cache *c, int key)
+{
+	int i;
+
+	for (i = 0; i < c->nr; i++) {
+		if (c->slots[i].key != key)
+			continue;
+
+		c->slots[i].used = ++c->clock;
+		return c->mem + i * c->len;
+	}
+
+	return NULL;
+}
+
+/**
+ * frame_cache_insert() - Add a frame to the cache.
+ * @param c Cache handle.
+ * @param key Frame index, which must not be negative.
+ *
+ * This evicts the least recently used frame if the cache is full.
+ *
+ * Return: Buffer the caller must fill with the frame.
+ */
+uint8_t *frame_cache_insert(struct frame_cache *c, int key)
+{
+	int i, lru = 0;
+
+	for (i = 0; i < c->nr; i++) {
+		if (c->slots[i].key == key) {
+			lru = i;
+			break;
+		}
+
+		if (c->slots[i].used < c->slots[lru].used)
+			lru = i;
+	}
+
+	c->slots[lru].key = key;
+	c->slots[lru].used = ++c->clock;
+	return c->mem + lru * c->len;
+}
+
+/**
+ * frame_cache_destroy() - Free a frame cache.
+ * @param c Cache handle.
+ *
+ * Return: Nothing.
+ */
+void frame_cache_destroy(struct frame_cache *c)
+{
+	free(c->mem);
+	free(c);
+}
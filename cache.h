@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct frame_cache;
+
+struct frame_cache *frame_cache_create(int nr, size_t len);
+
+const uint8_t *frame_cache_lookup(struct frame_cache *c, int key);
+
+uint8_t *frame_cache_insert(struct frame_cache *c, int key);
+
+void frame_cache_destroy(struct frame_cache *c);
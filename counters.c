@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "counters.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "latency.h"
+#include "pipeline.h"
+
+static atomic_uint_fast64_t counters[NR_COUNTERS];
+
+/*
+ * Names in the Prometheus text format, so the stats socket can be scraped
+ * directly.
+ */
+static const char *const counter_names[NR_COUNTERS] = {
+	[CTR_DEQUEUED] = "ircam_frames_dequeued_total",
+	[CTR_CAPTURE_DROPS] = "ircam_capture_drops_total",
+	[CTR_DQBUF_NS] = "ircam_dqbuf_wait_ns_total",
+	[CTR_STATS_NS] = "ircam_stats_ns_total",
+	[CTR_COLORIZE_NS] = "ircam_colorize_ns_total",
+	[CTR_ENCODE_NS] = "ircam_encode_ns_total",
+	[CTR_SEND_NS] = "ircam_send_ns_total",
+	[CTR_PRESENT_NS] = "ircam_present_ns_total",
+	[CTR_BYTES_WRITTEN] = "ircam_bytes_written_total",
+	[CTR_BYTES_SENT] = "ircam_bytes_sent_total",
+	[CTR_GATE_SKIPS] = "ircam_gate_skips_total",
+	[CTR_GATE_LEAD_DROPS] = "ircam_gate_lead_drops_total",
+};
+
+/**
+ * ctr_add() - Add to a pipeline counter.
+ * @param ctr Counter.
+ * @param v Amount to add.
+ *
+ * This may be called from any thread.
+ *
+ * Return: Nothing.
+ */
+void ctr_add(enum counter ctr, uint64_t v)
+{
+	atomic_fetch_add_explicit(&counters[ctr], v, memory_order_relaxed);
+}
+
+/**
+ * ctr_snapshot() - Read every pipeline counter.
+ * @param v Output array of counter values.
+ *
+ * Return: Nothing.
+ */
+void ctr_snapshot(uint64_t v[NR_COUNTERS])
+{
+	int i;
+
+	for (i = 0; i < NR_COUNTERS; i++)
+		v[i] = atomic_load_explicit(&counters[i], memory_order_relaxed);
+}
+
+static void dump_consumer(const char *name, const struct consumer *c,
+			  void *arg)
+{
+	FILE *out = arg;
+
+	fprintf(out, "ircam_consumer_queued{consumer=\"%s\"} %u\n", name,
+		consumer_queued(c));
+	fprintf(out, "ircam_consumer_drops_total{consumer=\"%s\"} %u\n", name,
+		consumer_drops(c));
+}
+
+/**
+ * ctr_dump() - Print every pipeline counter.
+ * @param out Stream to print to.
+ *
+ * Each line is a name and a value in the Prometheus text format: the queue
+ * depth and drops of every running consumer, and the capture latency
+ * percentiles (see lat_summary()), are included too.
+ *
+ * Return: Nothing.
+ */
+void ctr_dump(FILE *out)
+{
+	uint64_t v[NR_COUNTERS];
+	struct lat_summary s;
+	int i;
+
+	ctr_snapshot(v);
+	for (i = 0; i < NR_COUNTERS; i++)
+		fprintf(out, "%s %" PRIu64 "\n", counter_names[i], v[i]);
+
+	consumer_foreach(dump_consumer, out);
+
+	for (i = 0; i < NR_LAT_STAGES; i++) {
+		lat_summary(i, &s);
+		fprintf(out, "ircam_latency_p50_us{stage=\"%s\"} %u\n",
+			lat_stage_name(i), s.p50);
+		fprintf(out, "ircam_latency_p99_us{stage=\"%s\"} %u\n",
+			lat_stage_name(i), s.p99);
+	}
+}
+
+struct ctr_server {
+	int listen_fd;
+	int event_fd;
+	int interval;
+	pthread_t thread;
+	uint64_t last[NR_COUNTERS];
+	uint64_t last_ns;
+};
+
+static void log_consumer(const char *name, const struct consumer *c,
+			 void *arg)
+{
+	fprintf(arg, ", %s %u/%u", name, consumer_queued(c),
+		consumer_drops(c));
+}
+
+/*
+ * One line summarizing the interval since the last one: queues are shown as
+ * queued/dropped, and stage times as the percentage of a CPU they used. Like
+ * the dump (see serve_client()), it is formatted before it is written, so a
+ * blocked stderr can't hold up consumer_stop().
+ */
+static void log_counters(struct ctr_server *s)
+{
+	static const enum counter busy[] = {
+		CTR_DQBUF_NS,	 CTR_STATS_NS, CTR_COLORIZE_NS,
+		CTR_ENCODE_NS,	 CTR_SEND_NS,  CTR_PRESENT_NS,
+	};
+	static const char *const busy_names[] = {
+		"wait", "stats", "colorize", "encode", "send", "present",
+	};
+	uint64_t v[NR_COUNTERS], now = lat_now();
+	double secs = (now - s->last_ns) / 1e9;
+	size_t i, len;
+	char *buf;
+	FILE *out;
+
+	out = open_memstream(&buf, &len);
+	if (!out)
+		err(1, "can't open memstream");
+
+	ctr_snapshot(v);
+	fprintf(out, "stats: %.1f fps, %" PRIu64 " lost, %" PRIu64 " gated",
+		(v[CTR_DEQUEUED] - s->last[CTR_DEQUEUED]) / secs,
+		v[CTR_CAPTURE_DROPS] - s->last[CTR_CAPTURE_DROPS],
+		v[CTR_GATE_SKIPS] - s->last[CTR_GATE_SKIPS]);
+
+	for (i = 0; i < sizeof(busy) / sizeof(busy[0]); i++)
+		fprintf(out, ", %s %.1f%%", busy_names[i],
+			(v[busy[i]] - s->last[busy[i]]) / secs / 1e7);
+
+	fprintf(out, ", %.0fKB/s written, %.0fKB/s sent",
+		(v[CTR_BYTES_WRITTEN] - s->last[CTR_BYTES_WRITTEN]) / secs /
+			1e3,
+		(v[CTR_BYTES_SENT] - s->last[CTR_BYTES_SENT]) / secs / 1e3);
+
+	consumer_foreach(log_consumer, out);
+	fputc('\n', out);
+	fclose(out);
+
+	fwrite(buf, 1, len, stderr);
+	free(buf);
+
+	memcpy(s->last, v, sizeof(v));
+	s->last_ns = now;
+}
+
+/*
+ * The dump is formatted before it is written, so a client which never reads
+ * can't hold up consumer_stop() (see consumer_foreach()). It can't hold up
+ * this thread for long either.
+ */
+static void serve_client(int fd)
+{
+	const struct timeval timeout = { .tv_sec = 1 };
+	size_t len, off = 0;
+	char *buf;
+	FILE *out;
+
+	out = open_memstream(&buf, &len);
+	if (!out)
+		err(1, "can't open memstream");
+
+	ctr_dump(out);
+	fclose(out);
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	while (off < len) {
+		ssize_t ret = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		off += ret;
+	}
+
+	free(buf);
+	close(fd);
+}
+
+static void *ctr_server_thread(void *arg)
+{
+	struct ctr_server *s = arg;
+	uint64_t next = s->last_ns + s->interval * 1000000000ULL;
+
+	while (1) {
+		struct pollfd pfds[2] = {
+			{ .fd = s->event_fd, .events = POLLIN },
+			{ .fd = s->listen_fd, .events = POLLIN },
+		};
+		int timeout = -1;
+		uint64_t now;
+		int fd;
+
+		if (s->interval) {
+			now = lat_now();
+			timeout = now < next ? (next - now) / 1000000 + 1 : 0;
+		}
+
+		if (poll(pfds, s->listen_fd == -1 ? 1 : 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			err(1, "bad poll");
+		}
+
+		if (pfds[0].revents)
+			break;
+
+		if (pfds[1].revents) {
+			fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd != -1)
+				serve_client(fd);
+		}
+
+		if (s->interval && lat_now() >= next) {
+			log_counters(s);
+			next += s->interval * 1000000000ULL;
+		}
+	}
+
+	return NULL;
+}
+
+static int get_unix_listen(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "stats socket path '%s' is too long", path);
+
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		err(1, "can't create stats socket");
+
+	/*
+	 * A socket left behind by an earlier run would make bind() fail, but
+	 * anything else at the path is left alone.
+	 */
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode))
+			errx(1, "'%s' exists and isn't a socket", path);
+
+		unlink(path);
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		err(1, "can't bind stats socket '%s'", path);
+
+	if (listen(fd, 8))
+		err(1, "can't listen on stats socket '%s'", path);
+
+	return fd;
+}
+
+/**
+ * ctr_server_start() - Report the pipeline counters from a new thread.
+ * @param path Path of a unix socket to create, which prints the output of
+ *	       ctr_dump() to each client which connects, or NULL for none.
+ * @param interval Seconds between summaries of the counters printed on
+ *		   stderr, or zero for none.
+ *
+ * Return: Server handle.
+ */
+struct ctr_server *ctr_server_start(const char *path, int interval)
+{
+	struct ctr_server *s;
+	sigset_t all, old;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		errx(1, "can't allocate stats server");
+
+	s->interval = interval;
+	s->listen_fd = path ? get_unix_listen(path) : -1;
+	s->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->event_fd == -1)
+		err(1, "eventfd");
+
+	ctr_snapshot(s->last);
+	s->last_ns = lat_now();
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&s->thread, NULL, ctr_server_thread, s))
+		errx(1, "can't start stats thread");
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return s;
+}
+
+/**
+ * ctr_server_stop() - Stop reporting the pipeline counters.
+ * @param s Server handle.
+ *
+ * The unix socket, if any, is removed.
+ *
+ * Return: Nothing.
+ */
+void ctr_server_stop(struct ctr_server *s)
+{
+	const uint64_t one = 1;
+	struct sockaddr_un addr;
+	socklen_t len = sizeof(addr);
+
+	if (write(s->event_fd, &one, sizeof(one)) != sizeof(one))
+		err(1, "bad eventfd write");
+
+	pthread_join(s->thread, NULL);
+
+	if (s->listen_fd != -1) {
+		if (!getsockname(s->listen_fd, (struct sockaddr *)&addr, &len))
+			unlink(addr.sun_path);
+
+		close(s->listen_fd);
+	}
+
+	close(s->event_fd);
+	free(s);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Always-on counters for the work done in each stage of the pipeline. They
+ * only ever go up: the ones ending in _NS accumulate the time spent in a stage,
+ * so their rate is the fraction of a CPU that stage keeps busy.
+ */
+enum counter {
+	CTR_DEQUEUED,
+	CTR_CAPTURE_DROPS,
+	CTR_DQBUF_NS,
+	CTR_STATS_NS,
+	CTR_COLORIZE_NS,
+	CTR_ENCODE_NS,
+	CTR_SEND_NS,
+	CTR_PRESENT_NS,
+	CTR_BYTES_WRITTEN,
+	CTR_BYTES_SENT,
+	CTR_GATE_SKIPS,
+	CTR_GATE_LEAD_DROPS,
+	NR_COUNTERS,
+};
+
+void ctr_add(enum counter ctr, uint64_t v);
+
+void ctr_snapshot(uint64_t v[NR_COUNTERS]);
+
+void ctr_dump(FILE *out);
+
+struct ctr_server;
+
+struct ctr_server *ctr_server_start(const char *path, int interval);
+
+void ctr_server_stop(struct ctr_server *s);
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dev.h"
+
+#include <string.h>
+
+#define DOUBLE_HEIGHT(n, w, h, f)                                            \
+	{                                                                    \
+		.name = n, .width = w, .height = h, .fps = f,                \
+		.v4l2_width = w, .v4l2_height = (h) * 2,                     \
+		.skip = (w) * (h) * 2, .raw_per_kelvin = 64,                 \
+	}
+
+static const struct dev_profile profiles[] = {
+	DOUBLE_HEIGHT("tc001", 256, 192, 25),
+	DOUBLE_HEIGHT("384x288", 384, 288, 25),
+	DOUBLE_HEIGHT("640x512", 640, 512, 30),
+};
+
+#define NR_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+/*
+ * Anything else is assumed to have the same layout as the TC001.
+ */
+static struct dev_profile generic = {
+	.name = "generic",
+	.fps = 25,
+	.raw_per_kelvin = 64,
+};
+
+const struct dev_profile *cur_profile = &profiles[0];
+
+/**
+ * dev_profile_find() - Look up a device profile by name.
+ * @param name Name of the profile (ex. "tc001").
+ *
+ * Return: The profile, or NULL if there is no profile with that name.
+ */
+const struct dev_profile *dev_profile_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < NR_PROFILES; i++)
+		if (!strcmp(profiles[i].name, name))
+			return &profiles[i];
+
+	return NULL;
+}
+
+static const struct dev_profile *make_generic(int width, int height)
+{
+	generic.width = width;
+	generic.height = height;
+	generic.v4l2_width = width;
+	generic.v4l2_height = height * 2;
+	generic.skip = width * height * 2;
+	return &generic;
+}
+
+/**
+ * dev_profile_match() - Find the profile for a V4L2 frame size.
+ * @param v4l2_width Width the device advertises, in pixels.
+ * @param v4l2_height Height the device advertises, in pixels.
+ *
+ * Sizes which aren't in the table get a generic profile, which is only valid
+ * until the next call.
+ *
+ * Return: The profile, or NULL if the size can't be a thermal camera.
+ */
+const struct dev_profile *dev_profile_match(int v4l2_width, int v4l2_height)
+{
+	size_t i;
+
+	for (i = 0; i < NR_PROFILES; i++)
+		if (profiles[i].v4l2_width == v4l2_width &&
+		    profiles[i].v4l2_height == v4l2_height)
+			return &profiles[i];
+
+	if (v4l2_width <= 0 || v4l2_height <= 0 || v4l2_height % 2)
+		return NULL;
+
+	return make_generic(v4l2_width, v4l2_height / 2);
+}
+
+/**
+ * dev_profile_for_size() - Find the profile for a Y16 image size.
+ * @param width Image width in pixels.
+ * @param height Image height in pixels.
+ *
+ * This is for recordings, which only store the Y16 image. Like
+ * dev_profile_match(), unknown sizes get a generic profile.
+ *
+ * Return: The profile.
+ */
+const struct dev_profile *dev_profile_for_size(int width, int height)
+{
+	size_t i;
+
+	for (i = 0; i < NR_PROFILES; i++)
+		if (profiles[i].width == width && profiles[i].height == height)
+			return &profiles[i];
+
+	return make_generic(width, height);
+}
@@ -18,7 +18,7 @@
 #pragma once
 
 /*
- * Constants for TOPDON TC001
+ * Device profiles, and the TOPDON TC001 they are modelled on
  *
  * The device is a simple uvcvideo camera. It claims to provide 256x384 YUYV
  * (yuyv422) video, but it actually gives you two different views of the same
@@ -35,11 +35,50 @@
  *
  * The second bitmap is all we actually need: a true unscaled Y16 bitmap of the
  * raw temperature values detected by the IR camera sensor.
+ *
+ * The bigger 384x288 and 640x512 cores sold under other brands use the same
+ * double height layout, so they only differ by their geometry and framerate.
+ * The raw values are 1/64 Kelvin on all of them.
+ */
+
+/*
+ * Everything about a camera which the rest of the code depends on. The V4L2
+ * frame is v4l2_width by v4l2_height YUYV, and the Y16 image starts skip bytes
+ * into it. Raw values are in units of 1/raw_per_kelvin Kelvin.
+ */
+struct dev_profile {
+	const char *name;
+	int width;
+	int height;
+	int fps;
+	int v4l2_width;
+	int v4l2_height;
+	int skip;
+	int raw_per_kelvin;
+};
+
+/*
+ * Frame sizes the per-pixel kernels are specialized for: every profile in the
+ * table in dev.c should be listed here. Other sizes use a generic kernel.
  */
+#define DEV_SIZES(X)	X(256, 192) X(384, 288) X(640, 512)
+
+/*
+ * The current profile is chosen once at startup, before any other threads are
+ * started, and never changes after that.
+ */
+extern const struct dev_profile *cur_profile;
+
+const struct dev_profile *dev_profile_find(const char *name);
+
+const struct dev_profile *dev_profile_match(int v4l2_width, int v4l2_height);
+
+const struct dev_profile *dev_profile_for_size(int width, int height);
 
-#define WIDTH		256
-#define HEIGHT		192
-#define FPS		25
+#define WIDTH		(cur_profile->width)
+#define HEIGHT		(cur_profile->height)
+#define FPS		(cur_profile->fps)
 #define ISIZE		(WIDTH * HEIGHT * 2) // gray16le
-#define ISKIP		ISIZE // Skip 8-bit image (see above)
+#define ISKIP		(cur_profile->skip) // Skip 8-bit image (see above)
 #define VSIZE		(WIDTH * HEIGHT * 4) // rgba
+#define NV12_SIZE	(WIDTH * HEIGHT * 3 / 2)
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "evloop.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/*
+ * Each thread which waits on more than one thing runs one of these: a single
+ * epoll instance watching every file descriptor it cares about, calling back
+ * into the owner of each that becomes ready. Timers are timerfds, so they are
+ * just another source, and a thread only ever wakes up when there is work for
+ * it to do.
+ *
+ * Each epoll event carries its source's slot and generation. A slot may be
+ * removed and reused by a callback while events for its old occupant are
+ * still waiting to be dispatched, and the generation tells them apart.
+ */
+struct evsrc {
+	int fd;
+	uint32_t gen;
+	bool timer;
+	void (*fn)(void *arg, uint64_t v);
+	void *arg;
+};
+
+struct evloop {
+	int epoll_fd;
+	struct evsrc srcs[EVLOOP_MAX_SOURCES];
+};
+
+/**
+ * evloop_new() - Create an event loop.
+ *
+ * Return: Event loop handle.
+ */
+struct evloop *evloop_new(void)
+{
+	struct evloop *l;
+	int i;
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		errx(1, "can't allocate event loop");
+
+	l->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->epoll_fd == -1)
+		err(1, "epoll_create1");
+
+	for (i = 0; i < EVLOOP_MAX_SOURCES; i++)
+		l->srcs[i].fd = -1;
+
+	return l;
+}
+
+static struct evsrc *find_src(struct evloop *l, int fd)
+{
+	int i;
+
+	for (i = 0; i < EVLOOP_MAX_SOURCES; i++)
+		if (l->srcs[i].fd == fd)
+			return &l->srcs[i];
+
+	return NULL;
+}
+
+static void src_ctl(struct evloop *l, int op, struct evsrc *s,
+		    uint32_t events)
+{
+	struct epoll_event e = {
+		.events = events,
+		.data.u64 = (uint64_t)s->gen << 32 | (s - l->srcs),
+	};
+
+	if (epoll_ctl(l->epoll_fd, op, s->fd, &e))
+		err(1, "epoll_ctl");
+}
+
+static struct evsrc *add_src(struct evloop *l, int fd, uint32_t events,
+			     void (*fn)(void *arg, uint64_t v), void *arg)
+{
+	struct evsrc *s = find_src(l, -1);
+
+	if (!s)
+		errx(1, "too many event sources");
+
+	s->fd = fd;
+	s->timer = false;
+	s->fn = fn;
+	s->arg = arg;
+	src_ctl(l, EPOLL_CTL_ADD, s, events);
+	return s;
+}
+
+/**
+ * evloop_add() - Watch a file descriptor.
+ * @param l Event loop handle.
+ * @param fd File descriptor, which the caller still owns.
+ * @param events Mask of epoll events to wait for.
+ * @param fn Function to call when the descriptor is ready, which is passed
+ *	     the mask of epoll events which occurred.
+ * @param arg Argument passed to fn.
+ *
+ * Return: Nothing.
+ */
+void evloop_add(struct evloop *l, int fd, uint32_t events,
+		void (*fn)(void *arg, uint64_t v), void *arg)
+{
+	add_src(l, fd, events, fn, arg);
+}
+
+/**
+ * evloop_mod() - Change the events a file descriptor is watched for.
+ * @param l Event loop handle.
+ * @param fd File descriptor added with evloop_add().
+ * @param events New mask of epoll events to wait for.
+ *
+ * Return: Nothing.
+ */
+void evloop_mod(struct evloop *l, int fd, uint32_t events)
+{
+	struct evsrc *s = find_src(l, fd);
+
+	if (!s)
+		errx(1, "no event source for fd %d", fd);
+
+	src_ctl(l, EPOLL_CTL_MOD, s, events);
+}
+
+/**
+ * evloop_add_timer() - Call a function periodically.
+ * @param l Event loop handle.
+ * @param interval_ms Period of the timer, and the delay before it first fires.
+ * @param fn Function to call when the timer fires, which is passed the number
+ *	     of periods which have passed since it last ran.
+ * @param arg Argument passed to fn.
+ *
+ * Return: File descriptor of the timer, to pass to evloop_del().
+ */
+int evloop_add_timer(struct evloop *l, int64_t interval_ms,
+		     void (*fn)(void *arg, uint64_t v), void *arg)
+{
+	const struct timespec period = {
+		.tv_sec = interval_ms / 1000,
+		.tv_nsec = interval_ms % 1000 * 1000000,
+	};
+	const struct itimerspec t = {
+		.it_interval = period,
+		.it_value = period,
+	};
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1)
+		err(1, "timerfd_create");
+
+	if (timerfd_settime(fd, 0, &t, NULL))
+		err(1, "timerfd_settime");
+
+	add_src(l, fd, EPOLLIN, fn, arg)->timer = true;
+	return fd;
+}
+
+/**
+ * evloop_del() - Stop watching a file descriptor.
+ * @param l Event loop handle.
+ * @param fd File descriptor added with evloop_add(), or a timer.
+ *
+ * This may be called from a callback, even for a descriptor which has events
+ * pending: they are discarded. Timers are closed, anything else is left for
+ * the caller to close.
+ *
+ * Return: Nothing.
+ */
+void evloop_del(struct evloop *l, int fd)
+{
+	struct evsrc *s = find_src(l, fd);
+
+	if (!s)
+		return;
+
+	if (epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, fd, NULL))
+		err(1, "epoll_ctl");
+
+	if (s->timer)
+		close(fd);
+
+	s->fd = -1;
+	s->gen++;
+}
+
+/**
+ * evloop_run_once() - Wait for events, and dispatch them.
+ * @param l Event loop handle.
+ * @param timeout_ms Maximum time to wait in milliseconds, or -1 to wait until
+ *		     something happens.
+ *
+ * Return: Number of events dispatched, which is zero on timeout or if a signal
+ * interrupted the wait.
+ */
+int evloop_run_once(struct evloop *l, int timeout_ms)
+{
+	struct epoll_event evs[EVLOOP_MAX_SOURCES];
+	int i, nr, done = 0;
+
+	nr = epoll_wait(l->epoll_fd, evs, EVLOOP_MAX_SOURCES, timeout_ms);
+	if (nr == -1) {
+		if (errno == EINTR)
+			return 0;
+
+		err(1, "epoll_wait");
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct evsrc *s = &l->srcs[(uint32_t)evs[i].data.u64];
+		uint64_t v = evs[i].events;
+
+		if (s->fd == -1 || s->gen != evs[i].data.u64 >> 32)
+			continue;
+
+		/*
+		 * Another callback may have already drained the timer.
+		 */
+		if (s->timer && read(s->fd, &v, sizeof(v)) != sizeof(v))
+			continue;
+
+		s->fn(s->arg, v);
+		done++;
+	}
+
+	return done;
+}
+
+/**
+ * evloop_free() - Free an event loop.
+ * @param l Event loop handle.
+ *
+ * Any timers still running are closed.
+ *
+ * Return: Nothing.
+ */
+void evloop_free(struct evloop *l)
+{
+	int i;
+
+	for (i = 0; i < EVLOOP_MAX_SOURCES; i++)
+		if (l->srcs[i].fd != -1 && l->srcs[i].timer)
+			close(l->srcs[i].fd);
+
+	close(l->epoll_fd);
+	free(l);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * The most sources one event loop can watch at once.
+ */
+#define EVLOOP_MAX_SOURCES 32
+
+struct evloop;
+
+struct evloop *evloop_new(void);
+
+void evloop_add(struct evloop *l, int fd, uint32_t events,
+		void (*fn)(void *arg, uint64_t v), void *arg);
+
+void evloop_mod(struct evloop *l, int fd, uint32_t events);
+
+int evloop_add_timer(struct evloop *l, int64_t interval_ms,
+		     void (*fn)(void *arg, uint64_t v), void *arg);
+
+void evloop_del(struct evloop *l, int fd);
+
+int evloop_run_once(struct evloop *l, int timeout_ms);
+
+void evloop_free(struct evloop *l);
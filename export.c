@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "export.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <err.h>
+#include <time.h>
+
+#include "dev.h"
+#include "lavc.h"
+#include "record.h"
+#include "stats.h"
+
+static int parse_view_int(const char *key, const char *val, int min, int max)
+{
+	char *end;
+	long v;
+
+	v = strtol(val, &end, 10);
+	if (*end || end == val || v < min || v > max)
+		errx(1, "bad view %s '%s' (%d-%d)", key, val, min, max);
+
+	return v;
+}
+
+/*
+ * Limits are raw Y16 values (1/64 Kelvin), or Celsius with a "C" suffix.
+ */
+static uint16_t parse_view_temp(const char *key, const char *val)
+{
+	size_t len = strlen(val);
+	double c, raw;
+	char *end;
+
+	if (!len || (val[len - 1] != 'C' && val[len - 1] != 'c'))
+		return parse_view_int(key, val, 0, UINT16_MAX);
+
+	c = strtod(val, &end);
+	raw = (c + 273.15) * 64;
+	if (end != val + len - 1 || raw < 0 || raw > UINT16_MAX)
+		errx(1, "bad view %s '%s'", key, val);
+
+	return raw + 0.5;
+}
+
+static void parse_view_file(struct export_view *v, const char *path)
+{
+	char line[256];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		err(1, "can't open view file '%s'", path);
+
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line, *end;
+
+		while (isspace((unsigned char)*p))
+			p++;
+
+		end = p + strlen(p);
+		while (end > p && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+
+		if (*p && *p != '#')
+			export_parse_view(v, p);
+	}
+
+	fclose(f);
+}
+
+/**
+ * export_parse_view() - Parse a view specification for export.
+ * @param v View to update.
+ * @param spec Comma separated list of key=value pairs, or "@path" to read
+ *	       them from a file, one or more per line.
+ *
+ * The keys are "min" and "max" (raw values, or Celsius with a C suffix, or
+ * "auto"), "gamma" (as shown in the overlay, for example 0.50), "contours"
+ * (1-8), and "invert", "colormap", and "rotate" (0 or 1). For example:
+ * "min=20C,max=45C,colormap=1,gamma=0.75".
+ *
+ * Exits on error.
+ *
+ * Return: Nothing.
+ */
+void export_parse_view(struct export_view *v, const char *spec)
+{
+	char *tmp, *tok, *save;
+
+	if (spec[0] == '@') {
+		parse_view_file(v, spec + 1);
+		return;
+	}
+
+	tmp = strdup(spec);
+	if (!tmp)
+		errx(1, "no memory for view");
+
+	for (tok = strtok_r(tmp, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+
+		if (!val)
+			errx(1, "bad view option '%s'", tok);
+
+		*val++ = '\0';
+		if (!strcmp(tok, "min") || !strcmp(tok, "max")) {
+			uint16_t t = 0;
+
+			if (strcmp(val, "auto"))
+				t = parse_view_temp(tok, val);
+
+			if (!strcmp(tok, "min"))
+				v->cfg.min = t;
+			else
+				v->cfg.max = t;
+		} else if (!strcmp(tok, "gamma")) {
+			v->cfg.gammafactor = palette_parse_gamma(val);
+			if (v->cfg.gammafactor < 0)
+				errx(1, "unknown gamma '%s'", val);
+		} else if (!strcmp(tok, "contours")) {
+			v->cfg.contours = parse_view_int(tok, val, 1, 8);
+		} else if (!strcmp(tok, "invert")) {
+			v->cfg.invert = parse_view_int(tok, val, 0, 1);
+		} else if (!strcmp(tok, "colormap")) {
+			v->cfg.colormap = parse_view_int(tok, val, 0, 1);
+		} else if (!strcmp(tok, "rotate")) {
+			v->rotate = parse_view_int(tok, val, 0, 1);
+		} else {
+			errx(1, "unknown view option '%s'", tok);
+		}
+	}
+
+	free(tmp);
+}
+
+static double now_s(void)
+{
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t))
+		err(1, "Bad clock_gettime");
+
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * export_run() - Render a raw recording to RGB video as fast as possible.
+ * @param inpath Path to the raw recording.
+ * @param outpath Path to write the RGB video to.
+ * @param v How to render each frame.
+ * @param opts Encoder to use, and its tuning.
+ * @param stop Export ends early when this becomes non-zero.
+ *
+ * The decoder's frame threads, this thread colorizing, and the recorder's
+ * encoder thread all work on different frames at once, and FFV1 can spread
+ * each frame it encodes over more threads (see the "threads" encoder option).
+ * Each frame keeps its original timestamp. With the "hw" encoder profile,
+ * frames are colorized straight to NV12 for a hardware H.264 encoder.
+ *
+ * Return: Nothing.
+ */
+void export_run(const char *inpath, const char *outpath,
+		const struct export_view *v, const struct lavc_enc_opts *opts,
+		const volatile sig_atomic_t *stop)
+{
+	double start, last, now;
+	struct recorder *rec;
+	struct palette *pal;
+	struct lavc_ctx *in;
+	const uint8_t *data;
+	uint8_t *out;
+	size_t len;
+	int nr, idx, done = 0;
+
+	len = opts->hw ? NV12_SIZE : VSIZE;
+	pal = calloc(1, sizeof(*pal));
+	out = malloc(len);
+	if (!pal || !out)
+		errx(1, "can't allocate export buffers");
+
+	in = lavc_start_decode(inpath);
+	nr = lavc_decode_frames(in);
+	rec = recorder_start(outpath, WIDTH, HEIGHT, FPS,
+			     opts->hw ? AV_PIX_FMT_NV12 : AV_PIX_FMT_BGRA, opts,
+			     true);
+
+	start = last = now_s();
+	while (!*stop && (data = lavc_decode(in, &idx))) {
+		struct palette_cfg cfg = v->cfg;
+		int64_t pts;
+
+		if (!cfg.min || !cfg.max) {
+			struct frame_stats st;
+
+			frame_stats(&st, data, WIDTH * HEIGHT);
+			if (!cfg.min)
+				cfg.min = st.min;
+
+			if (!cfg.max)
+				cfg.max = st.max;
+		}
+
+		cfg.yuv = opts->hw;
+		if (cfg.min >= cfg.max && opts->hw) {
+			memset(out, 16, WIDTH * HEIGHT);
+			memset(out + WIDTH * HEIGHT, 128, WIDTH * HEIGHT / 2);
+		} else if (cfg.min >= cfg.max) {
+			memset(out, 0, VSIZE);
+		} else if (opts->hw) {
+			palette_update(pal, &cfg);
+			palette_colorize_nv12(pal, out, data, WIDTH, HEIGHT,
+					      v->rotate);
+		} else {
+			palette_update(pal, &cfg);
+			palette_colorize(pal, (uint32_t *)out, data,
+					 WIDTH * HEIGHT, v->rotate);
+		}
+
+		/*
+		 * The recorder takes a zero timestamp to mean there isn't one,
+		 * and only the offsets from the first frame end up in the file.
+		 */
+		pts = lavc_decode_pts_ms(in, idx);
+		if (pts < 0)
+			pts = (int64_t)idx * 1000 / FPS;
+
+		recorder_write(rec, idx, (pts + 1) * 1000000, out, len);
+		done++;
+
+		now = now_s();
+		if (now - last >= 1) {
+			fprintf(stderr, "\r%d/%d frames, %.0f fps", done, nr,
+				done / (now - start));
+			last = now;
+		}
+	}
+
+	recorder_end(rec);
+	lavc_end_decode(in);
+
+	now = now_s();
+	fprintf(stderr, "\rExported %d/%d frames in %.1fs (%.0f fps)\n", done,
+		nr, now - start, done / (now - start));
+
+	free(out);
+	free(pal);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <signal.h>
+
+#include "palette.h"
+
+struct lavc_enc_opts;
+
+/*
+ * How to render raw frames for export. A min or max of zero follows each
+ * frame, like AUTO mode in the viewer.
+ */
+struct export_view {
+	struct palette_cfg cfg;
+	bool rotate;
+};
+
+void export_parse_view(struct export_view *v, const char *spec);
+
+void export_run(const char *inpath, const char *outpath,
+		const struct export_view *v, const struct lavc_enc_opts *opts,
+		const volatile sig_atomic_t *stop);
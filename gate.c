@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "gate.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <err.h>
+
+#include "counters.h"
+
+/*
+ * The image is compared in blocks this many pixels square: small enough that
+ * a person walking into a corner of the frame is a change, and large enough
+ * that sensor noise averages out.
+ */
+#define BLOCK		16
+
+#define LEAD_MAX_MS	10000
+
+struct gate {
+	struct gate_opts o;
+	int width;
+	int height;
+	int bw;
+	int bh;
+	int frame_ms;
+	uint32_t thresh;
+	uint32_t *ref;
+	uint32_t *cur;
+	bool have_ref;
+	uint64_t last_keep_ns;
+	uint64_t hold_until_ns;
+
+	/*
+	 * Copies of the most recent frames skipped, oldest first from head,
+	 * to lead into the next change.
+	 */
+	struct frame_pool *pool;
+	struct frame **lead;
+	int nr_lead;
+	int head;
+	int count;
+};
+
+/**
+ * gate_parse_opts() - Parse a recording gate specification.
+ * @param o Options to update.
+ * @param spec Comma separated list of key=value pairs: "threshold" (Kelvin),
+ *	       and "keepalive", "lead", and "hold" (seconds).
+ *
+ * Return: Nothing.
+ */
+void gate_parse_opts(struct gate_opts *o, const char *spec)
+{
+	char *tmp, *tok, *save;
+
+	tmp = strdup(spec);
+	if (!tmp)
+		errx(1, "no memory for gate options");
+
+	for (tok = strtok_r(tmp, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+		char *end;
+		double v;
+
+		if (!val)
+			errx(1, "gate option '%s' needs a value", tok);
+
+		*val++ = '\0';
+		v = strtod(val, &end);
+		if (*end || end == val || v < 0)
+			errx(1, "bad value '%s' for gate option '%s'", val,
+			     tok);
+
+		if (!strcmp(tok, "threshold") && v > 0 && v <= 100)
+			o->threshold = v;
+		else if (!strcmp(tok, "keepalive") && v <= 3600)
+			o->keepalive_ms = v * 1000;
+		else if (!strcmp(tok, "lead") && v * 1000 <= LEAD_MAX_MS)
+			o->lead_ms = v * 1000;
+		else if (!strcmp(tok, "hold") && v <= 3600)
+			o->hold_ms = v * 1000;
+		else
+			errx(1, "bad gate option '%s=%s'", tok, val);
+	}
+
+	free(tmp);
+}
+
+/**
+ * gate_new() - Create a recording gate.
+ * @param o Options for the gate.
+ * @param width Width of frames in pixels.
+ * @param height Height of frames in pixels.
+ * @param fps Nominal framerate, for frames without a capture time and to size
+ *	      the lead-in.
+ * @param raw_per_kelvin Raw pixel values per Kelvin.
+ * @param held Most frames stored through the gate that may still be in use at
+ *	       once, by whatever the frames are stored to.
+ *
+ * Return: Gate handle.
+ */
+struct gate *gate_new(const struct gate_opts *o, int width, int height,
+		      int fps, int raw_per_kelvin, int held)
+{
+	struct gate *g;
+
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		err(1, "can't allocate gate");
+
+	g->o = *o;
+	g->width = width;
+	g->height = height;
+	g->bw = (width + BLOCK - 1) / BLOCK;
+	g->bh = (height + BLOCK - 1) / BLOCK;
+	g->frame_ms = 1000 / fps;
+	g->thresh = o->threshold * raw_per_kelvin + 0.5;
+	g->ref = calloc(g->bw * g->bh, sizeof(*g->ref));
+	g->cur = calloc(g->bw * g->bh, sizeof(*g->cur));
+	if (!g->ref || !g->cur)
+		err(1, "can't allocate gate blocks");
+
+	g->nr_lead = (int64_t)o->lead_ms * fps / 1000;
+	if (g->nr_lead) {
+		g->lead = calloc(g->nr_lead, sizeof(*g->lead));
+		if (!g->lead)
+			err(1, "can't allocate gate lead-in");
+
+		/*
+		 * Once a lead-in is stored, its copies may be held until the
+		 * recorders catch up, so there are enough for another full
+		 * lead-in to build up behind them, plus the one being filled.
+		 */
+		g->pool = frame_pool_create(g->nr_lead + held + 1,
+					    (size_t)width * height * 2);
+	}
+
+	return g;
+}
+
+static void block_sums(const struct gate *g, const uint8_t *y16,
+		       uint32_t *sums)
+{
+	const uint16_t *px = (const void *)y16;
+	int x, y;
+
+	memset(sums, 0, g->bw * g->bh * sizeof(*sums));
+	for (y = 0; y < g->height; y++) {
+		uint32_t *row = sums + (y / BLOCK) * g->bw;
+		const uint16_t *line = px + y * g->width;
+
+		for (x = 0; x < g->width; x++)
+			row[x / BLOCK] += line[x];
+	}
+}
+
+/*
+ * Blocks on the right and bottom edges may be partial, so each is compared
+ * by its mean.
+ */
+static bool changed(const struct gate *g)
+{
+	int bx, by;
+
+	for (by = 0; by < g->bh; by++) {
+		int h = g->height - by * BLOCK;
+
+		if (h > BLOCK)
+			h = BLOCK;
+
+		for (bx = 0; bx < g->bw; bx++) {
+			int i = by * g->bw + bx, w = g->width - bx * BLOCK;
+			uint32_t a = g->cur[i], b = g->ref[i];
+
+			if (w > BLOCK)
+				w = BLOCK;
+
+			if ((a > b ? a - b : b - a) > g->thresh * w * h)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static void lead_clear(struct gate *g)
+{
+	while (g->count) {
+		frame_put(g->lead[g->head]);
+		g->head = (g->head + 1) % g->nr_lead;
+		g->count--;
+	}
+}
+
+static void lead_push(struct gate *g, const struct frame *f)
+{
+	struct frame *copy;
+
+	if (!g->nr_lead)
+		return;
+
+	if (g->count == g->nr_lead) {
+		frame_put(g->lead[g->head]);
+		g->head = (g->head + 1) % g->nr_lead;
+		g->count--;
+	}
+
+	/*
+	 * If the recorders are holding more than they should, this frame is
+	 * left out of the next lead-in.
+	 */
+	copy = frame_pool_get(g->pool);
+	if (!copy) {
+		ctr_add(CTR_GATE_LEAD_DROPS, 1);
+		return;
+	}
+
+	copy->seq = f->seq;
+	copy->ts_ns = f->ts_ns;
+	copy->pts_ms = f->pts_ms;
+	memcpy(copy->data, f->data, f->len);
+	copy->len = f->len;
+	copy->nr_roi = 0;
+	g->lead[(g->head + g->count) % g->nr_lead] = copy;
+	g->count++;
+}
+
+static void lead_store(struct gate *g,
+		       void (*store)(struct frame *f, void *arg), void *arg)
+{
+	while (g->count) {
+		struct frame *f = g->lead[g->head];
+
+		g->head = (g->head + 1) % g->nr_lead;
+		g->count--;
+		store(f, arg);
+		frame_put(f);
+	}
+}
+
+/**
+ * gate_push() - Store a frame if it is worth recording.
+ * @param g Gate handle.
+ * @param f Frame to consider.
+ * @param store Function to store a frame, which takes its own reference if it
+ *		needs the frame after it returns.
+ * @param arg Argument for store().
+ *
+ * When a change starts, the lead-in is stored before the frame. Skipped frames
+ * are simply missing: the recorders timestamp every frame from its capture
+ * time, so playback timing is unaffected.
+ *
+ * Return: Nothing.
+ */
+void gate_push(struct gate *g, struct frame *f,
+	       void (*store)(struct frame *f, void *arg), void *arg)
+{
+	uint64_t now = f->ts_ns;
+
+	if (!now)
+		now = (uint64_t)f->seq * g->frame_ms * 1000000;
+
+	block_sums(g, f->data, g->cur);
+	if (!g->have_ref || changed(g))
+		g->hold_until_ns = now + g->o.hold_ms * 1000000ULL;
+
+	if (now <= g->hold_until_ns) {
+		lead_store(g, store, arg);
+	} else if (g->o.keepalive_ms &&
+		   now - g->last_keep_ns >= g->o.keepalive_ms * 1000000ULL) {
+		lead_clear(g);
+	} else {
+		lead_push(g, f);
+		ctr_add(CTR_GATE_SKIPS, 1);
+		return;
+	}
+
+	memcpy(g->ref, g->cur, g->bw * g->bh * sizeof(*g->ref));
+	g->have_ref = true;
+	g->last_keep_ns = now;
+	store(f, arg);
+}
+
+/**
+ * gate_reset() - Make the next frame a change.
+ * @param g Gate handle.
+ *
+ * A new recording should never start in the middle of a quiet period, with
+ * nothing to show until the next keepalive.
+ *
+ * Return: Nothing.
+ */
+void gate_reset(struct gate *g)
+{
+	lead_clear(g);
+	g->have_ref = false;
+}
+
+/**
+ * gate_free() - Free a recording gate.
+ * @param g Gate handle.
+ *
+ * The recorders must be done with every frame it stored.
+ *
+ * Return: Nothing.
+ */
+void gate_free(struct gate *g)
+{
+	lead_clear(g);
+	if (g->pool)
+		frame_pool_destroy(g->pool);
+
+	free(g->lead);
+	free(g->ref);
+	free(g->cur);
+	free(g);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "pipeline.h"
+
+/*
+ * A frame is a change if the mean of any block of the image has moved more
+ * than threshold Kelvin since the last frame kept. Between changes, a frame is
+ * kept every keepalive_ms, or never if it is zero. Recording continues at full
+ * rate until hold_ms after the last change, and starts lead_ms before it.
+ */
+struct gate_opts {
+	double threshold;
+	int keepalive_ms;
+	int lead_ms;
+	int hold_ms;
+};
+
+void gate_parse_opts(struct gate_opts *o, const char *spec);
+
+struct gate;
+
+struct gate *gate_new(const struct gate_opts *o, int width, int height,
+		      int fps, int raw_per_kelvin, int held);
+
+void gate_push(struct gate *g, struct frame *f,
+	       void (*store)(struct frame *f, void *arg), void *arg);
+
+void gate_reset(struct gate *g);
+
+void gate_free(struct gate *g);
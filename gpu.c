@@ -0,0 +1,477 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "gpu.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include <SDL_opengles2.h>
+
+#include "dev.h"
+
+/*
+ * Colorize frames on the GPU, sharing the GL context of an SDL renderer.
+ *
+ * The raw Y16LE frame is uploaded as a two channel 8-bit texture, because
+ * GLES2 has no 16-bit formats: the shader reassembles each value from the low
+ * (luminance) and high (alpha) bytes, so it must never be filtered. The 8-bit
+ * part of the palette (see palette_update_pal8()) is a 256x1 texture, and the
+ * shader does the same normalization as palette_update() to index it.
+ *
+ * SDL caches the GL state it thinks it has set, so everything we touch is put
+ * back exactly as we found it before SDL draws anything else.
+ */
+
+#define GL_FUNCS(X)                                                          \
+	X(void, ActiveTexture, (GLenum))                                     \
+	X(void, AttachShader, (GLuint, GLuint))                              \
+	X(void, BindAttribLocation, (GLuint, GLuint, const GLchar *))        \
+	X(void, BindBuffer, (GLenum, GLuint))                                \
+	X(void, BindTexture, (GLenum, GLuint))                               \
+	X(void, BufferData, (GLenum, GLsizeiptr, const void *, GLenum))      \
+	X(void, CompileShader, (GLuint))                                     \
+	X(GLuint, CreateProgram, (void))                                     \
+	X(GLuint, CreateShader, (GLenum))                                    \
+	X(void, DeleteBuffers, (GLsizei, const GLuint *))                    \
+	X(void, DeleteProgram, (GLuint))                                     \
+	X(void, DeleteShader, (GLuint))                                      \
+	X(void, DeleteTextures, (GLsizei, const GLuint *))                   \
+	X(void, Disable, (GLenum))                                           \
+	X(void, DisableVertexAttribArray, (GLuint))                          \
+	X(void, DrawArrays, (GLenum, GLint, GLsizei))                        \
+	X(void, Enable, (GLenum))                                            \
+	X(void, EnableVertexAttribArray, (GLuint))                           \
+	X(void, GenBuffers, (GLsizei, GLuint *))                             \
+	X(void, GenTextures, (GLsizei, GLuint *))                            \
+	X(void, GetIntegerv, (GLenum, GLint *))                              \
+	X(void, GetProgramiv, (GLuint, GLenum, GLint *))                     \
+	X(void, GetShaderInfoLog, (GLuint, GLsizei, GLsizei *, GLchar *))    \
+	X(void, GetShaderiv, (GLuint, GLenum, GLint *))                      \
+	X(GLint, GetUniformLocation, (GLuint, const GLchar *))               \
+	X(void, GetVertexAttribiv, (GLuint, GLenum, GLint *))                \
+	X(GLboolean, IsEnabled, (GLenum))                                    \
+	X(void, LinkProgram, (GLuint))                                       \
+	X(void, ShaderSource,                                                \
+	  (GLuint, GLsizei, const GLchar *const *, const GLint *))           \
+	X(void, TexImage2D,                                                  \
+	  (GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum,    \
+	   const void *))                                                    \
+	X(void, TexParameteri, (GLenum, GLenum, GLint))                      \
+	X(void, TexSubImage2D,                                               \
+	  (GLenum, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLenum,    \
+	   const void *))                                                    \
+	X(void, Uniform1f, (GLint, GLfloat))                                 \
+	X(void, Uniform1i, (GLint, GLint))                                   \
+	X(void, UseProgram, (GLuint))                                        \
+	X(void, VertexAttribPointer,                                         \
+	  (GLuint, GLint, GLenum, GLboolean, GLsizei, const void *))         \
+	X(void, Viewport, (GLint, GLint, GLsizei, GLsizei))
+
+struct gpu {
+	SDL_Renderer *r;
+
+#define GL_FUNC_PTR(ret, name, args) ret(GL_APIENTRY *name) args;
+	GL_FUNCS(GL_FUNC_PTR)
+#undef GL_FUNC_PTR
+
+	GLuint prog;
+	GLuint vbo;
+	GLuint y16_tex;
+	GLuint pal_tex;
+	GLint u_min;
+	GLint u_max;
+	GLint u_mult;
+	GLint u_blank;
+	GLint u_rotate;
+	bool pal8_valid;
+	uint32_t pal8[256];
+};
+
+/*
+ * No #version, so this is GLSL 1.10 on desktop GL and GLSL ES 1.00 on GLES2.
+ */
+static const char *const vert_src =
+	"attribute vec2 a_pos;\n"
+	"uniform float u_rotate;\n"
+	"varying vec2 v_uv;\n"
+	"void main()\n"
+	"{\n"
+	"	vec2 uv = vec2(a_pos.x + 1.0, 1.0 - a_pos.y) * 0.5;\n"
+	"	v_uv = mix(uv, vec2(1.0) - uv, u_rotate);\n"
+	"	gl_Position = vec4(a_pos, 0.0, 1.0);\n"
+	"}\n";
+
+/*
+ * Every raw value must be exact, which needs highp on GLES: without it the
+ * shader fails to compile, so we fall back to the CPU. The palette is stored
+ * BGRA like everything else, hence the swizzle.
+ */
+static const char *const frag_src =
+	"#ifdef GL_ES\n"
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"precision highp float;\n"
+	"#else\n"
+	"#error no highp in fragment shaders\n"
+	"#endif\n"
+	"#endif\n"
+	"uniform sampler2D u_y16;\n"
+	"uniform sampler2D u_pal;\n"
+	"uniform float u_min;\n"
+	"uniform float u_max;\n"
+	"uniform float u_mult;\n"
+	"uniform float u_blank;\n"
+	"varying vec2 v_uv;\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 t = texture2D(u_y16, v_uv);\n"
+	"	float v = floor(t.r * 255.0 + 0.5) +\n"
+	"		  floor(t.a * 255.0 + 0.5) * 256.0;\n"
+	"	float i = 255.0;\n"
+	"	vec4 p;\n"
+	"	if (v <= u_min)\n"
+	"		i = 0.0;\n"
+	"	else if (v < u_max)\n"
+	"		i = min(floor((v - u_min) * u_mult), 255.0);\n"
+	"	p = texture2D(u_pal, vec2((i + 0.5) / 256.0, 0.5));\n"
+	"	gl_FragColor = mix(vec4(p.b, p.g, p.r, 1.0),\n"
+	"			   vec4(0.0, 0.0, 0.0, 1.0), u_blank);\n"
+	"}\n";
+
+/*
+ * Two triangles covering the whole viewport.
+ */
+static const GLfloat quad[] = {
+	-1.0F, -1.0F, 1.0F, -1.0F, -1.0F, 1.0F, 1.0F, 1.0F,
+};
+
+/*
+ * Everything gpu_paint() changes which SDL might care about.
+ */
+struct gl_state {
+	GLint prog;
+	GLint active_tex;
+	GLint tex0;
+	GLint tex1;
+	GLint vbo;
+	GLint attr0;
+	GLint viewport[4];
+	GLboolean blend;
+	GLboolean scissor;
+};
+
+static void save_state(struct gpu *g, struct gl_state *s)
+{
+	g->GetIntegerv(GL_CURRENT_PROGRAM, &s->prog);
+	g->GetIntegerv(GL_ACTIVE_TEXTURE, &s->active_tex);
+	g->ActiveTexture(GL_TEXTURE0);
+	g->GetIntegerv(GL_TEXTURE_BINDING_2D, &s->tex0);
+	g->ActiveTexture(GL_TEXTURE1);
+	g->GetIntegerv(GL_TEXTURE_BINDING_2D, &s->tex1);
+	g->GetIntegerv(GL_ARRAY_BUFFER_BINDING, &s->vbo);
+	g->GetVertexAttribiv(0, GL_VERTEX_ATTRIB_ARRAY_ENABLED, &s->attr0);
+	g->GetIntegerv(GL_VIEWPORT, s->viewport);
+	s->blend = g->IsEnabled(GL_BLEND);
+	s->scissor = g->IsEnabled(GL_SCISSOR_TEST);
+}
+
+static void restore_state(struct gpu *g, const struct gl_state *s)
+{
+	if (s->scissor)
+		g->Enable(GL_SCISSOR_TEST);
+
+	if (s->blend)
+		g->Enable(GL_BLEND);
+
+	g->Viewport(s->viewport[0], s->viewport[1], s->viewport[2],
+		    s->viewport[3]);
+
+	if (!s->attr0)
+		g->DisableVertexAttribArray(0);
+
+	g->BindBuffer(GL_ARRAY_BUFFER, s->vbo);
+	g->ActiveTexture(GL_TEXTURE1);
+	g->BindTexture(GL_TEXTURE_2D, s->tex1);
+	g->ActiveTexture(GL_TEXTURE0);
+	g->BindTexture(GL_TEXTURE_2D, s->tex0);
+	g->ActiveTexture(s->active_tex);
+	g->UseProgram(s->prog);
+}
+
+static GLuint compile(struct gpu *g, GLenum type, const char *src)
+{
+	GLuint shader;
+	GLint ok;
+
+	shader = g->CreateShader(type);
+	g->ShaderSource(shader, 1, &src, NULL);
+	g->CompileShader(shader);
+	g->GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		char log[1024] = "";
+
+		g->GetShaderInfoLog(shader, sizeof(log), NULL, log);
+		warnx("can't compile shader: %s", log);
+		g->DeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+static GLuint new_texture(struct gpu *g, GLenum format, int w, int h)
+{
+	GLuint tex;
+
+	g->GenTextures(1, &tex);
+	g->BindTexture(GL_TEXTURE_2D, tex);
+	g->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	g->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	g->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	g->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	g->TexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format,
+		      GL_UNSIGNED_BYTE, NULL);
+
+	return tex;
+}
+
+/*
+ * POSIX guarantees function and object pointers have the same representation,
+ * but ISO C doesn't allow converting between them directly.
+ */
+static bool load_proc(void *dst, const char *name)
+{
+	void *p = SDL_GL_GetProcAddress(name);
+
+	memcpy(dst, &p, sizeof(p));
+	return p;
+}
+
+/**
+ * gpu_create_renderer() - Create an SDL renderer which gpu_open() can use.
+ * @param w Window to render into.
+ *
+ * GLES2 is preferred, since that's all the Raspberry Pi's VideoCore has.
+ *
+ * Return: SDL renderer, or NULL if neither GLES2 nor GL is available.
+ */
+SDL_Renderer *gpu_create_renderer(SDL_Window *w)
+{
+	static const char *const drivers[] = { "opengles2", "opengl" };
+	SDL_RendererInfo info;
+	SDL_Renderer *r;
+	unsigned i;
+	int j;
+
+	for (i = 0; i < sizeof(drivers) / sizeof(drivers[0]); i++) {
+		for (j = 0; j < SDL_GetNumRenderDrivers(); j++) {
+			if (SDL_GetRenderDriverInfo(j, &info) ||
+			    strcmp(info.name, drivers[i]))
+				continue;
+
+			/*
+			 * Asking for a specific driver also disables SDL's
+			 * command batching, which lets us draw in between.
+			 */
+			r = SDL_CreateRenderer(w, j, SDL_RENDERER_ACCELERATED);
+			if (r)
+				return r;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * gpu_open() - Set up GPU colorization for an SDL renderer.
+ * @param r Renderer from gpu_create_renderer().
+ *
+ * Return: GPU handle, or NULL if the renderer can't be used, in which case
+ * the caller should colorize on the CPU.
+ */
+struct gpu *gpu_open(SDL_Renderer *r)
+{
+	GLuint vert, frag;
+	struct gl_state s;
+	struct gpu *g;
+	GLint ok;
+
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		errx(1, "can't allocate GPU context");
+
+	g->r = r;
+
+#define GL_FUNC_LOAD(ret, name, args)                                       \
+	if (!load_proc(&g->name, "gl" #name)) {                              \
+		warnx("no gl" #name "() in this GL implementation");         \
+		goto err;                                                    \
+	}
+
+	GL_FUNCS(GL_FUNC_LOAD)
+#undef GL_FUNC_LOAD
+
+	vert = compile(g, GL_VERTEX_SHADER, vert_src);
+	if (!vert)
+		goto err;
+
+	frag = compile(g, GL_FRAGMENT_SHADER, frag_src);
+	if (!frag) {
+		g->DeleteShader(vert);
+		goto err;
+	}
+
+	g->prog = g->CreateProgram();
+	g->AttachShader(g->prog, vert);
+	g->AttachShader(g->prog, frag);
+	g->BindAttribLocation(g->prog, 0, "a_pos");
+	g->LinkProgram(g->prog);
+	g->DeleteShader(vert);
+	g->DeleteShader(frag);
+
+	g->GetProgramiv(g->prog, GL_LINK_STATUS, &ok);
+	if (!ok) {
+		warnx("can't link shader program");
+		g->DeleteProgram(g->prog);
+		goto err;
+	}
+
+	g->u_min = g->GetUniformLocation(g->prog, "u_min");
+	g->u_max = g->GetUniformLocation(g->prog, "u_max");
+	g->u_mult = g->GetUniformLocation(g->prog, "u_mult");
+	g->u_blank = g->GetUniformLocation(g->prog, "u_blank");
+	g->u_rotate = g->GetUniformLocation(g->prog, "u_rotate");
+
+	SDL_RenderFlush(r);
+	save_state(g, &s);
+
+	g->UseProgram(g->prog);
+	g->Uniform1i(g->GetUniformLocation(g->prog, "u_y16"), 0);
+	g->Uniform1i(g->GetUniformLocation(g->prog, "u_pal"), 1);
+
+	g->GenBuffers(1, &g->vbo);
+	g->BindBuffer(GL_ARRAY_BUFFER, g->vbo);
+	g->BufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+	g->ActiveTexture(GL_TEXTURE0);
+	g->y16_tex = new_texture(g, GL_LUMINANCE_ALPHA, WIDTH, HEIGHT);
+	g->ActiveTexture(GL_TEXTURE1);
+	g->pal_tex = new_texture(g, GL_RGBA, 256, 1);
+
+	restore_state(g, &s);
+	return g;
+
+err:
+	free(g);
+	return NULL;
+}
+
+/**
+ * gpu_paint() - Colorize a frame into the renderer's logical viewport.
+ * @param g GPU handle.
+ * @param y16 Raw Y16LE framebuffer, or NULL to repaint the last one.
+ * @param pal8 The 8-bit palette, see palette_update_pal8().
+ * @param min Raw value mapped to pal8[0].
+ * @param max Raw value mapped to pal8[255].
+ * @param rotate Rotate the output by 180 degrees.
+ *
+ * If min >= max, the frame is painted black, as in the CPU path.
+ *
+ * Return: Nothing.
+ */
+void gpu_paint(struct gpu *g, const uint8_t *y16, const uint32_t *pal8,
+	       uint16_t min, uint16_t max, bool rotate)
+{
+	struct gl_state s;
+	float sx, sy;
+	SDL_Rect vp;
+	int ow, oh;
+
+	/*
+	 * Anything SDL has queued must be drawn first, with its own state.
+	 */
+	SDL_RenderFlush(g->r);
+	save_state(g, &s);
+
+	/*
+	 * SDL reports the viewport in logical coordinates with a top left
+	 * origin, and GL wants pixels from the bottom left.
+	 */
+	SDL_RenderGetViewport(g->r, &vp);
+	SDL_RenderGetScale(g->r, &sx, &sy);
+	SDL_GetRendererOutputSize(g->r, &ow, &oh);
+	g->Viewport(vp.x * sx, oh - (vp.y + vp.h) * sy, vp.w * sx, vp.h * sy);
+
+	g->Disable(GL_BLEND);
+	g->Disable(GL_SCISSOR_TEST);
+	g->UseProgram(g->prog);
+
+	g->ActiveTexture(GL_TEXTURE1);
+	g->BindTexture(GL_TEXTURE_2D, g->pal_tex);
+	if (!g->pal8_valid || memcmp(g->pal8, pal8, sizeof(g->pal8))) {
+		g->TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 1, GL_RGBA,
+				 GL_UNSIGNED_BYTE, pal8);
+		memcpy(g->pal8, pal8, sizeof(g->pal8));
+		g->pal8_valid = true;
+	}
+
+	g->ActiveTexture(GL_TEXTURE0);
+	g->BindTexture(GL_TEXTURE_2D, g->y16_tex);
+	if (y16)
+		g->TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT,
+				 GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, y16);
+
+	/*
+	 * The same fixed point scale factor as palette_update(), so both
+	 * paths pick the same palette entries.
+	 */
+	g->Uniform1f(g->u_blank, min >= max);
+	if (min < max) {
+		g->Uniform1f(g->u_min, min);
+		g->Uniform1f(g->u_max, max);
+		g->Uniform1f(g->u_mult,
+			     (float)((1UL << 24) / ((uint32_t)max - min)) /
+				     65536.0F);
+	}
+
+	g->Uniform1f(g->u_rotate, rotate);
+
+	g->BindBuffer(GL_ARRAY_BUFFER, g->vbo);
+	g->EnableVertexAttribArray(0);
+	g->VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	g->DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	restore_state(g, &s);
+}
+
+/**
+ * gpu_close() - Free GPU colorization resources.
+ * @param g GPU handle.
+ *
+ * This must be called before the renderer is destroyed.
+ *
+ * Return: Nothing.
+ */
+void gpu_close(struct gpu *g)
+{
+	g->DeleteTextures(1, &g->y16_tex);
+	g->DeleteTextures(1, &g->pal_tex);
+	g->DeleteBuffers(1, &g->vbo);
+	g->DeleteProgram(g->prog);
+	free(g);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <SDL.h>
+
+struct gpu;
+
+SDL_Renderer *gpu_create_renderer(SDL_Window *w);
+
+struct gpu *gpu_open(SDL_Renderer *r);
+
+void gpu_paint(struct gpu *g, const uint8_t *y16, const uint32_t *pal8,
+	       uint16_t min, uint16_t max, bool rotate);
+
+void gpu_close(struct gpu *g);
@@ -17,17 +17,118 @@
 #include "inet.h"
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
-static int get_stream_listen(int port)
+#include "counters.h"
+#include "evloop.h"
+#include "latency.h"
+
+/*
+ * Socket buffer size for datagram sockets, enough for a few raw frames.
+ */
+#define DGRAM_BUFSIZE (1 << 20)
+
+/**
+ * stream_parse_opts() - Parse a TCP tuning specification.
+ * @param o Options to update.
+ * @param spec Comma separated list of key=value pairs: "rcvbuf" (bytes, or 0
+ *	       for the kernel default), "nodelay" (0 or 1), and "quickack" (0
+ *	       or 1).
+ *
+ * Return: Nothing.
+ */
+void stream_parse_opts(struct stream_opts *o, const char *spec)
+{
+	char *tmp, *tok, *save;
+
+	tmp = strdup(spec);
+	if (!tmp)
+		errx(1, "no memory for socket options");
+
+	for (tok = strtok_r(tmp, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+		char *end;
+		long v;
+
+		if (!val)
+			errx(1, "socket option '%s' needs a value", tok);
+
+		*val++ = '\0';
+		v = strtol(val, &end, 0);
+		if (*end || end == val || v < 0)
+			errx(1, "bad value '%s' for socket option '%s'", val,
+			     tok);
+
+		if (!strcmp(tok, "rcvbuf") && v <= INT_MAX)
+			o->rcvbuf = v;
+		else if (!strcmp(tok, "nodelay") && v <= 1)
+			o->nodelay = v;
+		else if (!strcmp(tok, "quickack") && v <= 1)
+			o->quickack = v;
+		else
+			errx(1, "bad socket option '%s=%s'", tok, val);
+	}
+
+	free(tmp);
+}
+
+/**
+ * stream_rearm() - Reapply the TCP options the kernel doesn't keep.
+ * @param fd Connected TCP socket.
+ * @param o Options the socket was set up with.
+ *
+ * TCP_QUICKACK is only a hint for the next few ACKs, so a receiver which
+ * wants it must set it again after every read.
+ *
+ * Return: Nothing.
+ */
+void stream_rearm(int fd, const struct stream_opts *o)
+{
+	int v = 1;
+
+	if (o->quickack)
+		setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &v, sizeof(v));
+}
+
+/*
+ * SO_RCVBUF must be set before connect() or listen() to affect the window
+ * scale, and accepted sockets inherit it from the listener. The others are set
+ * on every connected socket.
+ */
+static void set_rcvbuf(int fd, const struct stream_opts *o)
+{
+	if (o->rcvbuf)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &o->rcvbuf,
+			   sizeof(o->rcvbuf));
+}
+
+static void set_stream_opts(int fd, const struct stream_opts *o)
+{
+	int v = o->nodelay;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+	stream_rearm(fd, o);
+}
+
+static int get_stream_listen(int port, const struct stream_opts *opts)
 {
 	const struct sockaddr_in6 sa = {
 		.sin6_family = AF_INET6,
@@ -37,7 +138,8 @@ static int get_stream_listen(int port)
 	int listen_fd;
 	int v;
 
-	listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+	listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			   0);
 	if (listen_fd == -1)
 		return -1;
 
@@ -48,6 +150,8 @@ static int get_stream_listen(int port)
 	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v)))
 		goto err;
 
+	set_rcvbuf(listen_fd, opts);
+
 	if (bind(listen_fd, (const struct sockaddr *)&sa, sizeof(sa)))
 		goto err;
 
@@ -61,48 +165,615 @@ err:
 	return -1;
 }
 
+/*
+ * The streaming server runs in its own thread, and multiplexes the listening
+ * socket, every client, and notifications of new frames from the producer
+ * through a single event loop (see evloop.c).
+ *
+ * Frames are refcounted and shared: each client's send queue just holds a
+ * reference to the same encoded buffer, so the cost of serving another client
+ * is the bytes written, not another copy. Sockets are non-blocking, and each
+ * client remembers how much of the frame at the head of its queue has gone out.
+ *
+ * Clients may ask for a cheaper view of the stream over the same connection
+ * (see struct wire_view). The producer encodes each distinct view once, and
+ * each frame is only queued to the clients which asked for its view.
+ */
+#define MAX_CLIENTS	STREAM_MAX_CLIENTS
+#define CLIENT_QUEUE	4
+#define PENDING		(2 * MAX_CLIENTS)
+
+struct client {
+	struct stream_server *s;
+	int fd;
+	size_t off;
+	unsigned head;
+	unsigned nr;
+	struct frame *queue[CLIENT_QUEUE];
+	bool want_out;
+
+	struct wire_view view;
+	struct wire_view staged;
+	unsigned ctl_len;
+	uint8_t ctl[WIRE_VIEW_MSG_LEN];
+};
+
+struct pending {
+	struct frame *f;
+	struct wire_view view;
+};
+
+struct stream_server {
+	int listen_fd;
+	int event_fd;
+	struct evloop *loop;
+	enum slow_client_policy policy;
+	struct stream_opts opts;
+	pthread_t thread;
+	atomic_bool closed;
+	atomic_int nr_clients;
+
+	pthread_mutex_t lock;
+	int nr_pending;
+	struct pending pending[PENDING];
+	bool in_use[MAX_CLIENTS];
+	struct wire_view views[MAX_CLIENTS];
+
+	struct client clients[MAX_CLIENTS];
+};
+
+static void client_close(struct stream_server *s, struct client *c)
+{
+	while (c->nr) {
+		frame_put(c->queue[c->head]);
+		c->head = (c->head + 1) % CLIENT_QUEUE;
+		c->nr--;
+	}
+
+	evloop_del(s->loop, c->fd);
+	close(c->fd);
+	c->fd = -1;
+	atomic_fetch_sub(&s->nr_clients, 1);
+
+	pthread_mutex_lock(&s->lock);
+	s->in_use[c - s->clients] = false;
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void client_event(void *arg, uint64_t events);
+
+static void client_accept(void *arg,
+			  __attribute__((unused)) uint64_t events)
+{
+	struct stream_server *s = arg;
+	struct client *c = NULL;
+	int fd, i;
+
+	fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (s->clients[i].fd == -1) {
+			c = &s->clients[i];
+			break;
+		}
+	}
+
+	if (!c) {
+		warnx("too many clients, rejecting");
+		close(fd);
+		return;
+	}
+
+	*c = (struct client){
+		.s = s,
+		.fd = fd,
+	};
+
+	set_stream_opts(fd, &s->opts);
+
+	pthread_mutex_lock(&s->lock);
+	s->in_use[i] = true;
+	s->views[i] = c->view;
+	pthread_mutex_unlock(&s->lock);
+
+	evloop_add(s->loop, fd, EPOLLIN, client_event, c);
+	atomic_fetch_add(&s->nr_clients, 1);
+}
+
+/*
+ * Write as much of the client's queue as the socket will take. Returns -1 if
+ * the client should be disconnected.
+ */
+static int client_flush(struct stream_server *s, struct client *c)
+{
+	bool want_out;
+
+	while (c->nr) {
+		struct frame *f = c->queue[c->head];
+		uint64_t start = lat_now();
+		ssize_t ret;
+
+		ret = send(c->fd, f->data + c->off, f->len - c->off,
+			   MSG_NOSIGNAL | MSG_DONTWAIT);
+		ctr_add(CTR_SEND_NS, lat_now() - start);
+		if (ret == -1) {
+			if (errno == EAGAIN)
+				break;
+
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		ctr_add(CTR_BYTES_SENT, ret);
+		c->off += ret;
+		if (c->off < f->len)
+			continue;
+
+		lat_record(LAT_SEND, f->ts_ns);
+		frame_put(f);
+		c->head = (c->head + 1) % CLIENT_QUEUE;
+		c->nr--;
+		c->off = 0;
+	}
+
+	/*
+	 * Only ask for EPOLLOUT while we have something to write, otherwise we
+	 * would spin on a client with an empty socket buffer.
+	 */
+	want_out = c->nr;
+	if (want_out != c->want_out) {
+		evloop_mod(s->loop, c->fd,
+			   EPOLLIN | (want_out ? EPOLLOUT : 0));
+		c->want_out = want_out;
+	}
+
+	return 0;
+}
+
+static int client_queue(struct stream_server *s, struct client *c,
+			struct frame *f)
+{
+	if (c->nr == CLIENT_QUEUE) {
+		if (s->policy == SLOW_CLIENT_DISCONNECT)
+			return -1;
+
+		/*
+		 * Every frame is a keyframe, so skipping ahead is just a matter
+		 * of throwing away everything queued behind the frame we're in
+		 * the middle of sending.
+		 */
+		while (c->nr > (c->off ? 1 : 0)) {
+			c->nr--;
+			frame_put(c->queue[(c->head + c->nr) % CLIENT_QUEUE]);
+		}
+	}
+
+	frame_get(f);
+	c->queue[(c->head + c->nr) % CLIENT_QUEUE] = f;
+	c->nr++;
+	return 0;
+}
+
+static void fan_out(void *arg, __attribute__((unused)) uint64_t events)
+{
+	struct stream_server *s = arg;
+	struct pending frames[PENDING];
+	uint64_t v;
+	int i, j, nr;
+
+	if (read(s->event_fd, &v, sizeof(v)) != sizeof(v) && errno != EAGAIN)
+		err(1, "bad eventfd read");
+
+	pthread_mutex_lock(&s->lock);
+	nr = s->nr_pending;
+	memcpy(frames, s->pending, nr * sizeof(frames[0]));
+	s->nr_pending = 0;
+	pthread_mutex_unlock(&s->lock);
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < MAX_CLIENTS; j++) {
+			struct client *c = &s->clients[j];
+
+			if (c->fd == -1 || memcmp(&c->view, &frames[i].view,
+						  sizeof(c->view)))
+				continue;
+
+			if (client_queue(s, c, frames[i].f)) {
+				warnx("disconnecting slow client");
+				client_close(s, c);
+			}
+		}
+
+		frame_put(frames[i].f);
+	}
+
+	for (j = 0; j < MAX_CLIENTS; j++) {
+		struct client *c = &s->clients[j];
+
+		if (c->fd != -1 && client_flush(s, c))
+			client_close(s, c);
+	}
+}
+
+/*
+ * Apply every complete control event the client has sent so far. A view only
+ * takes effect once the client commits it, and only then does the producer
+ * get to see it.
+ */
+static int client_ctl(struct stream_server *s, struct client *c)
+{
+	const unsigned len = sizeof(struct wire_ctl);
+	unsigned off;
+
+	for (off = 0; off + len <= c->ctl_len; off += len) {
+		struct wire_ctl ctl;
+		int ret;
+
+		memcpy(&ctl, c->ctl + off, len);
+		ret = wire_ctl_apply(&c->staged, &ctl);
+		if (ret == -1)
+			return -1;
+
+		if (ret == 1) {
+			c->view = c->staged;
+			pthread_mutex_lock(&s->lock);
+			s->views[c - s->clients] = c->view;
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+
+	c->ctl_len -= off;
+	memmove(c->ctl, c->ctl + off, c->ctl_len);
+	return 0;
+}
+
+/*
+ * The only thing clients ever send is control events: anything which isn't
+ * one gets them disconnected.
+ */
+static void client_event(void *arg, uint64_t events)
+{
+	struct client *c = arg;
+	struct stream_server *s = c->s;
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		client_close(s, c);
+		return;
+	}
+
+	if (events & EPOLLIN) {
+		ssize_t ret = recv(c->fd, c->ctl + c->ctl_len,
+				   sizeof(c->ctl) - c->ctl_len, MSG_DONTWAIT);
+
+		if (ret == 0 || (ret == -1 && errno != EAGAIN)) {
+			client_close(s, c);
+			return;
+		}
+
+		if (ret > 0) {
+			c->ctl_len += ret;
+			if (client_ctl(s, c)) {
+				warnx("bad control message from client");
+				client_close(s, c);
+				return;
+			}
+		}
+	}
+
+	if (events & EPOLLOUT && client_flush(s, c))
+		client_close(s, c);
+}
+
+static void *server_thread(void *arg)
+{
+	struct stream_server *s = arg;
+
+	while (!atomic_load(&s->closed))
+		evloop_run_once(s->loop, -1);
+
+	return NULL;
+}
+
 /**
- * get_stream_listen_one() - Listen and accept a single TCP connection.
+ * stream_server_start() - Start serving frames to TCP clients.
  * @param port TCP port to listen on.
+ * @param policy What to do when a client can't keep up.
+ * @param opts Tuning for every client connection.
  *
- * Create a TCP listener on the specified port, accept a single
- * connection, then immediately tear down the listener.
+ * Clients may connect and disconnect at any time.
  *
- * Return: File descriptor for the new connection.
+ * Return: Server handle.
  */
-int get_stream_listen_one(int port)
+struct stream_server *stream_server_start(int port,
+					  enum slow_client_policy policy,
+					  const struct stream_opts *opts)
 {
-	int fd, nfd;
+	struct stream_server *s;
+	sigset_t all, old;
+	int i;
 
-	fd = get_stream_listen(port);
-	if (fd == -1)
-		return -1;
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		errx(1, "can't allocate stream server");
 
-	nfd = accept(fd, NULL, NULL);
+	s->policy = policy;
+	s->opts = *opts;
+	atomic_init(&s->closed, false);
+	atomic_init(&s->nr_clients, 0);
+	pthread_mutex_init(&s->lock, NULL);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		s->clients[i].fd = -1;
 
-	close(fd);
-	return nfd;
+	s->listen_fd = get_stream_listen(port, opts);
+	if (s->listen_fd == -1)
+		err(1, "can't listen on port %d", port);
+
+	s->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->event_fd == -1)
+		err(1, "eventfd");
+
+	s->loop = evloop_new();
+	evloop_add(s->loop, s->listen_fd, EPOLLIN, client_accept, s);
+	evloop_add(s->loop, s->event_fd, EPOLLIN, fan_out, s);
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&s->thread, NULL, server_thread, s))
+		errx(1, "can't start server thread");
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return s;
+}
+
+/**
+ * stream_server_clients() - Count the connected clients.
+ * @param s Server handle.
+ *
+ * Return: Number of clients connected right now.
+ */
+int stream_server_clients(const struct stream_server *s)
+{
+	return atomic_load_explicit(&s->nr_clients, memory_order_relaxed);
+}
+
+/**
+ * stream_server_views() - List the views the connected clients want.
+ * @param s Server handle.
+ * @param views Output array of distinct views.
+ * @param max Size of the array, STREAM_MAX_CLIENTS is always enough.
+ *
+ * Clients which never asked for anything want the all-zeroes full view.
+ *
+ * Return: Number of views written to the array.
+ */
+int stream_server_views(struct stream_server *s, struct wire_view *views,
+			int max)
+{
+	int i, j, nr = 0;
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < MAX_CLIENTS && nr < max; i++) {
+		if (!s->in_use[i])
+			continue;
+
+		for (j = 0; j < nr; j++)
+			if (!memcmp(&views[j], &s->views[i], sizeof(views[j])))
+				break;
+
+		if (j == nr)
+			views[nr++] = s->views[i];
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return nr;
+}
+
+/**
+ * stream_server_send() - Queue a frame for every client wanting its view.
+ * @param s Server handle.
+ * @param f Frame holding the exact bytes to send, which the server takes a
+ *	    new reference to.
+ * @param v View the frame was encoded with, see stream_server_views().
+ *
+ * This never blocks: if the server thread falls behind, the oldest frame not
+ * yet queued to the clients is dropped.
+ *
+ * Return: Nothing.
+ */
+void stream_server_send(struct stream_server *s, struct frame *f,
+			const struct wire_view *v)
+{
+	const uint64_t one = 1;
+	struct frame *old = NULL;
+
+	frame_get(f);
+
+	pthread_mutex_lock(&s->lock);
+	if (s->nr_pending == PENDING) {
+		old = s->pending[0].f;
+		memmove(s->pending, s->pending + 1,
+			(PENDING - 1) * sizeof(s->pending[0]));
+		s->nr_pending--;
+	}
+
+	s->pending[s->nr_pending++] = (struct pending){
+		.f = f,
+		.view = *v,
+	};
+	pthread_mutex_unlock(&s->lock);
+
+	if (old)
+		frame_put(old);
+
+	if (write(s->event_fd, &one, sizeof(one)) != sizeof(one))
+		err(1, "bad eventfd write");
+}
+
+/**
+ * stream_server_stop() - Disconnect every client and stop the server.
+ * @param s Server handle.
+ *
+ * Frames still queued are dropped, and all references to them released.
+ *
+ * Return: Nothing.
+ */
+void stream_server_stop(struct stream_server *s)
+{
+	const uint64_t one = 1;
+	int i;
+
+	atomic_store(&s->closed, true);
+	if (write(s->event_fd, &one, sizeof(one)) != sizeof(one))
+		err(1, "bad eventfd write");
+
+	pthread_join(s->thread, NULL);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (s->clients[i].fd != -1)
+			client_close(s, &s->clients[i]);
+
+	for (i = 0; i < s->nr_pending; i++)
+		frame_put(s->pending[i].f);
+
+	evloop_free(s->loop);
+	close(s->event_fd);
+	close(s->listen_fd);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
 }
 
 /**
  * get_stream_connect() - Connect to a remote TCP server.
  * @param s sockaddr_in6 specifying the address/port to connect to.
+ * @param opts Tuning for the connection.
  *
  * Return: File descriptor for the new connection.
  */
-int get_stream_connect(const struct sockaddr_in6 *s)
+int get_stream_connect(const struct sockaddr_in6 *s,
+		       const struct stream_opts *opts)
 {
 	int fd;
 
-	fd = socket(AF_INET6, SOCK_STREAM, 0);
+	fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (fd == -1)
 		return fd;
 
+	set_rcvbuf(fd, opts);
 	if (connect(fd, (const struct sockaddr *)s, sizeof(*s)))
 		goto err;
 
+	set_stream_opts(fd, opts);
 	return fd;
 err:
 	close(fd);
 	return -1;
 }
+
+/**
+ * get_dgram_connect() - Get a UDP socket for sending to a remote address.
+ * @param dst Unicast or multicast address and port to send to.
+ *
+ * Return: File descriptor of the connected socket.
+ */
+int get_dgram_connect(const struct sockaddr_in6 *dst)
+{
+	int fd, v;
+
+	fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		err(1, "can't get dgram socket");
+
+	/*
+	 * A whole frame goes out in one burst: make room for it.
+	 */
+	v = DGRAM_BUFSIZE;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &v, sizeof(v));
+
+	if (connect(fd, (const struct sockaddr *)dst, sizeof(*dst)))
+		err(1, "can't connect");
+
+	return fd;
+}
+
+static bool is_v4_multicast(const struct in6_addr *a)
+{
+	return IN6_IS_ADDR_V4MAPPED(a) && (a->s6_addr[12] & 0xF0) == 0xE0;
+}
+
+/**
+ * get_dgram_listen() - Get a UDP socket for receiving.
+ * @param src Multicast group to join, or local address to bind, and port.
+ *
+ * IPv4 multicast groups (as v4-mapped addresses) get an AF_INET socket, since
+ * the group must be joined at the IPv4 level. Everything else is dual stack.
+ *
+ * Return: File descriptor of the bound socket.
+ */
+int get_dgram_listen(const struct sockaddr_in6 *src)
+{
+	int fd, v;
+
+	if (is_v4_multicast(&src->sin6_addr)) {
+		struct sockaddr_in sa = {
+			.sin_family = AF_INET,
+			.sin_port = src->sin6_port,
+			.sin_addr.s_addr = htonl(INADDR_ANY),
+		};
+		struct ip_mreqn mreq = { 0 };
+
+		memcpy(&mreq.imr_multiaddr, &src->sin6_addr.s6_addr[12], 4);
+
+		fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			err(1, "can't get dgram socket");
+
+		v = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v));
+
+		if (bind(fd, (const struct sockaddr *)&sa, sizeof(sa)))
+			err(1, "can't bind dgram socket");
+
+		if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+			       sizeof(mreq)))
+			err(1, "can't join multicast group");
+	} else {
+		struct sockaddr_in6 sa = *src;
+		struct ipv6_mreq mreq = {
+			.ipv6mr_multiaddr = src->sin6_addr,
+		};
+		bool mcast = IN6_IS_ADDR_MULTICAST(&src->sin6_addr);
+
+		if (mcast || (IN6_IS_ADDR_V4MAPPED(&src->sin6_addr) &&
+			      !src->sin6_addr.s6_addr32[3]))
+			sa.sin6_addr = in6addr_any;
+
+		fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			err(1, "can't get dgram socket");
+
+		v = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v, sizeof(v));
+
+		v = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v));
+
+		if (bind(fd, (const struct sockaddr *)&sa, sizeof(sa)))
+			err(1, "can't bind dgram socket");
+
+		if (mcast && setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+					&mreq, sizeof(mreq)))
+			err(1, "can't join multicast group");
+	}
+
+	v = DGRAM_BUFSIZE;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &v, sizeof(v));
+	return fd;
+}
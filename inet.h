@@ -1,8 +1,58 @@
 #pragma once
 
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-int get_stream_listen_one(int port);
+#include "pipeline.h"
+#include "wire.h"
 
-int get_stream_connect(const struct sockaddr_in6 *s);
+/*
+ * What the server does with a client whose send queue is full.
+ */
+enum slow_client_policy {
+	SLOW_CLIENT_SKIP,
+	SLOW_CLIENT_DISCONNECT,
+};
+
+/*
+ * Tuning applied to every TCP connection, on both ends. A zero rcvbuf leaves
+ * the kernel's autotuning alone.
+ */
+struct stream_opts {
+	int rcvbuf;
+	bool nodelay;
+	bool quickack;
+};
+
+void stream_parse_opts(struct stream_opts *o, const char *spec);
+
+void stream_rearm(int fd, const struct stream_opts *o);
+
+/*
+ * The most clients one stream server will serve at once.
+ */
+#define STREAM_MAX_CLIENTS 16
+
+struct stream_server;
+
+struct stream_server *stream_server_start(int port,
+					  enum slow_client_policy policy,
+					  const struct stream_opts *opts);
+
+int stream_server_clients(const struct stream_server *s);
+
+int stream_server_views(struct stream_server *s, struct wire_view *views,
+			int max);
+
+void stream_server_send(struct stream_server *s, struct frame *f,
+			const struct wire_view *v);
+
+void stream_server_stop(struct stream_server *s);
+
+int get_stream_connect(const struct sockaddr_in6 *s,
+		       const struct stream_opts *opts);
+
+int get_dgram_connect(const struct sockaddr_in6 *dst);
+
+int get_dgram_listen(const struct sockaddr_in6 *src);
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <err.h>
+
+/*
+ * Log-linear histogram: each power of two is split into SUB_BUCKETS linear
+ * buckets, so every reported value is within 12.5% of the truth. Values below
+ * SUB_BUCKETS are exact. 256 buckets reach past 2^32us, which is more than an
+ * hour.
+ */
+#define SUB_BITS	3
+#define SUB_BUCKETS	(1 << SUB_BITS)
+#define NR_BUCKETS	256
+
+struct lat_hist {
+	atomic_uint buckets[NR_BUCKETS];
+	atomic_uint count;
+	atomic_uint max;
+};
+
+static struct lat_hist hists[NR_LAT_STAGES];
+
+static const char *const stage_names[NR_LAT_STAGES] = {
+	[LAT_STATS] = "stats",
+	[LAT_COLORIZE] = "colorize",
+	[LAT_ENCODE] = "encode",
+	[LAT_SEND] = "send",
+	[LAT_PRESENT] = "present",
+};
+
+static unsigned bucket_of(uint32_t us)
+{
+	int e;
+
+	if (us < SUB_BUCKETS)
+		return us;
+
+	e = 31 - __builtin_clz(us) - SUB_BITS;
+	return e * SUB_BUCKETS + (us >> e);
+}
+
+/*
+ * Highest value which falls in a bucket.
+ */
+static unsigned bucket_max(unsigned idx)
+{
+	unsigned e, m;
+
+	if (idx < SUB_BUCKETS * 2)
+		return idx;
+
+	e = idx / SUB_BUCKETS - 1;
+	m = idx - e * SUB_BUCKETS;
+	return ((m + 1) << e) - 1;
+}
+
+/**
+ * lat_now() - Get the current time on the clock V4L2 stamps frames with.
+ *
+ * Return: CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t lat_now(void)
+{
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t))
+		err(1, "Bad clock_gettime");
+
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/**
+ * lat_stage_name() - Get the name of a pipeline stage.
+ * @param stage Pipeline stage.
+ *
+ * Return: Name of the stage.
+ */
+const char *lat_stage_name(enum lat_stage stage)
+{
+	return stage_names[stage];
+}
+
+/**
+ * lat_record() - Record how stale a frame is at some point in the pipeline.
+ * @param stage Pipeline stage which just finished with the frame.
+ * @param capture_ns Capture time of the frame (see lat_now()), or zero if it
+ *		     is unknown, in which case nothing is recorded.
+ *
+ * This may be called from any thread.
+ *
+ * Return: Nothing.
+ */
+void lat_record(enum lat_stage stage, uint64_t capture_ns)
+{
+	struct lat_hist *h = &hists[stage];
+	uint64_t now, delta;
+	unsigned max;
+	uint32_t us;
+
+	if (!capture_ns)
+		return;
+
+	now = lat_now();
+	delta = now > capture_ns ? (now - capture_ns) / 1000 : 0;
+	us = delta > UINT32_MAX ? UINT32_MAX : delta;
+
+	atomic_fetch_add_explicit(&h->buckets[bucket_of(us)], 1,
+				  memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (us > max && !atomic_compare_exchange_weak_explicit(
+				   &h->max, &max, us, memory_order_relaxed,
+				   memory_order_relaxed))
+		;
+}
+
+/**
+ * lat_summary() - Summarize the latency histogram for a pipeline stage.
+ * @param stage Pipeline stage.
+ * @param s Output summary, in microseconds.
+ *
+ * Return: Nothing.
+ */
+void lat_summary(enum lat_stage stage, struct lat_summary *s)
+{
+	struct lat_hist *h = &hists[stage];
+	unsigned seen = 0;
+	int i;
+
+	*s = (struct lat_summary){
+		.count = atomic_load_explicit(&h->count, memory_order_relaxed),
+		.max = atomic_load_explicit(&h->max, memory_order_relaxed),
+	};
+
+	if (!s->count)
+		return;
+
+	/*
+	 * Samples may land while we walk the buckets, so the counts need not
+	 * add up exactly: that doesn't matter for a percentile.
+	 */
+	for (i = 0; i < NR_BUCKETS; i++) {
+		seen += atomic_load_explicit(&h->buckets[i],
+					     memory_order_relaxed);
+
+		if (!s->p50 && seen * 2ULL >= s->count)
+			s->p50 = bucket_max(i);
+
+		if (seen * 100ULL >= s->count * 99ULL) {
+			s->p99 = bucket_max(i);
+			break;
+		}
+	}
+
+	if (s->p50 > s->max)
+		s->p50 = s->max;
+
+	if (s->p99 > s->max)
+		s->p99 = s->max;
+}
+
+/**
+ * lat_dump() - Print a table of latencies for every pipeline stage.
+ * @param out Stream to print to.
+ *
+ * Nothing is printed if no latencies have been recorded.
+ *
+ * Return: Nothing.
+ */
+void lat_dump(FILE *out)
+{
+	struct lat_summary s;
+	bool header = false;
+	int i;
+
+	for (i = 0; i < NR_LAT_STAGES; i++) {
+		lat_summary(i, &s);
+		if (!s.count)
+			continue;
+
+		if (!header) {
+			fprintf(out, "%-10s %10s %10s %10s %10s\n", "latency",
+				"frames", "p50(us)", "p99(us)", "max(us)");
+			header = true;
+		}
+
+		fprintf(out, "%-10s %10u %10u %10u %10u\n", stage_names[i],
+			s.count, s.p50, s.p99, s.max);
+	}
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Points in the pipeline where we measure how long ago the frame being
+ * processed was captured by the camera.
+ */
+enum lat_stage {
+	LAT_STATS,
+	LAT_COLORIZE,
+	LAT_ENCODE,
+	LAT_SEND,
+	LAT_PRESENT,
+	NR_LAT_STAGES,
+};
+
+/*
+ * Latencies are in microseconds.
+ */
+struct lat_summary {
+	unsigned count;
+	unsigned p50;
+	unsigned p99;
+	unsigned max;
+};
+
+uint64_t lat_now(void);
+
+const char *lat_stage_name(enum lat_stage stage);
+
+void lat_record(enum lat_stage stage, uint64_t capture_ns);
+
+void lat_summary(enum lat_stage stage, struct lat_summary *s);
+
+void lat_dump(FILE *out);
@@ -19,17 +19,42 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <errno.h>
 #include <time.h>
 #include <err.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/timestamp.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+
+#include "counters.h"
+#include "writer.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+/*
+ * Output goes through this much buffering in libavformat on its way to the
+ * writer thread (see writer.c).
+ */
+#define AVIO_BUFSIZE (64 << 10)
+
+/*
+ * The buffer passed to AVIO write callbacks only became const in lavf 61.
+ */
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+typedef uint8_t avio_buf_t;
+#else
+typedef const uint8_t avio_buf_t;
+#endif
 
 struct lavc_ctx {
 	AVPacket *pkt;
@@ -39,10 +64,378 @@ struct lavc_ctx {
 	AVFormatContext *fctx;
 	AVCodecContext *ctx;
 	AVFrame *frame;
-	int pts_mult;
-	bool queued;
+	AVFrame *ref_frame;
+	AVFrame *hw_frame;
+	int sw_fmt;
+	struct writer *writer;
+	int frame_ms;
+	struct index_entry *index;
+	int nr_frames;
+	int next_frame;
+	int seek_frame;
+	int skip_to;
+};
+
+/*
+ * One entry per frame in a file being decoded, in packet order.
+ */
+struct index_entry {
+	int64_t pts;
+	uint32_t key;
+	uint32_t unused;
+};
+
+/*
+ * The header of the sidecar file an index is saved in, so it need only be
+ * built the first time a file is played. It's only valid while the size and
+ * modification time of the file match.
+ */
+struct index_hdr {
+	char magic[8];
+	int64_t size;
+	int64_t mtime_ns;
+	uint32_t stream;
+	uint32_t nr;
 };
 
+static const char index_magic[8] = "IRCAMIX1";
+
+/*
+ * Named starting points for lavc_parse_enc_opts(). "fast" uses the cheapest
+ * entropy coder, "small" spends CPU on a better model and longer GOPs.
+ */
+static const struct {
+	const char *name;
+	struct lavc_enc_opts opts;
+} enc_profiles[] = {
+	{
+		.name = "default",
+		.opts = { .threads = 1, .level = -1, .slices = -1,
+			  .context = -1, .gop = -1 },
+	},
+	{
+		.name = "fast",
+		.opts = { .threads = 0, .level = 3, .slices = -1,
+			  .coder = "rice", .context = 0, .gop = 1 },
+	},
+	{
+		.name = "small",
+		.opts = { .threads = 0, .level = 3, .slices = -1,
+			  .coder = "range_tab", .context = 1, .gop = 300 },
+	},
+	{
+		.name = "hw",
+		.opts = { .threads = 0, .level = -1, .slices = -1,
+			  .context = -1, .gop = 50, .hw = true,
+			  .bitrate = 4000 },
+	},
+};
+
+/*
+ * Encoders tried in order by the "hw" profile: the Raspberry Pi's, NVIDIA's,
+ * and Intel or AMD's through VAAPI. The last is the software fallback.
+ */
+static const char *const hw_encoders[] = {
+	"h264_v4l2m2m",
+	"h264_nvenc",
+	"h264_vaapi",
+	"libx264",
+};
+
+static const char *const enc_coders[] = { "rice", "range_def", "range_tab" };
+
+static int parse_enc_int(const char *key, const char *val, int min, int max)
+{
+	char *end;
+	long v;
+
+	v = strtol(val, &end, 10);
+	if (*end || end == val || v < min || v > max)
+		errx(1, "bad encoder %s '%s' (%d-%d)", key, val, min, max);
+
+	return v;
+}
+
+/**
+ * lavc_parse_enc_opts() - Parse an encoder tuning specification.
+ * @param o Options to update.
+ * @param spec Comma separated list of a profile name and/or key=value pairs.
+ *
+ * The profiles are "default", "fast", "small", and "hw". The keys are
+ * "threads", "level", "slices", "coder" (rice, range_def, or range_tab),
+ * "context" (0 or 1), and "gop". For example: "fast,threads=2" or
+ * "coder=rice,gop=25".
+ *
+ * The "codec" key names any other libavcodec encoder to use instead of FFV1,
+ * which must accept the pixel format being recorded. Only "threads", "gop",
+ * and "bitrate" (in kbit/s) apply to other encoders.
+ *
+ * The "hw" profile records NV12 instead of BGRA, through the first hardware
+ * H.264 encoder which works on this machine, falling back to libx264. With
+ * "codec", only that encoder is tried.
+ *
+ * The "segment" key is read by the recorder rather than the encoder: it rolls
+ * recordings over to a new file every so many minutes (see record.c).
+ *
+ * Exits on error.
+ *
+ * Return: Nothing.
+ */
+void lavc_parse_enc_opts(struct lavc_enc_opts *o, const char *spec)
+{
+	char *tmp, *tok, *save;
+	unsigned i;
+
+	tmp = strdup(spec);
+	if (!tmp)
+		errx(1, "no memory for encoder options");
+
+	for (tok = strtok_r(tmp, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+
+		if (!val) {
+			for (i = 0; i < ARRAY_SIZE(enc_profiles); i++)
+				if (!strcmp(tok, enc_profiles[i].name))
+					break;
+
+			if (i == ARRAY_SIZE(enc_profiles))
+				errx(1, "unknown encoder profile '%s'", tok);
+
+			*o = enc_profiles[i].opts;
+			continue;
+		}
+
+		*val++ = '\0';
+		if (!strcmp(tok, "threads")) {
+			o->threads = parse_enc_int(tok, val, 0, 64);
+		} else if (!strcmp(tok, "level")) {
+			o->level = parse_enc_int(tok, val, 0, 3);
+		} else if (!strcmp(tok, "slices")) {
+			o->slices = parse_enc_int(tok, val, 1, 1024);
+		} else if (!strcmp(tok, "context")) {
+			o->context = parse_enc_int(tok, val, 0, 1);
+		} else if (!strcmp(tok, "gop")) {
+			o->gop = parse_enc_int(tok, val, 1, 10000);
+		} else if (!strcmp(tok, "segment")) {
+			o->segment = parse_enc_int(tok, val, 0, 1440);
+		} else if (!strcmp(tok, "bitrate")) {
+			o->bitrate = parse_enc_int(tok, val, 1, 1000000);
+		} else if (!strcmp(tok, "codec")) {
+			const AVCodec *codec;
+
+			/*
+			 * The name belongs to libavcodec, so nothing needs to
+			 * be freed when the options are.
+			 */
+			codec = avcodec_find_encoder_by_name(val);
+			if (!codec)
+				errx(1, "unknown encoder '%s'", val);
+
+			o->codec = codec->name;
+		} else if (!strcmp(tok, "coder")) {
+			for (i = 0; i < ARRAY_SIZE(enc_coders); i++)
+				if (!strcmp(val, enc_coders[i]))
+					break;
+
+			if (i == ARRAY_SIZE(enc_coders))
+				errx(1, "unknown FFV1 coder '%s'", val);
+
+			o->coder = enc_coders[i];
+		} else {
+			errx(1, "unknown encoder option '%s'", tok);
+		}
+	}
+
+	/*
+	 * FFV1 can only split frames into slices, and thus only use more than
+	 * one thread, at level 3.
+	 */
+	if ((o->threads != 1 || o->slices > 1) && o->level < 3)
+		o->level = 3;
+
+	free(tmp);
+}
+
+static void apply_enc_opts(AVCodecContext *ctx, AVDictionary **dict,
+			   const struct lavc_enc_opts *o)
+{
+	ctx->thread_count = o->threads;
+	ctx->thread_type = FF_THREAD_SLICE;
+
+	if (o->gop > 0)
+		ctx->gop_size = o->gop;
+
+	/*
+	 * B-frames only add latency, and not every hardware encoder can make
+	 * them. The NV12 comes from palette_colorize_nv12().
+	 */
+	if (o->hw) {
+		ctx->max_b_frames = 0;
+		ctx->colorspace = AVCOL_SPC_SMPTE170M;
+		ctx->color_range = AVCOL_RANGE_MPEG;
+	}
+
+	if (ctx->codec_id != AV_CODEC_ID_FFV1) {
+		if (o->bitrate > 0)
+			ctx->bit_rate = o->bitrate * 1000LL;
+
+		return;
+	}
+
+	if (o->level >= 0)
+		ctx->level = o->level;
+
+	if (o->slices > 0)
+		ctx->slices = o->slices;
+
+	if (o->coder)
+		av_dict_set(dict, "coder", o->coder, 0);
+
+	if (o->context >= 0)
+		av_dict_set_int(dict, "context", o->context, 0);
+}
+
+static int avio_write_cb(void *opaque, avio_buf_t *buf, int len)
+{
+	writer_write(opaque, buf, len);
+	return len;
+}
+
+static int64_t avio_seek_cb(void *opaque, int64_t off, int whence)
+{
+	if (whence & AVSEEK_SIZE)
+		return writer_size(opaque);
+
+	return writer_seek(opaque, off, whence & ~AVSEEK_FORCE);
+}
+
+/*
+ * Recordings are written by their own thread, so storage stalls never hold up
+ * the encoder, or the capture loop it might be running in.
+ */
+static void open_writer(struct lavc_ctx *c, const char *path)
+{
+	uint8_t *buf;
+
+	buf = av_malloc(AVIO_BUFSIZE);
+	if (!buf)
+		errx(1, "can't allocate AVIO buffer");
+
+	c->writer = writer_open(path);
+	c->fctx->pb = avio_alloc_context(buf, AVIO_BUFSIZE, 1, c->writer, NULL,
+					 avio_write_cb, avio_seek_cb);
+	if (!c->fctx->pb)
+		errx(1, "can't allocate AVIO context");
+}
+
+static bool try_encoder(struct lavc_ctx *c, const AVCodec *codec, int width,
+			int height, int fps, int pix_fmt,
+			AVBufferRef *hw_frames,
+			const struct lavc_enc_opts *opts)
+{
+	AVDictionary *dict = NULL;
+	AVCodecContext *ctx;
+	int r;
+
+	ctx = avcodec_alloc_context3(codec);
+	if (!ctx)
+		errx(1, "can't allocate video context");
+
+	ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+	ctx->codec_id = codec->id;
+	ctx->width = width;
+	ctx->height = height;
+	ctx->time_base = (AVRational){ 1, 1000 };
+	ctx->framerate = (AVRational){ fps, 1 };
+	ctx->pix_fmt = pix_fmt;
+
+	if (c->fmt->flags & AVFMT_GLOBALHEADER)
+		ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if (hw_frames) {
+		ctx->hw_frames_ctx = av_buffer_ref(hw_frames);
+		if (!ctx->hw_frames_ctx)
+			errx(1, "can't reference hardware frames");
+	}
+
+	if (opts)
+		apply_enc_opts(ctx, &dict, opts);
+
+	r = avcodec_open2(ctx, codec, &dict);
+	av_dict_free(&dict);
+	if (r) {
+		avcodec_free_context(&ctx);
+		return false;
+	}
+
+	c->codec = codec;
+	c->ctx = ctx;
+	return true;
+}
+
+/*
+ * Encoders like VAAPI only take frames which are already in device memory:
+ * failing a plain open, each frame is uploaded from system memory instead (see
+ * encode_send()). Failing to open a device is not an error, the machine might
+ * simply not have one.
+ */
+static bool open_encoder(struct lavc_ctx *c, const char *name, int width,
+			 int height, int fps, int pix_fmt,
+			 const struct lavc_enc_opts *opts)
+{
+	const AVCodecHWConfig *cfg;
+	AVHWFramesContext *fc;
+	const AVCodec *codec;
+	AVBufferRef *dev, *frames;
+	bool ok;
+	int i;
+
+	codec = avcodec_find_encoder_by_name(name);
+	if (!codec)
+		return false;
+
+	if (try_encoder(c, codec, width, height, fps, pix_fmt, NULL, opts))
+		return true;
+
+	for (i = 0; (cfg = avcodec_get_hw_config(codec, i)); i++) {
+		if (!(cfg->methods & AV_CODEC_HW_CONFIG_METHOD_HW_FRAMES_CTX))
+			continue;
+
+		if (av_hwdevice_ctx_create(&dev, cfg->device_type, NULL, NULL,
+					   0))
+			continue;
+
+		frames = av_hwframe_ctx_alloc(dev);
+		av_buffer_unref(&dev);
+		if (!frames)
+			errx(1, "can't allocate hardware frames");
+
+		fc = (AVHWFramesContext *)frames->data;
+		fc->format = cfg->pix_fmt;
+		fc->sw_format = pix_fmt;
+		fc->width = width;
+		fc->height = height;
+		fc->initial_pool_size = 8;
+
+		ok = !av_hwframe_ctx_init(frames) &&
+		     try_encoder(c, codec, width, height, fps, cfg->pix_fmt,
+				 frames, opts);
+
+		av_buffer_unref(&frames);
+		if (!ok)
+			continue;
+
+		c->hw_frame = av_frame_alloc();
+		if (!c->hw_frame)
+			errx(1, "can't allocate video frame");
+
+		return true;
+	}
+
+	return false;
+}
+
 /**
  * lavc_start_encode() - Initialize a handle for encoding a raw video
  *			 stream to a file.
@@ -52,16 +445,22 @@ struct lavc_ctx {
  * @param height Height of video frame.
  * @param fps Framerate in frames per second.
  * @param pix_fmt FFMPEG pixel format code.
+ * @param opts Encoder tuning, or NULL for the libavcodec defaults.
  *
  * Note that the FFMPEG pixel format codes are differnt than the V4L2
  * codes!
  *
+ * With opts->hw set and no codec named, each of hw_encoders[] is tried in
+ * order until one opens.
+ *
  * Return: Handle for stream.
  */
 struct lavc_ctx *lavc_start_encode(const char *path, int width, int height,
-				   int fps, int pix_fmt)
+				   int fps, int pix_fmt,
+				   const struct lavc_enc_opts *opts)
 {
 	struct lavc_ctx *c;
+	unsigned i;
 
 	c = calloc(1, sizeof(*c));
 	if (!c)
@@ -81,31 +480,33 @@ struct lavc_ctx *lavc_start_encode(const char *path, int width, int height,
 	if (!c->pkt)
 		errx(1, "can't allocate video packet");
 
-	c->codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
-	if (!c->codec)
-		errx(1, "can't find FFV1 codec");
+	if (opts && opts->hw && !opts->codec) {
+		for (i = 0; i < ARRAY_SIZE(hw_encoders); i++)
+			if (open_encoder(c, hw_encoders[i], width, height, fps,
+					 pix_fmt, opts))
+				break;
 
-	c->ctx = avcodec_alloc_context3(c->codec);
-	if (!c->ctx)
-		errx(1, "can't allocate video context");
+		if (i == ARRAY_SIZE(hw_encoders))
+			errx(1, "can't open any H.264 encoder");
 
-	c->ctx->codec_type = AVMEDIA_TYPE_VIDEO;
-	c->ctx->codec_id = AV_CODEC_ID_FFV1;
-	c->ctx->width = width;
-	c->ctx->height = height;
-	c->ctx->time_base = (AVRational){ 1, 1000 };
-	c->ctx->framerate = (AVRational){ fps, 1 };
-	c->ctx->pix_fmt = pix_fmt;
-	c->pts_mult = 1000 / fps;
+		if (i == ARRAY_SIZE(hw_encoders) - 1)
+			warnx("no hardware H.264 encoder, using %s",
+			      c->codec->name);
+	} else {
+		const char *name = opts && opts->codec ? opts->codec : "ffv1";
 
-	if (avcodec_open2(c->ctx, c->codec, NULL))
-		errx(1, "can't open codec");
+		if (!open_encoder(c, name, width, height, fps, pix_fmt, opts))
+			errx(1, "can't open %s encoder", name);
+	}
+
+	c->sw_fmt = pix_fmt;
+	c->frame_ms = 1000 / fps;
 
 	c->frame = av_frame_alloc();
 	if (!c->frame)
 		errx(1, "can't allocate video frame");
 
-	c->frame->format = c->ctx->pix_fmt;
+	c->frame->format = pix_fmt;
 	c->frame->width = width;
 	c->frame->height = height;
 
@@ -116,8 +517,7 @@ struct lavc_ctx *lavc_start_encode(const char *path, int width, int height,
 		errx(1, "can't copy codec parameters");
 
 	if (!(c->fmt->flags & AVFMT_NOFILE))
-		if (avio_open(&c->fctx->pb, path, AVIO_FLAG_WRITE) < 0)
-			err(1, "can't open record file");
+		open_writer(c, path);
 
 	if (avformat_write_header(c->fctx, NULL) < 0)
 		errx(1, "can't write header");
@@ -125,28 +525,25 @@ struct lavc_ctx *lavc_start_encode(const char *path, int width, int height,
 	return c;
 }
 
-/**
- * lavc_encode() - Push a framebuffer to the encoder.
- * @param c LAVC context handle.
- * @param pts PTS value for frame.
- * @param data Pointer to raw framebuffer.
- * @param len Length of framebuffer data.
- *
- * Return: 0 on success, non-zero on error.
- */
-int lavc_encode(struct lavc_ctx *c, uint32_t pts, const uint8_t *data, int len)
+static int encode_send(struct lavc_ctx *c, uint32_t pts, AVFrame *frame)
 {
+	bool upload = frame && c->hw_frame;
 	int r;
 
-	if (data) {
-		if (av_frame_make_writable(c->frame))
-			errx(1, "can't make frame writable");
+	if (upload) {
+		if (av_hwframe_get_buffer(c->ctx->hw_frames_ctx, c->hw_frame,
+					  0) ||
+		    av_hwframe_transfer_data(c->hw_frame, frame, 0))
+			errx(1, "can't upload frame to %s", c->codec->name);
 
-		c->frame->pts = pts * c->pts_mult;
-		memcpy(c->frame->data[0], data, len);
+		c->hw_frame->pts = frame->pts;
+		frame = c->hw_frame;
 	}
 
-	r = avcodec_send_frame(c->ctx, data ? c->frame : NULL);
+	r = avcodec_send_frame(c->ctx, frame);
+	if (upload)
+		av_frame_unref(c->hw_frame);
+
 	if (r < 0)
 		errx(1, "can't send frame for encoding");
 
@@ -163,9 +560,17 @@ int lavc_encode(struct lavc_ctx *c, uint32_t pts, const uint8_t *data, int len)
 			}
 		}
 
-		c->pkt->pts = pts * c->pts_mult;
-		c->pkt->dts = pts * c->pts_mult;
-		c->pkt->duration = c->pts_mult;
+		/*
+		 * Encoders with a delay, like H.264, return packets later than
+		 * the frames they came from, with the right timestamps.
+		 */
+		if (!(c->codec->capabilities & AV_CODEC_CAP_DELAY)) {
+			c->pkt->pts = pts;
+			c->pkt->dts = pts;
+		}
+
+		c->pkt->duration = c->frame_ms;
+		ctr_add(CTR_BYTES_WRITTEN, c->pkt->size);
 		if (av_interleaved_write_frame(c->fctx, c->pkt) < 0)
 			errx(1, "can't write encoded data");
 	}
@@ -173,6 +578,96 @@ int lavc_encode(struct lavc_ctx *c, uint32_t pts, const uint8_t *data, int len)
 	return r;
 }
 
+/**
+ * lavc_encode() - Push a framebuffer to the encoder.
+ * @param c LAVC context handle.
+ * @param pts PTS value for frame, in milliseconds.
+ * @param data Pointer to raw framebuffer.
+ * @param len Length of framebuffer data.
+ *
+ * Return: 0 on success, non-zero on error.
+ */
+int lavc_encode(struct lavc_ctx *c, uint32_t pts, const uint8_t *data, int len)
+{
+	if (data) {
+		if (av_frame_make_writable(c->frame))
+			errx(1, "can't make frame writable");
+
+		c->frame->pts = pts;
+		if (av_pix_fmt_count_planes(c->sw_fmt) == 1) {
+			memcpy(c->frame->data[0], data, len);
+		} else {
+			uint8_t *planes[4];
+			int linesizes[4];
+
+			av_image_fill_arrays(planes, linesizes, data,
+					     c->sw_fmt, c->frame->width,
+					     c->frame->height, 1);
+			av_image_copy(c->frame->data, c->frame->linesize,
+				      (const uint8_t **)planes, linesizes,
+				      c->sw_fmt, c->frame->width,
+				      c->frame->height);
+		}
+	}
+
+	return encode_send(c, pts, data ? c->frame : NULL);
+}
+
+/**
+ * lavc_encode_ref() - Push a framebuffer to the encoder without copying it.
+ * @param c LAVC context handle.
+ * @param pts PTS value for frame, in milliseconds.
+ * @param data Pointer to raw framebuffer.
+ * @param len Length of framebuffer data.
+ * @param release Called with opaque and data once the encoder is done.
+ * @param opaque Argument for release.
+ *
+ * The framebuffer is handed to libavcodec as-is, and must remain valid and
+ * unmodified until release() is called. That may happen before this returns,
+ * or later from whatever thread drops the encoder's last reference. If this
+ * fails, release() is never called.
+ *
+ * Return: 0 on success, non-zero on error.
+ */
+int lavc_encode_ref(struct lavc_ctx *c, uint32_t pts, const uint8_t *data,
+		    int len, void (*release)(void *opaque, uint8_t *data),
+		    void *opaque)
+{
+	AVBufferRef *ref;
+	int r;
+
+	if (!c->ref_frame) {
+		c->ref_frame = av_frame_alloc();
+		if (!c->ref_frame)
+			errx(1, "can't allocate video frame");
+	}
+
+	/*
+	 * The encoder only reads the frame, the cast is safe.
+	 */
+	ref = av_buffer_create((uint8_t *)data, len, release, opaque,
+			       AV_BUFFER_FLAG_READONLY);
+	if (!ref)
+		return -1;
+
+	c->ref_frame->format = c->sw_fmt;
+	c->ref_frame->width = c->ctx->width;
+	c->ref_frame->height = c->ctx->height;
+	c->ref_frame->pts = pts;
+	c->ref_frame->buf[0] = ref;
+	av_image_fill_arrays(c->ref_frame->data, c->ref_frame->linesize,
+			     ref->data, c->sw_fmt, c->ctx->width,
+			     c->ctx->height, 1);
+
+	/*
+	 * avcodec_send_frame() takes its own reference if it needs one, so we
+	 * can drop ours immediately.
+	 */
+	r = encode_send(c, pts, c->ref_frame);
+	av_frame_unref(c->ref_frame);
+	return r;
+}
+
 /**
  * lavc_end_encode() - Shutdown an encoding stream.
  * @param c LAVC context handle.
@@ -182,30 +677,191 @@ int lavc_encode(struct lavc_ctx *c, uint32_t pts, const uint8_t *data, int len)
 void lavc_end_encode(struct lavc_ctx *c)
 {
 	av_write_trailer(c->fctx);
-	if (!(c->fmt->flags & AVFMT_NOFILE))
-		avio_closep(&c->fctx->pb);
+	if (c->writer) {
+		avio_flush(c->fctx->pb);
+		av_freep(&c->fctx->pb->buffer);
+		avio_context_free(&c->fctx->pb);
+		writer_close(c->writer);
+	}
 
 	avformat_free_context(c->fctx);
 	av_packet_free(&c->pkt);
 	avcodec_free_context(&c->ctx);
 	av_frame_free(&c->frame);
+	av_frame_free(&c->ref_frame);
+	av_frame_free(&c->hw_frame);
 	free(c);
 }
 
+static bool load_index(struct lavc_ctx *c, const char *idxpath,
+		       const struct stat *st)
+{
+	struct index_hdr hdr;
+	bool ok = false;
+	FILE *f;
+
+	f = fopen(idxpath, "r");
+	if (!f)
+		return false;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, index_magic, sizeof(hdr.magic)) ||
+	    hdr.size != st->st_size ||
+	    hdr.mtime_ns != st->st_mtim.tv_sec * 1000000000LL +
+				    st->st_mtim.tv_nsec ||
+	    hdr.stream != (uint32_t)c->stream->index || !hdr.nr ||
+	    hdr.nr > INT_MAX)
+		goto out;
+
+	c->index = calloc(hdr.nr, sizeof(*c->index));
+	if (!c->index)
+		errx(1, "can't allocate frame index");
+
+	if (fread(c->index, sizeof(*c->index), hdr.nr, f) != hdr.nr) {
+		free(c->index);
+		c->index = NULL;
+		goto out;
+	}
+
+	c->nr_frames = hdr.nr;
+	ok = true;
+out:
+	fclose(f);
+	return ok;
+}
+
+/*
+ * Failing to save the index only makes the next open slower, so it isn't
+ * fatal: the recording might be on read-only media.
+ */
+static void save_index(const struct lavc_ctx *c, const char *idxpath,
+		       const struct stat *st)
+{
+	struct index_hdr hdr = {
+		.size = st->st_size,
+		.mtime_ns = st->st_mtim.tv_sec * 1000000000LL +
+			    st->st_mtim.tv_nsec,
+		.stream = c->stream->index,
+		.nr = c->nr_frames,
+	};
+	FILE *f;
+
+	memcpy(hdr.magic, index_magic, sizeof(hdr.magic));
+
+	f = fopen(idxpath, "w");
+	if (!f)
+		return;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(c->index, sizeof(*c->index), c->nr_frames, f) !=
+		    (size_t)c->nr_frames) {
+		fclose(f);
+		unlink(idxpath);
+		return;
+	}
+
+	if (fclose(f))
+		unlink(idxpath);
+}
+
+/*
+ * Demuxing without decoding is cheap, but it still reads the whole file.
+ */
+static void build_index(struct lavc_ctx *c)
+{
+	struct index_entry *e;
+	int max = 0;
+
+	while (av_read_frame(c->fctx, c->pkt) >= 0) {
+		if (c->pkt->stream_index != c->stream->index) {
+			av_packet_unref(c->pkt);
+			continue;
+		}
+
+		if (c->nr_frames == max) {
+			max = max ? max * 2 : 4096;
+			c->index = realloc(c->index, max * sizeof(*c->index));
+			if (!c->index)
+				errx(1, "can't allocate frame index");
+		}
+
+		e = &c->index[c->nr_frames++];
+		e->pts = c->pkt->pts;
+		e->key = !!(c->pkt->flags & AV_PKT_FLAG_KEY);
+		e->unused = 0;
+		av_packet_unref(c->pkt);
+	}
+
+	if (!c->nr_frames)
+		errx(1, "no frames in file");
+
+	c->index[0].key = 1;
+}
+
+/*
+ * Our own recordings hold a single FFV1 stream, and Matroska stores everything
+ * the decoder needs in the header, so there's no need to probe them by
+ * decoding frames.
+ */
+static bool own_recording(const AVFormatContext *f)
+{
+	const AVCodecParameters *p;
+
+	if (f->nb_streams != 1)
+		return false;
+
+	p = f->streams[0]->codecpar;
+	return p->codec_type == AVMEDIA_TYPE_VIDEO &&
+	       p->codec_id == AV_CODEC_ID_FFV1 && p->width > 0 &&
+	       p->height > 0;
+}
+
+/**
+ * lavc_probe_size() - Get the frame size of a video file without decoding it.
+ * @param path Path to file containing encoded video.
+ * @param width Output frame width in pixels.
+ * @param height Output frame height in pixels.
+ *
+ * Return: Nothing.
+ */
+void lavc_probe_size(const char *path, int *width, int *height)
+{
+	AVFormatContext *f = NULL;
+	int sidx;
+
+	if (avformat_open_input(&f, path, NULL, NULL) < 0)
+		errx(1, "can't open input file '%s'", path);
+
+	if (!own_recording(f) && avformat_find_stream_info(f, NULL) < 0)
+		errx(1, "no stream information in '%s'", path);
+
+	sidx = av_find_best_stream(f, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if (sidx < 0)
+		errx(1, "no video stream in '%s'", path);
+
+	*width = f->streams[sidx]->codecpar->width;
+	*height = f->streams[sidx]->codecpar->height;
+	avformat_close_input(&f);
+}
+
 /**
  * lavc_start_decode() - Initialize a handle for decoding a compressed
  *			 video stream from a file.
  *
  * @param path Path to file containing encoded video.
  *
+ * This indexes every frame in the file, so playback can seek to any of them.
+ * The index is saved alongside the file as path.idx, and reused if the file
+ * hasn't changed since.
+ *
  * Return: Handle for the stream.
  */
 struct lavc_ctx *lavc_start_decode(const char *path)
 {
+	char idxpath[PATH_MAX];
 	struct lavc_ctx *c;
-	uint8_t *tmp_ptr[4];
-	int tmp_sz[4];
-	int ret, sidx;
+	struct stat st;
+	int sidx;
 
 	c = calloc(1, sizeof(*c));
 	if (!c)
@@ -214,7 +870,8 @@ struct lavc_ctx *lavc_start_decode(const char *path)
 	if (avformat_open_input(&c->fctx, path, NULL, NULL) < 0)
 		errx(1, "can't open input file '%s'", path);
 
-	if (avformat_find_stream_info(c->fctx, NULL) < 0)
+	if (!own_recording(c->fctx) &&
+	    avformat_find_stream_info(c->fctx, NULL) < 0)
 		errx(1, "no stream information in '%s'", path);
 
 	sidx = av_find_best_stream(c->fctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL,
@@ -234,15 +891,16 @@ struct lavc_ctx *lavc_start_decode(const char *path)
 	if (avcodec_parameters_to_context(c->ctx, c->stream->codecpar) < 0)
 		errx(1, "can't copy decoder parameters");
 
+	/*
+	 * FFV1 can decode every slice and several frames at once: the extra
+	 * delay of frame threading doesn't matter when playing a file.
+	 */
+	c->ctx->thread_count = 0;
+	c->ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
 	if (avcodec_open2(c->ctx, c->codec, NULL) < 0)
 		errx(1, "can't open decoder codec");
 
-	ret = av_image_alloc(tmp_ptr, tmp_sz, c->ctx->width, c->ctx->height,
-			     c->ctx->pix_fmt, 1);
-
-	if (ret < 0)
-		errx(1, "can't allocate image memory");
-
 	c->frame = av_frame_alloc();
 	if (!c->frame)
 		errx(1, "can't allocate image frame");
@@ -251,51 +909,180 @@ struct lavc_ctx *lavc_start_decode(const char *path)
 	if (!c->pkt)
 		errx(1, "can't allocate image packet");
 
+	if (stat(path, &st))
+		err(1, "can't stat '%s'", path);
+
+	snprintf(idxpath, sizeof(idxpath), "%s.idx", path);
+	if (!load_index(c, idxpath, &st)) {
+		build_index(c);
+		save_index(c, idxpath, &st);
+	}
+
+	lavc_decode_seek(c, 0);
 	return c;
 }
 
+/**
+ * lavc_decode_frames() - Get the number of frames in a file being decoded.
+ * @param c LAVC context handle.
+ *
+ * Return: Number of frames.
+ */
+int lavc_decode_frames(const struct lavc_ctx *c)
+{
+	return c->nr_frames;
+}
+
+/**
+ * lavc_decode_pts_ms() - Get the presentation time of a frame.
+ * @param c LAVC context handle.
+ * @param frame Index of the frame in the file.
+ *
+ * Return: Presentation time in milliseconds, or -1 if the file doesn't say.
+ */
+int64_t lavc_decode_pts_ms(const struct lavc_ctx *c, int frame)
+{
+	int64_t pts = c->index[frame].pts;
+
+	if (pts == AV_NOPTS_VALUE)
+		return -1;
+
+	return av_rescale_q(pts, c->stream->time_base, (AVRational){ 1, 1000 });
+}
+
+/**
+ * lavc_decode_tell() - Get the index of the next frame lavc_decode() returns.
+ * @param c LAVC context handle.
+ *
+ * Return: Frame index, which is equal to the number of frames at EOF.
+ */
+int lavc_decode_tell(const struct lavc_ctx *c)
+{
+	return c->next_frame < 0 ? c->skip_to : c->next_frame;
+}
+
+/*
+ * Find which frame the decoder landed on after a seek, from its timestamp.
+ */
+static int find_frame(const struct lavc_ctx *c, int64_t pts)
+{
+	int lo = 0, hi = c->nr_frames - 1;
+
+	if (pts == AV_NOPTS_VALUE)
+		return c->seek_frame;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (c->index[mid].pts == pts)
+			return mid;
+
+		if (c->index[mid].pts < pts)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return c->seek_frame;
+}
+
 /**
  * lavc_decode() - Decode the next frame in an encoded stream.
  * @param c LAVC context handle.
+ * @param frame Output index of the frame in the file.
  *
  * Call this function repeatedly until it returns NULL on EOF.
  *
  * Return: Pointer to raw framebuffer containing decoded data.
  *
  * The pointer returned by this function is only valid until the next
- * call to this function, or the next call to lavc_decode_loop().
+ * call to this function, lavc_decode_seek(), or lavc_decode_loop().
  */
-const uint8_t *lavc_decode(struct lavc_ctx *c)
+const uint8_t *lavc_decode(struct lavc_ctx *c, int *frame)
 {
 	int ret;
 
-	if (!c->queued) {
 again:
-		if (av_read_frame(c->fctx, c->pkt) < 0)
-			return NULL;
+	av_frame_unref(c->frame);
 
-		if (c->pkt->stream_index != c->stream->index) {
-			av_packet_unref(c->pkt);
-			goto again;
+	/*
+	 * With frame threading, the decoder holds on to several packets
+	 * before it returns the first frame, so at EOF it must be drained.
+	 */
+	while ((ret = avcodec_receive_frame(c->ctx, c->frame)) ==
+	       AVERROR(EAGAIN)) {
+		if (av_read_frame(c->fctx, c->pkt) < 0) {
+			avcodec_send_packet(c->ctx, NULL);
+			continue;
 		}
 
-		if (avcodec_send_packet(c->ctx, c->pkt) < 0)
+		if (c->pkt->stream_index == c->stream->index &&
+		    avcodec_send_packet(c->ctx, c->pkt) < 0)
 			errx(1, "can't submit packet");
 
 		av_packet_unref(c->pkt);
-		c->queued = 1;
+	}
 
-	} else {
-		av_frame_unref(c->frame);
+	if (ret == AVERROR_EOF) {
+		c->next_frame = c->nr_frames;
+		return NULL;
 	}
 
-	ret = avcodec_receive_frame(c->ctx, c->frame);
-	if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+	if (ret < 0)
+		errx(1, "can't decode frame");
+
+	if (c->next_frame < 0)
+		c->next_frame = find_frame(c, c->frame->best_effort_timestamp);
+
+	/*
+	 * Frames between the keyframe a seek landed on and the frame it asked
+	 * for are only decoded for their side effects on the decoder.
+	 */
+	*frame = c->next_frame++;
+	if (*frame < c->skip_to)
 		goto again;
 
 	return c->frame->data[0];
 }
 
+/**
+ * lavc_decode_seek() - Seek to any frame in a decoding stream.
+ * @param c LAVC context handle.
+ * @param frame Index of the frame in the file.
+ *
+ * After this function, lavc_decode() will begin returning frames from the
+ * given one onwards, until EOF. It seeks to the closest keyframe before it,
+ * and decodes forward from there.
+ *
+ * Return: Nothing.
+ */
+void lavc_decode_seek(struct lavc_ctx *c, int frame)
+{
+	int key;
+
+	if (frame < 0)
+		frame = 0;
+
+	if (frame >= c->nr_frames)
+		frame = c->nr_frames - 1;
+
+	for (key = frame; key > 0; key--)
+		if (c->index[key].key && c->index[key].pts != AV_NOPTS_VALUE)
+			break;
+
+	av_frame_unref(c->frame);
+	if (c->index[key].pts == AV_NOPTS_VALUE)
+		avformat_seek_file(c->fctx, c->stream->index, 0, 0, 0, 0);
+	else
+		av_seek_frame(c->fctx, c->stream->index, c->index[key].pts,
+			      AVSEEK_FLAG_BACKWARD);
+
+	avcodec_flush_buffers(c->ctx);
+	c->next_frame = -1;
+	c->seek_frame = key;
+	c->skip_to = frame;
+}
+
 /**
  * lavc_decode_loop() - Loop a decoding stream back to the beginning.
  * @param c LAVC context handle.
@@ -307,9 +1094,7 @@ again:
  */
 void lavc_decode_loop(struct lavc_ctx *c)
 {
-	av_frame_unref(c->frame);
-	avformat_seek_file(c->fctx, c->stream->index, 0, 0, 0, 0);
-	c->queued = 0;
+	lavc_decode_seek(c, 0);
 }
 
 /**
@@ -325,5 +1110,6 @@ void lavc_end_decode(struct lavc_ctx *c)
 	av_packet_free(&c->pkt);
 	av_frame_free(&c->frame);
 	avformat_free_context(c->fctx);
+	free(c->index);
 	free(c);
 }
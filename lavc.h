@@ -18,20 +18,58 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <libavutil/pixfmt.h>
 
 struct lavc_ctx;
 
+/*
+ * FFV1 encoder tuning. Negative values (and a NULL coder) leave the libavcodec
+ * default alone. A thread count of zero means one thread per CPU. A non-NULL
+ * codec names a different encoder to use. With hw set, the caller records
+ * NV12 and the first working hardware H.264 encoder is used (see
+ * lavc_start_encode()), with a bitrate in kbit/s.
+ */
+struct lavc_enc_opts {
+	const char *codec;
+	int threads;
+	int level;
+	int slices;
+	const char *coder;
+	int context;
+	int gop;
+	int segment;
+	bool hw;
+	int bitrate;
+};
+
+void lavc_parse_enc_opts(struct lavc_enc_opts *o, const char *spec);
+
 struct lavc_ctx *lavc_start_encode(const char *path, int width, int height,
-				   int fps, int pix_fmt);
+				   int fps, int pix_fmt,
+				   const struct lavc_enc_opts *opts);
 
 int lavc_encode(struct lavc_ctx *c, uint32_t pts, const uint8_t *data, int len);
 
+int lavc_encode_ref(struct lavc_ctx *c, uint32_t pts, const uint8_t *data,
+		    int len, void (*release)(void *opaque, uint8_t *data),
+		    void *opaque);
+
 void lavc_end_encode(struct lavc_ctx *c);
 
+void lavc_probe_size(const char *path, int *width, int *height);
+
 struct lavc_ctx *lavc_start_decode(const char *path);
 
-const uint8_t *lavc_decode(struct lavc_ctx *c);
+int lavc_decode_frames(const struct lavc_ctx *c);
+
+int64_t lavc_decode_pts_ms(const struct lavc_ctx *c, int frame);
+
+int lavc_decode_tell(const struct lavc_ctx *c);
+
+const uint8_t *lavc_decode(struct lavc_ctx *c, int *frame);
+
+void lavc_decode_seek(struct lavc_ctx *c, int frame);
 
 void lavc_decode_loop(struct lavc_ctx *c);
 
@@ -34,210 +34,1671 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "dev.h"
 #include "v4l2.h"
 #include "lavc.h"
 #include "sdl.h"
 #include "inet.h"
+#include "stats.h"
+#include "pipeline.h"
+#include "record.h"
+#include "latency.h"
+#include "wire.h"
+#include "cache.h"
+#include "counters.h"
+#include "evloop.h"
+#include "export.h"
+#include "roi.h"
+#include "gate.h"
+
+/*
+ * Ring depths for the threaded pipeline (see run_v4l2_threaded()).
+ */
+#define RENDER_DEPTH 4
+#define SENDER_DEPTH 4
+#define POOL_FRAMES 32
+#define SERVER_FRAMES 32
+
+#define MAX_CAMERAS SDL_MAX_VIEWS
+
+/*
+ * Default length of the black box ring file, ten minutes of video.
+ */
+#define RING_FRAMES (10 * 60 * FPS)
+
+/*
+ * Parse an IPv6 address, or an IPv4 address as a v4-mapped IPv6 address.
+ */
+static void parse_addr(struct sockaddr_in6 *sa, const char *str)
+{
+	char v4[sizeof("::ffff:XXX.XXX.XXX.XXX")];
+
+	sa->sin6_family = AF_INET6;
+	if (inet_pton(AF_INET6, str, &sa->sin6_addr) == 1)
+		return;
+
+	snprintf(v4, sizeof(v4), "::ffff:%s", str);
+	if (inet_pton(AF_INET6, v4, &sa->sin6_addr) == 1)
+		return;
+
+	errx(1, "Can't parse address '%s'", str);
+}
+
+/*
+ * Values for long options without a short equivalent.
+ */
+enum {
+	OPT_RAW_ENCODER = 256,
+	OPT_RGB_ENCODER,
+	OPT_V4L2_MEMORY,
+	OPT_WIRE_PAYLOAD,
+	OPT_SLOW_CLIENTS,
+	OPT_UDP_SEND,
+	OPT_TCP_OPTS,
+	OPT_GPU,
+	OPT_SEEK,
+	OPT_EXPORT,
+	OPT_VIEW,
+	OPT_STATS_SOCKET,
+	OPT_STATS_INTERVAL,
+	OPT_RING_FILE,
+	OPT_RING_FRAMES,
+	OPT_PRE_RECORD,
+	OPT_PROFILE,
+	OPT_PORT,
+	OPT_ROI,
+	OPT_ROI_LOG,
+	OPT_REMOTE_VIEW,
+	OPT_RECORD_GATE,
+};
+
+static enum v4l2_memory parse_v4l2_memory(const char *name)
+{
+	if (!strcmp(name, "mmap"))
+		return V4L2_MEMORY_MMAP;
+
+	if (!strcmp(name, "userptr"))
+		return V4L2_MEMORY_USERPTR;
+
+	if (!strcmp(name, "dmabuf"))
+		return V4L2_MEMORY_DMABUF;
+
+	errx(1, "bad V4L2 memory type '%s' (mmap, userptr, dmabuf)", name);
+}
 
 static int record_only;
-static struct lavc_ctx *record;
+static int threaded;
+static int use_gpu;
+static int seek_frame;
+static const char *export_path;
+static struct export_view export_view = {
+	.cfg = { .contours = 1, .colormap = true },
+};
+static int nr_cameras;
+static int backlog_secs;
+static struct gate_opts gate_opts = {
+	.threshold = 0.5,
+	.keepalive_ms = 10000,
+	.lead_ms = 1000,
+	.hold_ms = 3000,
+};
+static int use_gate;
+static const char *ring_path;
+static int ring_frames;
+static const char *profile_name;
+static struct lavc_enc_opts raw_opts;
+static struct lavc_enc_opts rgb_opts;
+static int v4l2_buffers;
+static enum v4l2_memory v4l2_memory = V4L2_MEMORY_MMAP;
 static int window_width = 1440;
 static int window_height = 1080;
 static const char *fontpath;
 static int listen_only;
-static FILE *remote_socket;
+static struct sockaddr_in6 udp_dst;
+static int base_port = 8888;
+static int udp_recv;
+static int wire_payload = WIRE_RICE;
+static enum slow_client_policy slow_clients = SLOW_CLIENT_SKIP;
+static struct stream_opts tcp_opts = {
+	.nodelay = true,
+	.quickack = true,
+};
+static struct wire_view remote_view;
+static int have_remote_view;
 static int hide_init_help;
+static const char *stats_socket;
+static int stats_interval;
+static struct roi rois[ROI_MAX];
+static int nr_rois;
+static const char *roi_log_path;
+static FILE *roi_file;
+
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t dump_latency;
+
+static void stopper(int sig)
+{
+	stop = sig;
+}
+
+static void dumper(int sig)
+{
+	dump_latency = sig;
+}
+
+static void check_dump_latency(void)
+{
+	if (!dump_latency)
+		return;
+
+	dump_latency = 0;
+	lat_dump(stderr);
+}
+
+/*
+ * SDL2 has no file descriptor to wait on, so while there's a window the event
+ * loops wake up at least this often to handle input.
+ */
+#define INPUT_MS 10
+
+static int input_timeout(const struct sdl_ctx *ctx)
+{
+#ifdef IRCAM_NOSDL
+	return -1;
+#else
+	return ctx ? INPUT_MS : -1;
+#endif
+}
+
+/*
+ * Event loop callback for sources which only need to be noticed.
+ */
+static void set_flag(void *arg, __attribute__((unused)) uint64_t v)
+{
+	*(bool *)arg = true;
+}
+
+/*
+ * Event loop callback for timers whose expirations need counting.
+ */
+static void add_ticks(void *arg, uint64_t v)
+{
+	*(uint64_t *)arg += v;
+}
+
+/*
+ * Where each camera's frames go, other than to the renderer: every camera has
+ * its own recording, ring file, and network streams.
+ */
+struct sink {
+	int idx;
+	struct recorder *record;
+	struct recorder *ring;
+	struct backlog *backlog;
+	struct gate *gate;
+	struct remote_tx *tx;
+};
+
+static struct sink sinks[MAX_CAMERAS];
+
+/*
+ * When several cameras start recording together, their files are named for
+ * the same second, and stamped against the same epoch so they stay in sync.
+ * The epoch is far enough in the past to include every frame in a backlog.
+ */
+struct record_trigger {
+	time_t time;
+	uint64_t epoch_ns;
+};
+
+static struct record_trigger new_record_trigger(void)
+{
+	struct record_trigger t = {
+		.time = time(NULL),
+	};
+	uint64_t now = lat_now(), back = (backlog_secs + 1) * 1000000000ULL;
+
+	if (nr_cameras > 1)
+		t.epoch_ns = now > back ? now - back : 1;
+
+	return t;
+}
+
+static void toggle_record(struct sink *s, const struct record_trigger *t)
+{
+	char path[PATH_MAX];
+
+	if (s->record) {
+		recorder_end(s->record);
+		s->record = NULL;
+		return;
+	}
+
+	if (s->gate)
+		gate_reset(s->gate);
+
+	if (nr_cameras > 1)
+		snprintf(path, sizeof(path), "%ld-cam%d-raw.mkv", t->time,
+			 s->idx);
+	else
+		snprintf(path, sizeof(path), "%ld-raw.mkv", t->time);
+
+	if (s->backlog) {
+		s->record = recorder_start_backlog(s->backlog, path, WIDTH,
+						   HEIGHT, FPS,
+						   AV_PIX_FMT_GRAY16LE,
+						   &raw_opts, t->epoch_ns);
+		return;
+	}
+
+	s->record = recorder_start(path, WIDTH, HEIGHT, FPS,
+				   AV_PIX_FMT_GRAY16LE, &raw_opts, threaded);
+	if (t->epoch_ns)
+		recorder_set_epoch(s->record, t->epoch_ns);
+}
+
+/*
+ * Every region of interest is measured once, as each frame enters the
+ * pipeline, and the results travel with the frame to the network sender and
+ * the overlay.
+ */
+static void measure_frame(struct frame *f)
+{
+	uint64_t start;
+
+	f->nr_roi = nr_rois;
+	if (!nr_rois)
+		return;
+
+	start = lat_now();
+	roi_measure(rois, nr_rois, f->roi, f->data, WIDTH);
+	ctr_add(CTR_STATS_NS, lat_now() - start);
+}
+
+static void log_frame(int cam, const struct frame *f, uint64_t ts_ns)
+{
+	if (roi_file && f->nr_roi)
+		roi_log(roi_file, cam, f->seq, ts_ns, rois, nr_rois, f->roi,
+			f->nr_roi);
+}
+
+/*
+ * Each V4L2 buffer is wrapped in a refcounted frame pointing directly at the
+ * Y16 data in the mmap'd buffer. The last frame_put() requeues the buffer to
+ * the kernel, so the renderer, network sender, and encoder can all read the
+ * frame in place without ever copying it.
+ */
+struct vbuf {
+	struct frame f;
+	struct camera *cam;
+	struct v4l2_buffer buf;
+};
+
+struct camera {
+	const char *devpath;
+	struct v4l2_dev *dev;
+	struct vbuf *vbufs;
+	int nr_vbufs;
+	atomic_int held;
+};
+
+/*
+ * How many V4L2 buffers must always be left queued for the kernel to fill.
+ */
+#define CAMERA_RESERVE 2
+
+static void vbuf_release(struct frame *f)
+{
+	struct vbuf *vb = (struct vbuf *)f;
+
+	v4l2_put_buffer(vb->cam->dev, &vb->buf);
+	atomic_fetch_sub_explicit(&vb->cam->held, 1, memory_order_relaxed);
+}
+
+static void camera_open(struct camera *cam, const char *devpath)
+{
+	cam->devpath = devpath;
+	cam->dev = v4l2_open(devpath, V4L2_PIX_FMT_YUYV,
+			     cur_profile->v4l2_width, cur_profile->v4l2_height,
+			     FPS, v4l2_buffers, v4l2_memory);
+
+	cam->nr_vbufs = v4l2_nr_buffers(cam->dev);
+	cam->vbufs = calloc(cam->nr_vbufs, sizeof(*cam->vbufs));
+	if (!cam->vbufs)
+		errx(1, "can't allocate V4L2 frames");
+
+	atomic_init(&cam->held, 0);
+}
+
+static void camera_close(struct camera *cam)
+{
+	if (atomic_load(&cam->held))
+		errx(1, "V4L2 buffers still in use at exit");
+
+	v4l2_close(cam->dev);
+	free(cam->vbufs);
+}
+
+/*
+ * Drivers which don't stamp buffers on the monotonic clock are stamped when we
+ * dequeue them instead.
+ */
+static uint64_t buf_timestamp(const struct v4l2_buffer *buf)
+{
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+	    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return lat_now();
+
+	return buf->timestamp.tv_sec * 1000000000ULL +
+	       buf->timestamp.tv_usec * 1000ULL;
+}
+
+/*
+ * Dequeue the next frame from the camera, or return NULL if interrupted by a
+ * signal.
+ *
+ * If a copy pool is given and consumers are holding on to so many buffers that
+ * the kernel would soon run out, the frame is copied into the pool and the
+ * buffer requeued immediately instead. Returns NULL in that case too if the
+ * pool is exhausted.
+ */
+static struct frame *camera_get(struct camera *cam, struct frame_pool *copy)
+{
+	struct v4l2_buffer buf = { 0 };
+	uint64_t start = lat_now();
+	const uint8_t *data;
+	struct frame *f;
+	struct vbuf *vb;
+
+	if (v4l2_get_buffer(cam->dev, &buf)) {
+		if (errno == EINTR)
+			return NULL;
+
+		err(1, "v4l2 failure");
+	}
+
+	ctr_add(CTR_DQBUF_NS, lat_now() - start);
+	ctr_add(CTR_DEQUEUED, 1);
+
+	if (buf.bytesused != (unsigned)(ISKIP + ISIZE))
+		errx(1,
+		     "bad image size (%d != %d), is '%s' the "
+		     "correct device? Pass '-d' to specify a "
+		     "different one",
+		     buf.bytesused, ISKIP + ISIZE, cam->devpath);
+
+	data = v4l2_buf_mmap(cam->dev, &buf) + ISKIP;
+
+	if (copy && atomic_load_explicit(&cam->held, memory_order_relaxed) >=
+			    cam->nr_vbufs - CAMERA_RESERVE) {
+		f = frame_pool_get(copy);
+		if (f) {
+			f->seq = buf.sequence;
+			f->ts_ns = buf_timestamp(&buf);
+			memcpy(f->data, data, ISIZE);
+		} else {
+			ctr_add(CTR_CAPTURE_DROPS, 1);
+		}
+
+		v4l2_put_buffer(cam->dev, &buf);
+		return f;
+	}
+
+	vb = &cam->vbufs[buf.index];
+	vb->cam = cam;
+	vb->buf = buf;
+	vb->f.seq = buf.sequence;
+	vb->f.ts_ns = buf_timestamp(&buf);
+	vb->f.data = (uint8_t *)data;
+	vb->f.len = ISIZE;
+	vb->f.release = vbuf_release;
+	atomic_init(&vb->f.refs, 1);
+	atomic_fetch_add_explicit(&cam->held, 1, memory_order_relaxed);
+	return &vb->f;
+}
+
+/*
+ * Everything needed to send camera frames to remote viewers, over TCP to any
+ * number of clients, and/or over UDP to a unicast or multicast destination.
+ */
+struct remote_tx {
+	struct stream_server *server;
+	int dgram_fd;
+	struct wire *wire;
+	struct frame_pool *pool;
+};
+
+/*
+ * Each camera's streams are on their own port, counting up from the base port.
+ */
+static struct remote_tx *remote_tx_start(int idx, bool tcp,
+					 const struct sockaddr_in6 *udp)
+{
+	struct sockaddr_in6 dst;
+	struct remote_tx *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		errx(1, "can't allocate remote sender");
+
+	t->wire = wire_new(wire_payload, WIDTH, HEIGHT);
+	t->pool = frame_pool_create(SERVER_FRAMES, wire_max_len(t->wire));
+	t->dgram_fd = -1;
+
+	if (tcp)
+		t->server = stream_server_start(base_port + idx, slow_clients,
+						 &tcp_opts);
+
+	if (udp) {
+		dst = *udp;
+		dst.sin6_port = htons(base_port + idx);
+		t->dgram_fd = get_dgram_connect(&dst);
+	}
+
+	return t;
+}
+
+static void remote_tx_stop(struct remote_tx *t)
+{
+	if (t->server)
+		stream_server_stop(t->server);
+
+	if (t->dgram_fd != -1)
+		close(t->dgram_fd);
+
+	frame_pool_destroy(t->pool);
+	wire_free(t->wire);
+	free(t);
+}
+
+/*
+ * Encode a frame for the wire once for each view the clients asked for, and
+ * share the results between all of the server's clients (and the UDP stream,
+ * which always gets the full view). Nothing is encoded while nobody is
+ * watching.
+ */
+static void send_frame(struct frame *f, void *arg)
+{
+	static const struct wire_view full;
+	struct remote_tx *t = arg;
+	bool tcp = t->server && stream_server_clients(t->server);
+	struct wire_view views[STREAM_MAX_CLIENTS + 1];
+	int i, nr = 0;
+
+	if (tcp)
+		nr = stream_server_views(t->server, views,
+					 STREAM_MAX_CLIENTS);
+
+	if (t->dgram_fd != -1) {
+		for (i = 0; i < nr; i++)
+			if (!memcmp(&views[i], &full, sizeof(full)))
+				break;
+
+		if (i == nr)
+			views[nr++] = full;
+	}
+
+	for (i = 0; i < nr; i++) {
+		const struct wire_view *v = &views[i];
+		bool udp = t->dgram_fd != -1 && !memcmp(v, &full, sizeof(*v));
+		struct frame *msg;
+
+		if (v->rate > 1 && f->seq % v->rate)
+			continue;
+
+		/*
+		 * If every buffer is still queued to some slow client, skip
+		 * this one.
+		 */
+		msg = frame_pool_get(t->pool);
+		if (!msg)
+			return;
+
+		msg->seq = f->seq;
+		msg->ts_ns = f->ts_ns;
+		msg->len = wire_encode(t->wire, msg->data, f->seq, f->ts_ns,
+				       f->data, f->roi, f->nr_roi, v);
+
+		if (tcp)
+			stream_server_send(t->server, msg, v);
+
+		if (udp) {
+			uint64_t start = lat_now();
+
+			if (wire_send_dgram(t->dgram_fd, msg->data, msg->len,
+					    f->seq))
+				err(1, "can't send UDP frame");
+
+			ctr_add(CTR_SEND_NS, lat_now() - start);
+			ctr_add(CTR_BYTES_SENT, msg->len);
+
+			if (!tcp)
+				lat_record(LAT_SEND, f->ts_ns);
+		}
+
+		frame_put(msg);
+	}
+}
+
+static void sink_store(struct frame *f, void *arg)
+{
+	struct sink *s = arg;
+
+	/*
+	 * A recording started from the backlog drains it, so frames only ever
+	 * go into the backlog once there is one.
+	 */
+	if (s->backlog)
+		backlog_push(s->backlog, f);
+	else if (s->record)
+		recorder_push(s->record, f);
+
+	if (s->ring)
+		recorder_push(s->ring, f);
+}
+
+/*
+ * With a gate, frames from a static scene are only recorded now and then.
+ */
+static void sink_push(struct sink *s, struct frame *f)
+{
+	uint64_t start;
+
+	if (!s->gate) {
+		sink_store(f, s);
+		return;
+	}
+
+	if (!s->backlog && !s->record && !s->ring)
+		return;
+
+	start = lat_now();
+	gate_push(s->gate, f, sink_store, s);
+	ctr_add(CTR_STATS_NS, lat_now() - start);
+}
+
+static void sink_end(struct sink *s)
+{
+	if (s->record) {
+		recorder_end(s->record);
+		s->record = NULL;
+	}
+
+	if (s->ring) {
+		recorder_end(s->ring);
+		s->ring = NULL;
+	}
+}
+
+/*
+ * The single threaded pipeline does everything from one event loop: each frame
+ * is handled as soon as the V4L2 device has it, and input is handled between
+ * frames, so a stalled camera never stalls the window.
+ */
+struct v4l2_run {
+	struct sdl_ctx *ctx;
+	struct sink *sink;
+	struct camera cam;
+};
+
+static void v4l2_action(struct v4l2_run *r, int action)
+{
+	struct record_trigger t;
+
+	switch (action) {
+	case TOGGLE_Y16_RECORD:
+		t = new_record_trigger();
+		toggle_record(r->sink, &t);
+		break;
+
+	case QUIT_PROGRAM:
+		stop = 1;
+		break;
+	}
+}
+
+static void v4l2_ready(void *arg, __attribute__((unused)) uint64_t events)
+{
+	struct v4l2_run *r = arg;
+	struct sink *s = r->sink;
+	struct frame *f;
+
+	f = camera_get(&r->cam, NULL);
+	if (!f)
+		return;
+
+	measure_frame(f);
+	log_frame(0, f, f->ts_ns);
+	sink_push(s, f);
+	if (s->tx)
+		send_frame(f, s->tx);
+
+	if (r->ctx) {
+		sdl_set_roi(r->ctx, 0, f->roi, f->nr_roi);
+		v4l2_action(r, paint_frame(r->ctx, f->seq, f->ts_ns, f->data));
+	}
+
+	frame_put(f);
+}
+
+static void run_v4l2(struct sdl_ctx *ctx, const char *devpath)
+{
+	struct v4l2_run r = {
+		.ctx = ctx,
+		.sink = &sinks[0],
+	};
+	struct record_trigger t;
+	struct evloop *loop;
+
+	camera_open(&r.cam, devpath);
+
+	if (record_only) {
+		t = new_record_trigger();
+		toggle_record(r.sink, &t);
+	}
+
+	loop = evloop_new();
+	evloop_add(loop, v4l2_fd(r.cam.dev), EPOLLIN, v4l2_ready, &r);
+
+	while (!stop) {
+		check_dump_latency();
+		if (!evloop_run_once(loop, input_timeout(ctx)) && ctx)
+			v4l2_action(&r, sdl_poll(ctx));
+	}
+
+	evloop_free(loop);
+	sink_end(r.sink);
+	camera_close(&r.cam);
+}
+
+/*
+ * The threaded pipeline: a capture thread for each camera queues each V4L2
+ * frame for each of the consumers below, and the buffer returns to the kernel
+ * once they are all done with it. Each consumer runs independently, so a slow
+ * encoder or network peer can no longer stall capture or rendering:
+ *
+ *	- The recorder blocks capture if it falls too far behind, so recordings
+ *	  never skip frames.
+ *	- The network sender and the renderer drop the oldest queued frames,
+ *	  so they always work on the latest one.
+ *
+ * If the consumers fall so far behind that they hold nearly every V4L2 buffer,
+ * frames are copied into a separate pool instead (see camera_get()).
+ *
+ * With more than one camera, each capture thread is pinned to its own CPU. It
+ * starts its camera's sender and recorders itself, so they inherit the CPU.
+ * The ring file recorder and stream server are started earlier, on the same
+ * CPU (see sinks_start()).
+ */
+struct capture {
+	struct camera cam;
+	struct sink *sink;
+	struct frame_pool *pool;
+	struct consumer *render;
+	struct consumer *sender;
+	pthread_t thread;
+	int cpu;
+	char render_name[16];
+	char sender_name[16];
+	atomic_bool toggle_record;
+};
+
+/*
+ * The trigger for the latest press, which the capture threads copy under the
+ * lock, since another press may replace it while they are still using it.
+ */
+static struct record_trigger record_trigger;
+static pthread_mutex_t record_trigger_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The n'th CPU this process may run on, wrapping around if there are fewer.
+ */
+static int nth_cpu(int n)
+{
+	cpu_set_t set;
+	int i, nr;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+
+	nr = CPU_COUNT(&set);
+	if (!nr)
+		return -1;
+
+	n %= nr;
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &set) && !n--)
+			return i;
+
+	return -1;
+}
+
+static void pin_thread(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		warnx("can't pin thread to CPU %d", cpu);
+}
+
+static void *capture_thread(void *arg)
+{
+	struct capture *cap = arg;
+	struct sink *s = cap->sink;
+
+	if (cap->cpu != -1)
+		pin_thread(cap->cpu);
+
+	if (s->tx)
+		cap->sender = consumer_start(cap->sender_name, SENDER_DEPTH,
+					     RING_DROP_OLDEST, send_frame,
+					     s->tx);
+
+	while (!stop) {
+		struct frame *f;
+
+		check_dump_latency();
+
+		/*
+		 * If even the copy pool is exhausted, some consumer is far
+		 * behind: drop this frame rather than waiting for it.
+		 */
+		f = camera_get(&cap->cam, cap->pool);
+		if (!f)
+			continue;
+
+		measure_frame(f);
+		log_frame(s->idx, f, f->ts_ns);
+
+		if (atomic_exchange(&cap->toggle_record, false)) {
+			struct record_trigger t;
+
+			pthread_mutex_lock(&record_trigger_lock);
+			t = record_trigger;
+			pthread_mutex_unlock(&record_trigger_lock);
+			toggle_record(s, &t);
+		}
+
+		sink_push(s, f);
+
+		if (cap->sender)
+			consumer_push(cap->sender, f);
+
+		if (cap->render)
+			consumer_push(cap->render, f);
+
+		frame_put(f);
+	}
+
+	sink_end(s);
+	if (cap->sender)
+		consumer_stop(cap->sender);
+
+	return NULL;
+}
+
+static void capture_start(struct capture *cap, int idx, const char *devpath,
+			  bool render)
+{
+	camera_open(&cap->cam, devpath);
+	cap->sink = &sinks[idx];
+	cap->pool = frame_pool_create(POOL_FRAMES, ISIZE);
+	cap->cpu = nr_cameras > 1 ? nth_cpu(idx) : -1;
+	atomic_init(&cap->toggle_record, record_only);
+
+	/*
+	 * The first camera's consumers keep their original names.
+	 */
+	if (idx) {
+		snprintf(cap->render_name, sizeof(cap->render_name),
+			 "render%d", idx);
+		snprintf(cap->sender_name, sizeof(cap->sender_name),
+			 "sender%d", idx);
+	} else {
+		strcpy(cap->render_name, "render");
+		strcpy(cap->sender_name, "sender");
+	}
+
+	if (render)
+		cap->render = consumer_start(cap->render_name, RENDER_DEPTH,
+					     RING_DROP_OLDEST, NULL, NULL);
+}
+
+static void capture_end(struct capture *cap)
+{
+	if (cap->render)
+		consumer_stop(cap->render);
+
+	camera_close(&cap->cam);
+	frame_pool_destroy(cap->pool);
+}
+
+/*
+ * Every capture thread toggles its recording from the same trigger, so all the
+ * files line up.
+ */
+static void toggle_record_all(struct capture *caps, int nr)
+{
+	int i;
+
+	pthread_mutex_lock(&record_trigger_lock);
+	record_trigger = new_record_trigger();
+	pthread_mutex_unlock(&record_trigger_lock);
+
+	for (i = 0; i < nr; i++)
+		atomic_store(&caps[i].toggle_record, true);
+}
+
+/*
+ * The renderer waits on every camera's ring at once, and whenever any of them
+ * has something new takes the latest frame from all of them, so the window is
+ * redrawn once for each round of frames however the cameras are phased. A
+ * stalled camera just leaves its last frame up, and input is handled between
+ * frames either way.
+ */
+static void run_v4l2_threaded(struct sdl_ctx *ctx, char *const *devpaths,
+			      int nr)
+{
+	struct capture caps[MAX_CAMERAS] = { 0 };
+	struct frame *frames[MAX_CAMERAS];
+	struct evloop *loop = NULL;
+	bool ready = false;
+	int i, first;
+
+	if (record_only)
+		record_trigger = new_record_trigger();
+
+	for (i = 0; i < nr; i++)
+		capture_start(&caps[i], i, devpaths[i], ctx);
+
+	/*
+	 * Without a window, the first camera is captured by the main thread.
+	 */
+	first = ctx ? 0 : 1;
+	for (i = first; i < nr; i++)
+		if (pthread_create(&caps[i].thread, NULL, capture_thread,
+				   &caps[i]))
+			errx(1, "can't start capture thread");
+
+	if (!ctx) {
+		capture_thread(&caps[0]);
+		goto out;
+	}
+
+	loop = evloop_new();
+	for (i = 0; i < nr; i++)
+		evloop_add(loop, consumer_fd(caps[i].render), EPOLLIN,
+			   set_flag, &ready);
+
+	while (!stop) {
+		int action, painted = 0;
+
+		ready = false;
+		if (evloop_run_once(loop, input_timeout(ctx)) && ready) {
+			for (i = 0; i < nr; i++)
+				consumer_fd_clear(caps[i].render);
+
+			for (i = 0; i < nr; i++)
+				frames[i] = consumer_pop_latest(caps[i].render,
+								0);
+		} else {
+			for (i = 0; i < nr; i++)
+				frames[i] = NULL;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (!frames[i])
+				continue;
+
+			sdl_set_roi(ctx, i, frames[i]->roi, frames[i]->nr_roi);
+			paint_tile(ctx, i, frames[i]->seq, frames[i]->ts_ns,
+				   frames[i]->data);
+			painted++;
+		}
+
+		action = painted ? paint_present(ctx) : sdl_poll(ctx);
+		for (i = 0; i < nr; i++)
+			if (frames[i])
+				frame_put(frames[i]);
+
+		switch (action) {
+		case TOGGLE_Y16_RECORD:
+			toggle_record_all(caps, nr);
+			break;
 
-static sig_atomic_t stop;
+		case QUIT_PROGRAM:
+			stop = 1;
+			break;
+		}
+	}
 
-static void stopper(int sig)
-{
-	stop = sig;
+out:
+	if (loop)
+		evloop_free(loop);
+
+	/*
+	 * Kick the capture threads out of poll() if a camera stalled.
+	 */
+	for (i = first; i < nr; i++) {
+		pthread_kill(caps[i].thread, SIGINT);
+		pthread_join(caps[i].thread, NULL);
+	}
+
+	for (i = 0; i < nr; i++)
+		capture_end(&caps[i]);
 }
 
-static int new_periodic_tfd(int64_t interval_ms)
+/*
+ * Playback decodes ahead in its own thread, so a slow frame never makes the
+ * renderer miss its deadline, and looping back to the start of the file never
+ * leaves a gap. The renderer shows each frame when the playback clock reaches
+ * its presentation time: the clock runs at some multiple of real time, and
+ * backwards when the decoder is producing frames in reverse.
+ *
+ * Recently decoded frames are cached, so stepping and scrubbing back and forth
+ * over the same frames is instant. Going backwards, the decoder fills the cache
+ * a chunk at a time from the nearest keyframe, since FFV1 can only go forward.
+ *
+ * To seek, the renderer posts a new target and bumps the generation. Each
+ * frame carries the generation it was decoded for, and the renderer discards
+ * any from before the latest seek. The decoder waits for it to do that before
+ * starting on the new target, so they don't queue up in front of it.
+ */
+#define PLAYBACK_DEPTH 8
+#define PLAYBACK_CACHE 128
+#define REVERSE_CHUNK 16
+#define SEEK_FRAMES (10 * FPS)
+
+static const int playback_speeds[] = { -8, -4, -2, -1, 1, 2, 4, 8 };
+static const int nr_playback_speeds =
+	sizeof(playback_speeds) / sizeof(playback_speeds[0]);
+
+struct playback {
+	struct lavc_ctx *lavc;
+	struct frame_cache *cache;
+	struct frame_pool *pool;
+	struct consumer *render;
+	int nr_frames;
+	atomic_int target;
+	atomic_int dir;
+	atomic_uint gen;
+	atomic_bool stop;
+	atomic_bool done;
+};
+
+static const uint8_t *playback_frame(struct playback *pb, int idx, int dir)
 {
-	const struct itimerspec t = {
-		.it_interval = {
-			.tv_sec = interval_ms / 1000,
-			.tv_nsec = interval_ms % 1000 * 1000000,
-		},
-		.it_value = {
-			.tv_sec = interval_ms / 1000,
-			.tv_nsec = interval_ms % 1000 * 1000000,
-		},
-	};
-	int fd;
+	const uint8_t *data;
+	uint8_t *dst = NULL;
+	int i, first;
 
-	fd = timerfd_create(CLOCK_MONOTONIC, 0);
-	if (fd == -1)
-		return -1;
+	data = frame_cache_lookup(pb->cache, idx);
+	if (data)
+		return data;
 
-	if (timerfd_settime(fd, 0, &t, NULL)) {
-		close(fd);
-		return -1;
+	first = dir < 0 && idx >= REVERSE_CHUNK ? idx - REVERSE_CHUNK + 1 : 0;
+	if (dir > 0)
+		first = idx;
+
+	if (lavc_decode_tell(pb->lavc) != first)
+		lavc_decode_seek(pb->lavc, first);
+
+	for (i = first; i <= idx; i++) {
+		int got;
+
+		data = lavc_decode(pb->lavc, &got);
+		if (!data)
+			errx(1, "can't decode frame %d", i);
+
+		dst = frame_cache_insert(pb->cache, got);
+		memcpy(dst, data, ISIZE);
 	}
 
-	return fd;
+	return dst;
 }
 
-static void run_v4l2(struct sdl_ctx *ctx, const char *devpath)
+static void *decode_thread(void *arg)
 {
-	struct v4l2_dev *dev;
+	struct playback *pb = arg;
+	unsigned gen = 0;
+	int idx = 0, dir = 1;
 
-	dev = v4l2_open(devpath, V4L2_PIX_FMT_YUYV, WIDTH, HEIGHT * 2, FPS);
-
-	while (!stop) {
-		struct v4l2_buffer buf = { 0 };
+	while (!atomic_load(&pb->stop)) {
 		const uint8_t *data;
+		struct frame *f;
+		int64_t pts;
 
-		if (v4l2_get_buffer(dev, &buf)) {
-			if (errno == EINTR)
-				continue;
+		if (atomic_load(&pb->gen) != gen) {
+			gen = atomic_load(&pb->gen);
+			idx = atomic_load(&pb->target);
+			dir = atomic_load(&pb->dir);
 
-			err(1, "v4l2 failure");
+			while (consumer_queued(pb->render) &&
+			       !atomic_load(&pb->stop))
+				usleep(1000);
 		}
 
-		if (buf.bytesused != ISKIP + ISIZE)
-			errx(1,
-			     "bad image size (%d != %d), is '%s' the "
-			     "correct device? Pass '-d' to specify a "
-			     "different one",
-			     buf.bytesused, ISIZE * 2, devpath);
-
-		data = v4l2_buf_mmap(dev, &buf) + ISKIP;
+		data = playback_frame(pb, idx, dir);
 
-		if (record)
-			if (lavc_encode(record, buf.sequence, data, ISIZE))
-				err(1, "can't record");
+		/*
+		 * The ring holds PLAYBACK_DEPTH frames and the renderer two
+		 * more, so the pool can never run dry.
+		 */
+		f = frame_pool_get(pb->pool);
+		if (!f)
+			errx(1, "playback pool exhausted");
 
-		if (remote_socket) {
-			if (fwrite(data, 1, ISIZE, remote_socket) != ISIZE)
-				err(1, "remote socket not accepting data");
-		}
+		pts = lavc_decode_pts_ms(pb->lavc, idx);
+		if (pts == -1)
+			pts = (int64_t)idx * 1000 / FPS;
 
-		if (ctx) {
-			char path[PATH_MAX];
+		memcpy(f->data, data, ISIZE);
+		f->seq = idx;
+		f->ts_ns = 0;
+		f->pts_ms = pts;
+		f->gen = gen;
+		measure_frame(f);
 
-			switch (paint_frame(ctx, buf.sequence, data)) {
-			case TOGGLE_Y16_RECORD:
-				if (record) {
-					lavc_end_encode(record);
-					record = NULL;
-					break;
-				}
+		consumer_push(pb->render, f);
+		frame_put(f);
 
-				snprintf(path, sizeof(path), "%ld-raw.mkv",
-					 time(NULL));
+		idx += dir;
+		if (idx >= pb->nr_frames)
+			idx = 0;
+		else if (idx < 0)
+			idx = pb->nr_frames - 1;
+	}
 
-				record = lavc_start_encode(path, WIDTH, HEIGHT,
-							   FPS,
-							   AV_PIX_FMT_GRAY16LE);
-				break;
+	atomic_store(&pb->done, true);
+	return NULL;
+}
 
-			case QUIT_PROGRAM:
-				goto out;
-			}
-		}
+static void playback_seek(struct playback *pb, int target, int dir)
+{
+	if (target < 0)
+		target = 0;
 
-		v4l2_put_buffer(dev, &buf);
-	}
-out:
-	if (record) {
-		lavc_end_encode(record);
-		record = NULL;
-	}
+	if (target >= pb->nr_frames)
+		target = pb->nr_frames - 1;
 
-	v4l2_close(dev);
+	atomic_store(&pb->target, target);
+	atomic_store(&pb->dir, dir);
+	atomic_fetch_add(&pb->gen, 1);
 }
 
 static void run_playback(struct sdl_ctx *ctx, const char *filepath)
 {
-	const uint8_t *data = NULL;
-	struct lavc_ctx *in_ctx;
-	uint32_t seq = 0;
+	struct frame *f, *cur = NULL, *next = NULL;
+	int speed_idx = 4, speed = 1, dir = 1;
+	struct playback pb;
+	sigset_t all, old;
+	pthread_t thread;
+	struct evloop *loop;
+	int64_t clock = 0;
+	bool resync = true;
 	bool paused = 0;
-	int timer_fd;
+	uint64_t ticks;
+
+	pb.lavc = lavc_start_decode(filepath);
+	pb.nr_frames = lavc_decode_frames(pb.lavc);
+	pb.cache = frame_cache_create(PLAYBACK_CACHE, ISIZE);
+	pb.pool = frame_pool_create(PLAYBACK_DEPTH + 3, ISIZE);
+	pb.render = consumer_start("playback", PLAYBACK_DEPTH, RING_BLOCK,
+				   NULL, NULL);
+	atomic_init(&pb.target, 0);
+	atomic_init(&pb.dir, 1);
+	atomic_init(&pb.gen, 0);
+	atomic_init(&pb.stop, false);
+	atomic_init(&pb.done, false);
+
+	if (seek_frame)
+		playback_seek(&pb, seek_frame, dir);
 
-	in_ctx = lavc_start_decode(filepath);
-	timer_fd = new_periodic_tfd(1000 / FPS);
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&thread, NULL, decode_thread, &pb))
+		errx(1, "can't start decode thread");
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	/*
+	 * The window is repainted on every tick of the playback clock, and
+	 * input is handled in between.
+	 */
+	loop = evloop_new();
+	evloop_add_timer(loop, 1000 / FPS, add_ticks, &ticks);
 
 	while (!stop) {
-		uint64_t ticks;
+		int action, target;
 
-		if (!data || !paused) {
-			data = lavc_decode(in_ctx);
-			if (!data) {
-				lavc_decode_loop(in_ctx);
-				sdl_loop(ctx);
-				seq = 0;
+		ticks = 0;
+		evloop_run_once(loop, input_timeout(ctx));
+		if (!ticks) {
+			action = sdl_poll(ctx);
+			if (action == NOTHING || !cur)
 				continue;
-			}
-		}
 
-		if (read(timer_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
-			err(1, "bad timerfd read");
+			goto act;
+		}
 
 		if (!paused)
-			seq += ticks;
+			clock += (int64_t)ticks * (1000 / FPS) * speed;
+
+		/*
+		 * Show the newest frame that's due: if the renderer stalled,
+		 * this skips frames to catch up instead of slowing down.
+		 */
+		while (resync || !paused) {
+			bool wrapped;
+
+			if (!next)
+				next = consumer_pop(pb.render,
+						    resync && !cur ? 100 : 0);
+
+			if (!next)
+				break;
+
+			if (next->gen != atomic_load(&pb.gen)) {
+				frame_put(next);
+				next = NULL;
+				continue;
+			}
+
+			wrapped = cur && !resync &&
+				  ((int64_t)next->seq - cur->seq) * dir < 0;
+
+			if (cur && !resync && !wrapped &&
+			    (dir > 0 ? next->pts_ms > clock :
+				       next->pts_ms < clock))
+				break;
+
+			if (wrapped)
+				sdl_loop(ctx);
+
+			if (resync || wrapped)
+				clock = next->pts_ms;
 
-		switch (paint_frame(ctx, seq, data)) {
+			if (cur)
+				frame_put(cur);
+
+			cur = next;
+			next = NULL;
+			resync = false;
+		}
+
+		if (!cur)
+			continue;
+
+		sdl_set_roi(ctx, 0, cur->roi, cur->nr_roi);
+		action = paint_frame(ctx, cur->seq, 0, cur->data);
+act:
+		target = -1;
+		switch (action) {
 		case TOGGLE_PAUSE:
 			paused = !paused;
 			break;
 
+		case STEP_FORWARD:
+			paused = true;
+			dir = 1;
+			target = cur->seq + 1;
+			break;
+
+		case STEP_BACK:
+			paused = true;
+			dir = -1;
+			target = cur->seq ? cur->seq - 1 : 0;
+			break;
+
+		case SPEED_UP:
+			if (speed_idx < nr_playback_speeds - 1)
+				speed_idx++;
+
+			break;
+
+		case SPEED_DOWN:
+			if (speed_idx > 0)
+				speed_idx--;
+
+			break;
+
+		case JUMP_FORWARD:
+			target = cur->seq + SEEK_FRAMES;
+			break;
+
+		case JUMP_BACK:
+			target = (int)cur->seq - SEEK_FRAMES;
+			break;
+
+		case JUMP_START:
+			target = 0;
+			break;
+
+		case JUMP_END:
+			target = pb.nr_frames - 1;
+			break;
+
 		case QUIT_PROGRAM:
 			goto out;
 		}
+
+		speed = playback_speeds[speed_idx];
+		sdl_playback_speed(ctx, speed);
+
+		/*
+		 * While playing, the decoder must go the way the clock does,
+		 * which stepping or a new speed may have changed.
+		 */
+		if (target == -1 && !paused && dir != (speed > 0 ? 1 : -1)) {
+			dir = speed > 0 ? 1 : -1;
+			target = cur->seq;
+		}
+
+		if (target != -1) {
+			playback_seek(&pb, target, dir);
+			resync = true;
+		}
 	}
 
 out:
-	close(timer_fd);
-	lavc_end_decode(in_ctx);
+	/*
+	 * The decode thread may be blocked on a full ring, so keep draining it
+	 * until the thread notices it should stop.
+	 */
+	atomic_store(&pb.stop, true);
+	while (!atomic_load(&pb.done)) {
+		f = consumer_pop(pb.render, 10);
+		if (f)
+			frame_put(f);
+	}
+
+	pthread_join(thread, NULL);
+	consumer_stop(pb.render);
+
+	if (cur)
+		frame_put(cur);
+
+	if (next)
+		frame_put(next);
+
+	evloop_free(loop);
+	frame_pool_destroy(pb.pool);
+	frame_cache_destroy(pb.cache);
+	lavc_end_decode(pb.lavc);
 }
 
-static void run_remote(struct sdl_ctx *ctx, const struct sockaddr_in6 *src)
-{
-	uint32_t seq = 0;
+/*
+ * The remote viewer receives frames in its own thread, so the socket is always
+ * drained as fast as the network delivers: if rendering stalls, the frames it
+ * missed are dropped here instead of piling up in the kernel's socket buffer,
+ * and the renderer always picks up the newest complete frame. The thread
+ * signals done_fd when the stream ends.
+ */
+struct remote_rx {
 	int fd;
+	bool udp;
+	struct wire *wire;
+	struct frame_pool *pool;
+	struct consumer *render;
+	int done_fd;
+};
+
+static void *receive_thread(void *arg)
+{
+	struct remote_rx *rx = arg;
 
-	fd = get_stream_connect(src);
-	if (fd == -1)
-		errx(1, "Can't connect");
+	while (1) {
+		struct wire_hdr hdr;
+		struct frame *f;
+		int ret;
 
-	while (!stop) {
-		uint8_t data[ISIZE];
-		size_t off = 0;
-		ssize_t ret;
+		/*
+		 * The ring holds RENDER_DEPTH frames and the renderer one more,
+		 * so the pool can never run dry.
+		 */
+		f = frame_pool_get(rx->pool);
+		if (!f)
+			errx(1, "receive pool exhausted");
 
-		do {
-			ret = read(fd, data + off, ISIZE - off);
-			if (ret <= 0)
-				break;
+		if (rx->udp) {
+			ret = wire_recv_dgram(rx->wire, rx->fd, &hdr, f->data,
+					      f->roi);
+		} else {
+			ret = wire_recv(rx->wire, rx->fd, &hdr, f->data,
+					f->roi);
+			stream_rearm(rx->fd, &tcp_opts);
+		}
 
-		} while ((off += ret) < ISIZE);
+		if (ret) {
+			frame_put(f);
+			break;
+		}
 
-		if (off != ISIZE)
-			goto out;
+		/*
+		 * The capture time is from the remote's clock, so it's no use
+		 * for measuring latency here. The remote measured its regions
+		 * of interest already.
+		 */
+		f->seq = hdr.seq;
+		f->ts_ns = 0;
+		f->nr_roi = hdr.nr_roi;
+		log_frame(0, f, hdr.ts_ns);
+		consumer_push(rx->render, f);
+		frame_put(f);
+	}
 
-		switch (paint_frame(ctx, ++seq, data)) {
-		case QUIT_PROGRAM:
-			goto out;
+	if (eventfd_write(rx->done_fd, 1))
+		err(1, "bad eventfd write");
+
+	return NULL;
+}
+
+/*
+ * Ask the server for a cheaper view of the stream. With 8-bit quantization,
+ * it uses the range the colour scale is fixed to, or each frame's own range if
+ * it isn't, so the request is repeated whenever that changes.
+ */
+static void request_view(struct sdl_ctx *ctx, int fd, bool force)
+{
+	uint8_t msg[WIRE_VIEW_MSG_LEN];
+	uint16_t qmin = 0, qmax = 0;
+	size_t len;
+
+	if (remote_view.q8 && (!sdl_view_range(ctx, &qmin, &qmax) ||
+			       qmax <= qmin))
+		qmin = qmax = 0;
+
+	if (!force && qmin == remote_view.qmin && qmax == remote_view.qmax)
+		return;
+
+	remote_view.qmin = qmin;
+	remote_view.qmax = qmax;
+	len = wire_view_msg(msg, &remote_view);
+	if (send(fd, msg, len, MSG_NOSIGNAL) != (ssize_t)len)
+		warn("can't send view request");
+}
+
+/*
+ * Over UDP, src is the multicast group to join, or the local address to
+ * receive unicast frames on.
+ */
+static void run_remote(struct sdl_ctx *ctx, const struct sockaddr_in6 *src,
+		       bool udp)
+{
+	struct remote_rx rx = {
+		.udp = udp,
+	};
+	bool ready = false, done = false;
+	struct evloop *loop;
+	sigset_t all, old;
+	pthread_t thread;
+
+	if (udp) {
+		if (have_remote_view)
+			errx(1, "--remote-view needs a TCP stream");
+
+		rx.fd = get_dgram_listen(src);
+	} else {
+		rx.fd = get_stream_connect(src, &tcp_opts);
+		if (rx.fd == -1)
+			errx(1, "Can't connect");
+
+		if (have_remote_view)
+			request_view(ctx, rx.fd, true);
+	}
+
+	rx.wire = wire_new(WIRE_RAW, WIDTH, HEIGHT);
+	rx.pool = frame_pool_create(RENDER_DEPTH + 2, ISIZE);
+	rx.render = consumer_start("render", RENDER_DEPTH, RING_DROP_OLDEST,
+				   NULL, NULL);
+	rx.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rx.done_fd == -1)
+		err(1, "eventfd");
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&thread, NULL, receive_thread, &rx))
+		errx(1, "can't start receive thread");
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	loop = evloop_new();
+	evloop_add(loop, consumer_fd(rx.render), EPOLLIN, set_flag, &ready);
+	evloop_add(loop, rx.done_fd, EPOLLIN, set_flag, &done);
+
+	while (!stop && !done) {
+		struct frame *f = NULL;
+		int action;
+
+		check_dump_latency();
+
+		ready = false;
+		if (evloop_run_once(loop, input_timeout(ctx)) && ready) {
+			consumer_fd_clear(rx.render);
+			f = consumer_pop_latest(rx.render, 0);
+		}
+
+		if (f) {
+			sdl_set_roi(ctx, 0, f->roi, f->nr_roi);
+			action = paint_frame(ctx, f->seq, 0, f->data);
+			frame_put(f);
+		} else {
+			action = sdl_poll(ctx);
 		}
+
+		if (action == QUIT_PROGRAM)
+			break;
+
+		if (have_remote_view && remote_view.q8)
+			request_view(ctx, rx.fd, false);
 	}
 
-out:
-	close(fd);
+	/*
+	 * Kick the receive thread out of recv(): this works for unconnected
+	 * UDP sockets too, even though it reports ENOTCONN.
+	 */
+	shutdown(rx.fd, SHUT_RDWR);
+	pthread_join(thread, NULL);
+
+	evloop_free(loop);
+	close(rx.done_fd);
+	consumer_stop(rx.render);
+	frame_pool_destroy(rx.pool);
+	wire_free(rx.wire);
+	close(rx.fd);
+}
+
+/*
+ * Prefer a size which matches a known profile, since some devices also list
+ * sizes which aren't really the thermal image.
+ */
+static const struct dev_profile *probe_device(const char *path)
+{
+	struct v4l2_frmsize_discrete sizes[16];
+	const struct dev_profile *p;
+	int i, nr;
+
+	nr = v4l2_frame_sizes(path, V4L2_PIX_FMT_YUYV, sizes, 16);
+	for (i = 0; i < nr; i++) {
+		p = dev_profile_match(sizes[i].width, sizes[i].height);
+		if (p && strcmp(p->name, "generic"))
+			return p;
+	}
+
+	for (i = 0; i < nr; i++) {
+		p = dev_profile_match(sizes[i].width, sizes[i].height);
+		if (p) {
+			warnx("unknown camera '%s', assuming %dx%d at %d fps",
+			      path, p->width, p->height, p->fps);
+			return p;
+		}
+	}
+
+	errx(1, "'%s' has no usable YUYV frame sizes, is it the correct "
+		"device? Pass '-d' to specify a different one", path);
+}
+
+/*
+ * The profile has to be chosen before anything allocates frames, so devices
+ * are probed here rather than when they are opened. Recordings always use the
+ * profile for their own frame size, and remote streams default to the TC001.
+ */
+static void select_profile(char *const *devpaths, const char *filepath)
+{
+	const struct dev_profile *p = NULL;
+	int i, width, height;
+
+	if (profile_name) {
+		p = dev_profile_find(profile_name);
+		if (!p)
+			errx(1, "unknown device profile '%s'", profile_name);
+	}
+
+	if (filepath) {
+		lavc_probe_size(filepath, &width, &height);
+		if (p && (p->width != width || p->height != height))
+			errx(1, "'%s' is %dx%d, not %s", filepath, width,
+			     height, p->name);
+
+		p = dev_profile_for_size(width, height);
+	} else if (nr_cameras && !p) {
+		p = probe_device(devpaths[0]);
+		width = p->width;
+		height = p->height;
+
+		/*
+		 * Every camera shares the profile, so they must all match.
+		 */
+		for (i = 1; i < nr_cameras; i++) {
+			p = probe_device(devpaths[i]);
+			if (p->width != width || p->height != height)
+				errx(1, "'%s' is %dx%d, but '%s' is %dx%d",
+				     devpaths[i], p->width, p->height,
+				     devpaths[0], width, height);
+		}
+	}
+
+	if (p)
+		cur_profile = p;
+}
+
+/*
+ * Ring files after the first camera's have the camera number appended. With
+ * several cameras, the main thread is pinned to each camera's CPU in turn
+ * while it starts that camera's threads, so they inherit it.
+ */
+static void sinks_start(void)
+{
+	int i, cpus[MAX_CAMERAS];
+	char path[PATH_MAX];
+	cpu_set_t orig;
+
+	/*
+	 * nth_cpu() counts from the calling thread's own affinity, so this
+	 * has to be worked out before the first pin.
+	 */
+	for (i = 0; i < nr_cameras; i++)
+		cpus[i] = nr_cameras > 1 ? nth_cpu(i) : -1;
+
+	if (sched_getaffinity(0, sizeof(orig), &orig))
+		err(1, "sched_getaffinity");
+
+	for (i = 0; i < nr_cameras; i++) {
+		struct sink *s = &sinks[i];
+
+		if (cpus[i] != -1)
+			pin_thread(cpus[i]);
+
+		s->idx = i;
+		/*
+		 * Each of the recording and the ring file may hold up to
+		 * RECORD_DEPTH + 1 frames. The backlog copies every frame, so
+		 * it holds none.
+		 */
+		if (use_gate)
+			s->gate = gate_new(&gate_opts, WIDTH, HEIGHT, FPS,
+					   cur_profile->raw_per_kelvin,
+					   2 * (RECORD_DEPTH + 1));
+
+		if (backlog_secs)
+			s->backlog = backlog_create(backlog_secs * FPS, ISIZE);
+
+		if (ring_path) {
+			if (i)
+				snprintf(path, sizeof(path), "%s.%d",
+					 ring_path, i);
+			else
+				snprintf(path, sizeof(path), "%s", ring_path);
+
+			s->ring = recorder_start_ring(path, WIDTH, HEIGHT,
+						      ring_frames, threaded);
+		}
+
+		if (listen_only || udp_dst.sin6_family)
+			s->tx = remote_tx_start(i, listen_only,
+						udp_dst.sin6_family ? &udp_dst :
+								      NULL);
+	}
+
+	if (nr_cameras > 1 &&
+	    pthread_setaffinity_np(pthread_self(), sizeof(orig), &orig))
+		warnx("can't restore main thread CPU affinity");
+}
+
+static void sinks_stop(void)
+{
+	int i;
+
+	for (i = 0; i < nr_cameras; i++) {
+		if (sinks[i].backlog)
+			backlog_destroy(sinks[i].backlog);
+
+		if (sinks[i].gate)
+			gate_free(sinks[i].gate);
+
+		if (sinks[i].tx)
+			remote_tx_stop(sinks[i].tx);
+	}
 }
 
 __attribute__((noreturn)) static void show_help_and_die(void)
 {
-	puts("usage: ./ircam [ -c remote | -p recfile | -d dev [-n] [-l] ] "
-	     "[-f fontpath] [-w window_pixel_width] [-q]");
+	puts("usage: ./ircam [ -c remote | -p recfile [--seek frame] |"
+	     " -d dev [-d dev...] [-n] [-l] [-t] ]");
+	puts("       ./ircam -p recfile --export outfile"
+	     " [--view key=val,...|@viewfile] [--rgb-encoder ...]");
+	puts("       [-f fontpath] [-w window_pixel_width] [-q] [--gpu]");
+	puts("       [-b nr_v4l2_buffers] [--v4l2-memory mmap|userptr|dmabuf]");
+	puts("       [--wire-payload raw|rice]"
+	     " [--slow-clients skip|disconnect]");
+	puts("       [--udp-send addr] [-u]"
+	     " [--tcp-opts rcvbuf=N,nodelay=0|1,quickack=0|1]");
+	puts("       [--remote-view crop=x:y:w:h,decimate=N,rate=N,q8=0|1]");
+	puts("       [--raw-encoder profile[,key=val...]]"
+	     " [--rgb-encoder profile[,key=val...]]");
+	puts("       [--stats-socket path] [--stats-interval seconds]");
+	puts("       [--ring-file path [--ring-frames N]]"
+	     " [--pre-record seconds]");
+	puts("       [--record-gate threshold=K,keepalive=S,lead=S,hold=S]");
+	puts("       [--profile tc001|384x288|640x512] [--port N]");
+	puts("       [--roi name=x,y[,w,h]|@roifile ...] [--roi-log path|-]");
 
 	exit(1);
 }
@@ -252,9 +1713,34 @@ int main(int argc, char **argv)
 		{ "record-only", no_argument, NULL, 'n' },
 		{ "font", required_argument, NULL, 'f' },
 		{ "quiet", no_argument, NULL, 'q' },
+		{ "threaded", no_argument, NULL, 't' },
+		{ "buffers", required_argument, NULL, 'b' },
+		{ "v4l2-memory", required_argument, NULL, OPT_V4L2_MEMORY },
+		{ "wire-payload", required_argument, NULL, OPT_WIRE_PAYLOAD },
+		{ "slow-clients", required_argument, NULL, OPT_SLOW_CLIENTS },
+		{ "udp", no_argument, NULL, 'u' },
+		{ "udp-send", required_argument, NULL, OPT_UDP_SEND },
+		{ "tcp-opts", required_argument, NULL, OPT_TCP_OPTS },
+		{ "gpu", no_argument, NULL, OPT_GPU },
+		{ "seek", required_argument, NULL, OPT_SEEK },
+		{ "export", required_argument, NULL, OPT_EXPORT },
+		{ "view", required_argument, NULL, OPT_VIEW },
+		{ "stats-socket", required_argument, NULL, OPT_STATS_SOCKET },
+		{ "stats-interval", required_argument, NULL,
+		  OPT_STATS_INTERVAL },
+		{ "ring-file", required_argument, NULL, OPT_RING_FILE },
+		{ "ring-frames", required_argument, NULL, OPT_RING_FRAMES },
+		{ "pre-record", required_argument, NULL, OPT_PRE_RECORD },
+		{ "profile", required_argument, NULL, OPT_PROFILE },
+		{ "port", required_argument, NULL, OPT_PORT },
+		{ "roi", required_argument, NULL, OPT_ROI },
+		{ "roi-log", required_argument, NULL, OPT_ROI_LOG },
+		{ "remote-view", required_argument, NULL, OPT_REMOTE_VIEW },
+		{ "record-gate", required_argument, NULL, OPT_RECORD_GATE },
+		{ "raw-encoder", required_argument, NULL, OPT_RAW_ENCODER },
+		{ "rgb-encoder", required_argument, NULL, OPT_RGB_ENCODER },
 		{ NULL, 0, NULL, 0 },
 	};
-	char v4[sizeof("::ffff:XXX.XXX.XXX.XXX")];
 	struct sockaddr_in6 video_srcaddr = { 0 };
 	struct sigaction ignore_action = {
 		.sa_handler = SIG_IGN,
@@ -262,7 +1748,12 @@ int main(int argc, char **argv)
 	struct sigaction stop_action = {
 		.sa_handler = stopper,
 	};
-	char *v4l2dev = NULL;
+	struct sigaction dump_action = {
+		.sa_handler = dumper,
+		.sa_flags = SA_RESTART,
+	};
+	struct ctr_server *counters = NULL;
+	char *devpaths[MAX_CAMERAS];
 	char *filepath = NULL;
 	struct sdl_ctx *ctx;
 
@@ -270,13 +1761,23 @@ int main(int argc, char **argv)
 	sigaction(SIGTERM, &stop_action, NULL);
 	sigaction(SIGPIPE, &ignore_action, NULL);
 	sigaction(SIGHUP, &ignore_action, NULL);
+	sigaction(SIGUSR1, &dump_action, NULL);
+	stats_init();
+
+	lavc_parse_enc_opts(&raw_opts, "default");
+	lavc_parse_enc_opts(&rgb_opts, "default");
 
 	while (1) {
-		int i = getopt_long(argc, argv, "hd:p:nw:f:lc:q", opts, NULL);
+		int i;
+
+		i = getopt_long(argc, argv, "hd:p:nw:f:lc:qtb:u", opts, NULL);
 
 		switch (i) {
 		case 'd':
-			v4l2dev = strdup(optarg);
+			if (nr_cameras == MAX_CAMERAS)
+				errx(1, "at most %d cameras", MAX_CAMERAS);
+
+			devpaths[nr_cameras++] = strdup(optarg);
 			break;
 		case 'n':
 			record_only = 1;
@@ -298,20 +1799,115 @@ int main(int argc, char **argv)
 			listen_only = 1;
 			break;
 		case 'c':
-			video_srcaddr.sin6_family = AF_INET6;
-			if (inet_pton(AF_INET6, optarg,
-				      &video_srcaddr.sin6_addr) == 1)
-				break;
-
-			snprintf(v4, sizeof(v4), "::ffff:%s", optarg);
-			if (inet_pton(AF_INET6, v4, &video_srcaddr.sin6_addr) ==
-			    1)
-				break;
-
-			errx(1, "Can't parse address '%s'", optarg);
+			parse_addr(&video_srcaddr, optarg);
+			break;
+		case 'u':
+			udp_recv = 1;
+			break;
+		case OPT_UDP_SEND:
+			parse_addr(&udp_dst, optarg);
+			break;
 		case 'q':
 			hide_init_help = 1;
 			break;
+		case 't':
+			threaded = 1;
+			break;
+		case 'b':
+			v4l2_buffers = atoi(optarg);
+			if (v4l2_buffers < 1)
+				errx(1, "bad V4L2 buffer count '%s'", optarg);
+
+			break;
+		case OPT_V4L2_MEMORY:
+			v4l2_memory = parse_v4l2_memory(optarg);
+			break;
+		case OPT_WIRE_PAYLOAD:
+			wire_payload = wire_parse_payload(optarg);
+			break;
+		case OPT_SLOW_CLIENTS:
+			if (!strcmp(optarg, "skip"))
+				slow_clients = SLOW_CLIENT_SKIP;
+			else if (!strcmp(optarg, "disconnect"))
+				slow_clients = SLOW_CLIENT_DISCONNECT;
+			else
+				errx(1, "bad slow client policy '%s'", optarg);
+
+			break;
+		case OPT_GPU:
+			use_gpu = 1;
+			break;
+		case OPT_EXPORT:
+			export_path = optarg;
+			break;
+		case OPT_VIEW:
+			export_parse_view(&export_view, optarg);
+			break;
+		case OPT_SEEK:
+			seek_frame = atoi(optarg);
+			if (seek_frame < 0)
+				errx(1, "bad seek frame '%s'", optarg);
+
+			break;
+		case OPT_STATS_SOCKET:
+			stats_socket = optarg;
+			break;
+		case OPT_STATS_INTERVAL:
+			stats_interval = atoi(optarg);
+			if (stats_interval < 1)
+				errx(1, "bad stats interval '%s'", optarg);
+
+			break;
+		case OPT_RING_FILE:
+			ring_path = optarg;
+			break;
+		case OPT_RING_FRAMES:
+			ring_frames = atoi(optarg);
+			if (ring_frames < 1)
+				errx(1, "bad ring file length '%s'", optarg);
+
+			break;
+		case OPT_PRE_RECORD:
+			backlog_secs = atoi(optarg);
+			if (backlog_secs < 1)
+				errx(1, "bad pre-record time '%s'", optarg);
+
+			break;
+		case OPT_PROFILE:
+			profile_name = optarg;
+			break;
+		case OPT_PORT:
+			base_port = atoi(optarg);
+			if (base_port < 1 || base_port > 65535 - MAX_CAMERAS)
+				errx(1, "bad port '%s'", optarg);
+
+			break;
+		case OPT_ROI:
+			nr_rois = roi_parse(rois, nr_rois, optarg);
+			break;
+		case OPT_ROI_LOG:
+			roi_log_path = optarg;
+			break;
+		case OPT_TCP_OPTS:
+			stream_parse_opts(&tcp_opts, optarg);
+			break;
+		case OPT_REMOTE_VIEW:
+			wire_parse_view(&remote_view, optarg);
+			have_remote_view = 1;
+			break;
+		case OPT_RECORD_GATE:
+			gate_parse_opts(&gate_opts, optarg);
+			use_gate = 1;
+			break;
+		case OPT_RAW_ENCODER:
+			lavc_parse_enc_opts(&raw_opts, optarg);
+			if (raw_opts.hw)
+				errx(1, "H.264 can't record 16-bit video");
+
+			break;
+		case OPT_RGB_ENCODER:
+			lavc_parse_enc_opts(&rgb_opts, optarg);
+			break;
 		case 'h':
 		default:
 			show_help_and_die();
@@ -321,56 +1917,100 @@ int main(int argc, char **argv)
 	}
 done:
 
-	if (!v4l2dev && !filepath && !video_srcaddr.sin6_family)
-		v4l2dev = strdup("/dev/video0");
+	if (!nr_cameras && !filepath && !video_srcaddr.sin6_family)
+		devpaths[nr_cameras++] = strdup("/dev/video0");
 
-	if (v4l2dev && filepath)
+	if (nr_cameras && filepath)
 		show_help_and_die();
 
-	if (v4l2dev && video_srcaddr.sin6_family)
+	if (nr_cameras && video_srcaddr.sin6_family)
 		show_help_and_die();
 
 	if (filepath && video_srcaddr.sin6_family)
 		show_help_and_die();
 
-	if (record_only || listen_only) {
-		if (record_only) {
-			char path[PATH_MAX];
+	/*
+	 * Only the threaded pipeline can capture from several cameras.
+	 */
+	if (nr_cameras > 1)
+		threaded = 1;
 
-			snprintf(path, sizeof(path), "%ld-raw.mkv", time(NULL));
-			record = lavc_start_encode(path, WIDTH, HEIGHT, FPS,
-						   AV_PIX_FMT_GRAY16LE);
-		}
+	select_profile(devpaths, filepath);
+	roi_check(rois, nr_rois, WIDTH, HEIGHT);
 
-		if (listen_only) {
-			remote_socket =
-				fdopen(get_stream_listen_one(8888), "w");
-			if (!remote_socket)
-				err(1, "Error on remote socket");
-		}
+	if (stats_socket || stats_interval)
+		counters = ctr_server_start(stats_socket, stats_interval);
+
+	if (export_path) {
+		if (!filepath)
+			show_help_and_die();
+
+		export_run(filepath, export_path, &export_view, &rgb_opts,
+			   &stop);
+		goto out;
+	}
+
+	if ((backlog_secs || ring_path || use_gate) && !nr_cameras)
+		show_help_and_die();
+
+	if (!ring_frames)
+		ring_frames = RING_FRAMES;
+
+	if (roi_log_path && !strcmp(roi_log_path, "-")) {
+		roi_file = stdout;
+	} else if (roi_log_path) {
+		roi_file = fopen(roi_log_path, "w");
+		if (!roi_file)
+			err(1, "can't open region log '%s'", roi_log_path);
+	}
+
+	if (roi_file)
+		roi_log_header(roi_file);
+
+	sinks_start();
+
+	if (record_only || listen_only || udp_dst.sin6_family) {
+		if (threaded)
+			run_v4l2_threaded(NULL, devpaths, nr_cameras);
+		else
+			run_v4l2(NULL, devpaths[0]);
 
-		run_v4l2(NULL, v4l2dev);
 		goto out;
 	}
 
 	ctx = sdl_open(window_width, window_height, !!filepath, fontpath,
-		       hide_init_help);
+		       hide_init_help, threaded, &rgb_opts, use_gpu,
+		       nr_cameras ? nr_cameras : 1);
 	if (!ctx)
 		errx(1, "can't initialize libsdl");
 
+	sdl_roi_names(ctx, rois, nr_rois);
+
 	if (filepath) {
 		run_playback(ctx, filepath);
-	} else if (v4l2dev) {
-		run_v4l2(ctx, v4l2dev);
+	} else if (nr_cameras && threaded) {
+		run_v4l2_threaded(ctx, devpaths, nr_cameras);
+	} else if (nr_cameras) {
+		run_v4l2(ctx, devpaths[0]);
 	} else if (video_srcaddr.sin6_family) {
-		video_srcaddr.sin6_port = htons(8888);
-		run_remote(ctx, &video_srcaddr);
+		video_srcaddr.sin6_port = htons(base_port);
+		run_remote(ctx, &video_srcaddr, udp_recv);
 	}
 
 	sdl_close(ctx);
 out:
+	lat_dump(stderr);
+	if (counters)
+		ctr_server_stop(counters);
+
+	sinks_stop();
+	if (roi_file && roi_file != stdout)
+		fclose(roi_file);
+
+	while (nr_cameras)
+		free(devpaths[--nr_cameras]);
+
 	free((void *)fontpath);
-	free(v4l2dev);
 	free(filepath);
 	return 0;
 }
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "palette.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dev.h"
+
+/*
+ * Lookup table for the Turbo colormap (see README).
+ */
+#include "turbo.h"
+
+/*
+ * 8-bit gamma correction lookup tables are precomputed by mkgamma.py.
+ */
+#include "gamma.h"
+
+static uint8_t getcolor(const struct palette_cfg *cfg, int color, uint8_t r)
+{
+	if (cfg->contours > 1) {
+		uint16_t fr = r * cfg->contours;
+		r = fr & 0xFF;
+	}
+
+	if (cfg->gammafactor)
+		r = gammalookup[cfg->gammafactor][r];
+
+	if (cfg->invert)
+		r = ~r;
+
+	if (cfg->colormap)
+		return turbo_srgb_bytes[r][color];
+
+	return r;
+}
+
+/*
+ * The output is always BGRA in memory (see sdl_open()), regardless of the
+ * endianness of the machine: build each entry bytewise.
+ */
+static uint32_t getpixel(const struct palette_cfg *cfg, uint8_t pval)
+{
+	const uint8_t bgra[4] = {
+		getcolor(cfg, BLUE, pval),
+		getcolor(cfg, GREEN, pval),
+		getcolor(cfg, RED, pval),
+		255,
+	};
+	uint32_t ret;
+
+	memcpy(&ret, bgra, sizeof(ret));
+	return ret;
+}
+
+/*
+ * The same pixel in 8-bit BT.601 limited range YCbCr, the usual input for
+ * hardware H.264 encoders, packed in the same bytewise way.
+ */
+static uint32_t getpixel_yuv(const struct palette_cfg *cfg, uint8_t pval)
+{
+	int r = getcolor(cfg, RED, pval);
+	int g = getcolor(cfg, GREEN, pval);
+	int b = getcolor(cfg, BLUE, pval);
+	const uint8_t yuv[4] = {
+		16 + ((66 * r + 129 * g + 25 * b + 128) >> 8),
+		128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8),
+		128 + ((112 * r - 94 * g - 18 * b + 128) >> 8),
+		0,
+	};
+	uint32_t ret;
+
+	memcpy(&ret, yuv, sizeof(ret));
+	return ret;
+}
+
+/**
+ * palette_parse_gamma() - Look up a gamma correction setting by name.
+ * @param name Gamma value as shown in the overlay, like "0.50".
+ *
+ * Return: Value for palette_cfg.gammafactor, or -1 if there is no such
+ *	   setting.
+ */
+int palette_parse_gamma(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr_gammavals; i++)
+		if (!strcmp(name, gammavals[i]))
+			return i;
+
+	return -1;
+}
+
+static bool same_8bit_cfg(const struct palette_cfg *a,
+			  const struct palette_cfg *b)
+{
+	return a->gammafactor == b->gammafactor &&
+	       a->contours == b->contours && a->invert == b->invert &&
+	       a->colormap == b->colormap && a->yuv == b->yuv;
+}
+
+/**
+ * palette_cfg_equal() - Compare two sets of view settings.
+ * @param a First settings.
+ * @param b Second settings.
+ *
+ * Return: True if every pixel comes out the same color with both.
+ */
+bool palette_cfg_equal(const struct palette_cfg *a,
+		       const struct palette_cfg *b)
+{
+	return same_8bit_cfg(a, b) && a->min == b->min && a->max == b->max;
+}
+
+static void fill(uint32_t *lut, uint32_t v, int start, int end)
+{
+	int i;
+
+	for (i = start; i < end; i++)
+		lut[i] = v;
+}
+
+/**
+ * palette_update() - Rebuild a raw-to-BGRA palette if its inputs changed.
+ * @param p Palette to update.
+ * @param cfg Desired view settings. The caller must ensure min < max.
+ *
+ * The palette maps every possible raw Y16 value directly to a final BGRA
+ * pixel, so colorizing a frame costs one load and one store per pixel.
+ *
+ * The 8-bit part of the pipeline (contours, gamma, invert, colormap) only
+ * depends on 256 distinct values, and is cached separately in pal8[]. Every
+ * lut[] entry outside [min, max] is either pal8[0] or pal8[255], so when only
+ * the view dynamic range moves (AUTO mode), we only rewrite the entries
+ * between the lowest and highest of the old and new limits.
+ *
+ * Return: True if the palette changed, false if it was already current.
+ */
+bool palette_update(struct palette *p, const struct palette_cfg *cfg)
+{
+	const struct palette_cfg *old = &p->cfg;
+	uint32_t multinv;
+	int lo, hi, v;
+
+	if (p->valid && palette_cfg_equal(old, cfg))
+		return false;
+
+	if (!p->valid || !same_8bit_cfg(old, cfg)) {
+		palette_update_pal8(p, cfg);
+		lo = 0;
+		hi = UINT16_MAX;
+	} else {
+		lo = old->min < cfg->min ? old->min : cfg->min;
+		hi = old->max > cfg->max ? old->max : cfg->max;
+	}
+
+	/*
+	 * We need to compute:
+	 *
+	 *			  V - min
+	 *			 ---------
+	 *			 max - min
+	 *
+	 * ...for each distinct pixel value V. Because the denominator is the
+	 * same for every pixel, we can calculate the multiplicative inverse of
+	 * (max - min) with a single division, and subsequently use hardware
+	 * multiplication to compute the ratio for each pixel.
+	 */
+
+	multinv = (1UL << 24) / ((uint32_t)cfg->max - cfg->min);
+
+	fill(p->lut, p->pal8[0], lo, cfg->min + 1);
+	for (v = cfg->min + 1; v < cfg->max; v++)
+		p->lut[v] = p->pal8[(multinv * (v - cfg->min)) >> 16];
+
+	fill(p->lut, p->pal8[255], cfg->max, hi + 1);
+
+	p->cfg = *cfg;
+	p->valid = true;
+	return true;
+}
+
+/**
+ * palette_update_pal8() - Rebuild only the 8-bit part of a palette.
+ * @param p Palette to update.
+ * @param cfg Desired view settings. The min and max are ignored.
+ *
+ * This is for callers which apply the dynamic range themselves (see gpu.c),
+ * and only need pal8[]. It leaves lut[] stale, so the next palette_update()
+ * rebuilds all of it.
+ *
+ * Return: True if pal8[] changed, false if it was already current.
+ */
+bool palette_update_pal8(struct palette *p, const struct palette_cfg *cfg)
+{
+	int v;
+
+	if (p->pal8_valid && same_8bit_cfg(&p->cfg, cfg))
+		return false;
+
+	for (v = 0; v < 256; v++)
+		p->pal8[v] = cfg->yuv ? getpixel_yuv(cfg, v) :
+					getpixel(cfg, v);
+
+	p->cfg = *cfg;
+	p->pal8_valid = true;
+	p->valid = false;
+	return true;
+}
+
+/*
+ * Rotating the output by 180° is equivalent to iterating through the flattened
+ * BGRA array backwards.
+ */
+static inline __attribute__((always_inline)) void
+colorize(const struct palette *p, uint32_t *restrict dst,
+	 const uint8_t *restrict src, int nr_pixels, bool rotate)
+{
+	int i;
+
+	if (rotate) {
+		for (i = 0; i < nr_pixels; i++)
+			dst[nr_pixels - 1 - i] =
+				p->lut[src[i * 2] | src[i * 2 + 1] << 8];
+
+		return;
+	}
+
+	for (i = 0; i < nr_pixels; i++)
+		dst[i] = p->lut[src[i * 2] | src[i * 2 + 1] << 8];
+}
+
+/*
+ * One copy of colorize() for each known frame size: with a constant trip count
+ * the compiler can unroll the loop without any remainder handling.
+ */
+#define COLORIZE_SIZE(w, h)                                                  \
+	static void colorize_##w##x##h(const struct palette *p,              \
+				       uint32_t *dst, const uint8_t *src,    \
+				       bool rotate)                          \
+	{                                                                    \
+		colorize(p, dst, src, (w) * (h), rotate);                    \
+	}
+
+DEV_SIZES(COLORIZE_SIZE)
+
+/**
+ * palette_colorize() - Convert a raw Y16LE framebuffer to BGRA.
+ * @param p Palette handle, see palette_update().
+ * @param dst Output BGRA framebuffer.
+ * @param src Input Y16LE framebuffer.
+ * @param nr_pixels Number of pixels in the framebuffer.
+ * @param rotate Rotate the output by 180 degrees.
+ *
+ * Return: Nothing.
+ */
+void palette_colorize(const struct palette *p, uint32_t *dst,
+		      const uint8_t *src, int nr_pixels, bool rotate)
+{
+#define COLORIZE_CASE(w, h)                                                  \
+	case (w) * (h):                                                      \
+		colorize_##w##x##h(p, dst, src, rotate);                     \
+		return;
+
+	switch (nr_pixels) {
+		DEV_SIZES(COLORIZE_CASE)
+	}
+
+	colorize(p, dst, src, nr_pixels, rotate);
+}
+
+/**
+ * palette_colorize_nv12() - Convert a raw Y16LE framebuffer to NV12.
+ * @param p Palette handle, see palette_update(), which must have been built
+ *	    with palette_cfg.yuv set.
+ * @param dst Output framebuffer: the Y plane, then the interleaved CbCr plane,
+ *	      with no padding.
+ * @param src Input Y16LE framebuffer.
+ * @param width Width of the framebuffer, which must be even.
+ * @param height Height of the framebuffer, which must be even.
+ * @param rotate Rotate the output by 180 degrees.
+ *
+ * Each chroma sample is the average of the four pixels it covers, so this is
+ * the only pass over the frame an NV12 recording needs.
+ *
+ * Return: Nothing.
+ */
+void palette_colorize_nv12(const struct palette *p, uint8_t *dst,
+			   const uint8_t *src, int width, int height,
+			   bool rotate)
+{
+	uint8_t *restrict uv = dst + width * height;
+	uint8_t *restrict y = dst;
+	int row, col;
+
+	for (row = 0; row < height; row += 2) {
+		const uint8_t *s0 = src + row * width * 2;
+		const uint8_t *s1 = s0 + width * 2;
+		uint8_t *y0, *y1, *c;
+		int step;
+
+		/*
+		 * Rotated, the pair of rows lands at the bottom of the output
+		 * reversed, the other way up.
+		 */
+		if (rotate) {
+			y0 = y + (height - 1 - row) * width + width - 1;
+			y1 = y0 - width;
+			c = uv + (height / 2 - 1 - row / 2) * width + width - 2;
+			step = -1;
+		} else {
+			y0 = y + row * width;
+			y1 = y0 + width;
+			c = uv + row / 2 * width;
+			step = 1;
+		}
+
+		for (col = 0; col < width; col += 2) {
+			const uint8_t *a, *b, *d, *e;
+
+			a = (const uint8_t *)&p->lut[s0[0] | s0[1] << 8];
+			b = (const uint8_t *)&p->lut[s0[2] | s0[3] << 8];
+			d = (const uint8_t *)&p->lut[s1[0] | s1[1] << 8];
+			e = (const uint8_t *)&p->lut[s1[2] | s1[3] << 8];
+
+			y0[0] = a[0];
+			y0[step] = b[0];
+			y1[0] = d[0];
+			y1[step] = e[0];
+			c[0] = (a[1] + b[1] + d[1] + e[1] + 2) >> 2;
+			c[1] = (a[2] + b[2] + d[2] + e[2] + 2) >> 2;
+
+			s0 += 4;
+			s1 += 4;
+			y0 += step * 2;
+			y1 += step * 2;
+			c += step * 2;
+		}
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Everything which determines the color of a pixel with a given raw value.
+ * With yuv set, palette entries are BT.601 limited range Y, Cb, and Cr bytes
+ * for palette_colorize_nv12() instead of BGRA.
+ */
+struct palette_cfg {
+	uint16_t min;
+	uint16_t max;
+	int gammafactor;
+	int contours;
+	bool invert;
+	bool colormap;
+	bool yuv;
+};
+
+struct palette {
+	struct palette_cfg cfg;
+	bool valid;
+	bool pal8_valid;
+	uint32_t pal8[256];
+	uint32_t lut[65536];
+};
+
+int palette_parse_gamma(const char *name);
+
+bool palette_cfg_equal(const struct palette_cfg *a,
+		       const struct palette_cfg *b);
+
+bool palette_update(struct palette *p, const struct palette_cfg *cfg);
+
+bool palette_update_pal8(struct palette *p, const struct palette_cfg *cfg);
+
+void palette_colorize(const struct palette *p, uint32_t *dst,
+		      const uint8_t *src, int nr_pixels, bool rotate);
+
+void palette_colorize_nv12(const struct palette *p, uint8_t *dst,
+			   const uint8_t *src, int width, int height,
+			   bool rotate);
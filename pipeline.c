@@ -0,0 +1,578 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/**
+ * frame_get() - Take an additional reference to a frame.
+ * @param f Frame handle.
+ *
+ * Return: Nothing.
+ */
+void frame_get(struct frame *f)
+{
+	atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * frame_put() - Drop a reference to a frame.
+ * @param f Frame handle.
+ *
+ * Return: Nothing.
+ */
+void frame_put(struct frame *f)
+{
+	if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) != 1)
+		return;
+
+	if (f->release)
+		f->release(f);
+}
+
+struct frame_pool {
+	int nr;
+	uint8_t *mem;
+	struct frame frames[];
+};
+
+/**
+ * frame_pool_create() - Preallocate a fixed number of frames.
+ * @param nr Number of frames.
+ * @param len Size of each frame's data buffer.
+ *
+ * Return: Pool handle.
+ */
+struct frame_pool *frame_pool_create(int nr, size_t len)
+{
+	struct frame_pool *p;
+	size_t stride;
+	int i;
+
+	p = calloc(1, sizeof(*p) + nr * sizeof(p->frames[0]));
+	if (!p)
+		errx(1, "can't allocate frame pool");
+
+	/*
+	 * Round each buffer up to a cacheline multiple, so the frames never
+	 * share lines between the threads working on them.
+	 */
+	stride = (len + 63) & ~(size_t)63;
+	if (posix_memalign((void **)&p->mem, 64, nr * stride))
+		errx(1, "can't allocate frame pool memory");
+
+	p->nr = nr;
+	for (i = 0; i < nr; i++) {
+		p->frames[i].data = p->mem + i * stride;
+		p->frames[i].len = len;
+		p->frames[i].priv = p;
+		atomic_init(&p->frames[i].refs, 0);
+	}
+
+	return p;
+}
+
+/**
+ * frame_pool_get() - Get a free frame from a pool.
+ * @param p Pool handle.
+ *
+ * Only one thread may call this function on a given pool. Any thread may
+ * drop the references to the frames it returns.
+ *
+ * Return: Frame with a single reference, or NULL if all frames are in use.
+ */
+struct frame *frame_pool_get(struct frame_pool *p)
+{
+	int i;
+
+	/*
+	 * Only the allocating thread moves a frame off zero, so a plain store
+	 * is enough once we see it there.
+	 */
+	for (i = 0; i < p->nr; i++) {
+		struct frame *f = &p->frames[i];
+
+		if (atomic_load_explicit(&f->refs, memory_order_acquire))
+			continue;
+
+		atomic_store_explicit(&f->refs, 1, memory_order_relaxed);
+		return f;
+	}
+
+	return NULL;
+}
+
+/**
+ * frame_pool_destroy() - Free a frame pool.
+ * @param p Pool handle.
+ *
+ * All references to frames from the pool must have been dropped.
+ *
+ * Return: Nothing.
+ */
+void frame_pool_destroy(struct frame_pool *p)
+{
+	free(p->mem);
+	free(p);
+}
+
+/*
+ * Single producer single consumer ring of frame pointers.
+ *
+ * The consumer claims the frame at the tail with a CAS. For RING_DROP_OLDEST
+ * rings the producer may do the same thing when the ring is full to steal the
+ * oldest frame, so the consumer never trusts a slot it has read until its CAS
+ * on the tail succeeds.
+ *
+ * Neither side touches the lock unless the other is asleep: a thread waiting
+ * for frames (or for space, on a RING_BLOCK ring) counts itself as a waiter
+ * under the lock, then checks the ring again before sleeping, and whoever
+ * changes the ring only wakes it if it sees a waiter.
+ *
+ * Consumers without a thread also get an eventfd, which becomes readable when
+ * a frame is pushed, so an event loop can wait for frames alongside anything
+ * else (see consumer_fd()).
+ */
+struct consumer {
+	const char *name;
+	void (*fn)(struct frame *f, void *arg);
+	void *arg;
+	enum ring_policy policy;
+	unsigned mask;
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_uint drops;
+	atomic_bool closed;
+	int event_fd;
+	pthread_mutex_t lock;
+	pthread_cond_t items;
+	pthread_cond_t space;
+	atomic_int item_waiters;
+	atomic_int space_waiters;
+	pthread_t thread;
+	struct consumer *next;
+	_Atomic(struct frame *) slots[];
+};
+
+/*
+ * Every running consumer, so their counters can be reported (see
+ * consumer_foreach()).
+ */
+static pthread_mutex_t consumers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct consumer *consumers;
+
+/*
+ * The fence pairs with the one in a waiter's check, so either the waiter sees
+ * the change to the ring, or we see the waiter.
+ */
+static void ring_wake(struct consumer *c, atomic_int *waiters,
+		      pthread_cond_t *cond)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(waiters, memory_order_relaxed))
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static bool ring_empty(struct consumer *c)
+{
+	return atomic_load_explicit(&c->tail, memory_order_acquire) ==
+	       atomic_load_explicit(&c->head, memory_order_acquire);
+}
+
+static struct frame *ring_pop(struct consumer *c)
+{
+	unsigned t = atomic_load_explicit(&c->tail, memory_order_relaxed);
+
+	while (t != atomic_load_explicit(&c->head, memory_order_acquire)) {
+		struct frame *f;
+
+		f = atomic_load_explicit(&c->slots[t & c->mask],
+					 memory_order_relaxed);
+
+		if (atomic_compare_exchange_weak_explicit(
+			    &c->tail, &t, t + 1, memory_order_acq_rel,
+			    memory_order_relaxed)) {
+			if (c->policy == RING_BLOCK)
+				ring_wake(c, &c->space_waiters, &c->space);
+
+			return f;
+		}
+	}
+
+	return NULL;
+}
+
+static bool ring_full(struct consumer *c, unsigned head)
+{
+	unsigned tail = atomic_load_explicit(&c->tail, memory_order_acquire);
+
+	return head - tail > c->mask;
+}
+
+/**
+ * consumer_push() - Queue a frame for a consumer.
+ * @param c Consumer handle.
+ * @param f Frame to queue.
+ *
+ * Takes a new reference to the frame. If the ring is full, either the oldest
+ * queued frame is dropped, or this blocks until there is space, depending on
+ * the consumer's policy.
+ *
+ * Return: Nothing.
+ */
+void consumer_push(struct consumer *c, struct frame *f)
+{
+	unsigned h = atomic_load_explicit(&c->head, memory_order_relaxed);
+
+	while (ring_full(c, h)) {
+		struct frame *old;
+
+		if (c->policy == RING_BLOCK) {
+			pthread_mutex_lock(&c->lock);
+			atomic_fetch_add(&c->space_waiters, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			if (ring_full(c, h))
+				pthread_cond_wait(&c->space, &c->lock);
+
+			atomic_fetch_sub(&c->space_waiters, 1);
+			pthread_mutex_unlock(&c->lock);
+			continue;
+		}
+
+		old = ring_pop(c);
+		if (old) {
+			atomic_fetch_add_explicit(&c->drops, 1,
+						  memory_order_relaxed);
+			frame_put(old);
+		}
+	}
+
+	frame_get(f);
+	atomic_store_explicit(&c->slots[h & c->mask], f, memory_order_relaxed);
+	atomic_store_explicit(&c->head, h + 1, memory_order_release);
+	ring_wake(c, &c->item_waiters, &c->items);
+
+	if (c->event_fd != -1 && eventfd_write(c->event_fd, 1))
+		err(1, "bad eventfd write");
+}
+
+static struct frame *consumer_wait(struct consumer *c,
+				   const struct timespec *deadline)
+{
+	struct frame *f;
+
+	while (!(f = ring_pop(c))) {
+		int r = 0;
+
+		if (atomic_load(&c->closed))
+			return NULL;
+
+		pthread_mutex_lock(&c->lock);
+		atomic_fetch_add(&c->item_waiters, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ring_empty(c) && !atomic_load(&c->closed)) {
+			if (deadline)
+				r = pthread_cond_timedwait(&c->items, &c->lock,
+							   deadline);
+			else
+				r = pthread_cond_wait(&c->items, &c->lock);
+		}
+
+		atomic_fetch_sub(&c->item_waiters, 1);
+		pthread_mutex_unlock(&c->lock);
+
+		if (r == ETIMEDOUT)
+			return ring_pop(c);
+	}
+
+	return f;
+}
+
+static struct frame *consumer_wait_ms(struct consumer *c, int timeout_ms)
+{
+	struct timespec deadline;
+
+	if (timeout_ms < 0)
+		return consumer_wait(c, NULL);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += timeout_ms % 1000 * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_nsec -= 1000000000L;
+		deadline.tv_sec++;
+	}
+
+	return consumer_wait(c, &deadline);
+}
+
+/**
+ * consumer_pop() - Take the oldest frame queued for a consumer.
+ * @param c Consumer handle, which must have been started without a thread.
+ * @param timeout_ms Maximum time to wait for a frame, or -1 to wait forever.
+ *
+ * Return: Frame, which the caller must frame_put(), or NULL on timeout.
+ */
+struct frame *consumer_pop(struct consumer *c, int timeout_ms)
+{
+	return consumer_wait_ms(c, timeout_ms);
+}
+
+/**
+ * consumer_pop_latest() - Take the newest frame queued for a consumer.
+ * @param c Consumer handle, which must have been started without a thread.
+ * @param timeout_ms Maximum time to wait for a frame, or -1 to wait forever.
+ *
+ * Any older frames still queued are dropped and counted as drops.
+ *
+ * Return: Frame, which the caller must frame_put(), or NULL on timeout.
+ */
+struct frame *consumer_pop_latest(struct consumer *c, int timeout_ms)
+{
+	struct frame *f, *next;
+
+	f = consumer_wait_ms(c, timeout_ms);
+	if (!f)
+		return NULL;
+
+	while ((next = ring_pop(c))) {
+		atomic_fetch_add_explicit(&c->drops, 1, memory_order_relaxed);
+		frame_put(f);
+		f = next;
+	}
+
+	return f;
+}
+
+static void *consumer_thread(void *arg)
+{
+	struct consumer *c = arg;
+	struct frame *f;
+
+	while ((f = consumer_wait(c, NULL))) {
+		c->fn(f, c->arg);
+		frame_put(f);
+	}
+
+	return NULL;
+}
+
+/**
+ * consumer_start() - Create a frame consumer.
+ * @param name Name of the consumer, for diagnostics.
+ * @param depth Number of queued frames, must be a power of two.
+ * @param policy What to do when the ring is full.
+ * @param fn Function to run in a new thread for each frame, or NULL.
+ * @param arg Argument passed to fn.
+ *
+ * If fn is NULL, no thread is started, and the caller is expected to
+ * retrieve frames with consumer_pop() or consumer_pop_latest().
+ *
+ * Return: Consumer handle.
+ */
+struct consumer *consumer_start(const char *name, int depth,
+				enum ring_policy policy,
+				void (*fn)(struct frame *f, void *arg),
+				void *arg)
+{
+	struct consumer *c;
+	sigset_t all, old;
+	int i;
+
+	if (depth < 2 || depth & (depth - 1))
+		errx(1, "bad ring depth %d for %s", depth, name);
+
+	c = calloc(1, sizeof(*c) + depth * sizeof(c->slots[0]));
+	if (!c)
+		errx(1, "can't allocate consumer");
+
+	c->name = name;
+	c->fn = fn;
+	c->arg = arg;
+	c->policy = policy;
+	c->mask = depth - 1;
+	atomic_init(&c->head, 0);
+	atomic_init(&c->tail, 0);
+	atomic_init(&c->drops, 0);
+	atomic_init(&c->closed, false);
+	for (i = 0; i < depth; i++)
+		atomic_init(&c->slots[i], NULL);
+
+	atomic_init(&c->item_waiters, 0);
+	atomic_init(&c->space_waiters, 0);
+	if (pthread_mutex_init(&c->lock, NULL) ||
+	    pthread_cond_init(&c->items, NULL) ||
+	    pthread_cond_init(&c->space, NULL))
+		errx(1, "can't initialize %s ring", name);
+
+	c->event_fd = -1;
+	if (!fn) {
+		c->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (c->event_fd == -1)
+			err(1, "eventfd");
+	}
+
+	pthread_mutex_lock(&consumers_lock);
+	c->next = consumers;
+	consumers = c;
+	pthread_mutex_unlock(&consumers_lock);
+
+	if (!fn)
+		return c;
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&c->thread, NULL, consumer_thread, c))
+		errx(1, "can't start %s thread", name);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return c;
+}
+
+/**
+ * consumer_fd() - Get a file descriptor to wait for frames on.
+ * @param c Consumer handle, which must have been started without a thread.
+ *
+ * The descriptor is readable once a frame has been pushed since the last
+ * consumer_fd_clear(). Pop frames with a zero timeout after it fires.
+ *
+ * Return: File descriptor, owned by the consumer.
+ */
+int consumer_fd(const struct consumer *c)
+{
+	return c->event_fd;
+}
+
+/**
+ * consumer_fd_clear() - Wait for a new push before consumer_fd() fires again.
+ * @param c Consumer handle, which must have been started without a thread.
+ *
+ * Clear it before popping, so a frame pushed in between is never missed.
+ *
+ * Return: Nothing.
+ */
+void consumer_fd_clear(struct consumer *c)
+{
+	eventfd_t v;
+
+	eventfd_read(c->event_fd, &v);
+}
+
+/**
+ * consumer_queued() - Count the frames queued for a consumer.
+ * @param c Consumer handle.
+ *
+ * Return: Number of frames waiting in the ring.
+ */
+unsigned consumer_queued(const struct consumer *c)
+{
+	unsigned tail = atomic_load_explicit(&c->tail, memory_order_acquire);
+
+	return atomic_load_explicit(&c->head, memory_order_acquire) - tail;
+}
+
+/**
+ * consumer_drops() - Count the frames dropped by a consumer.
+ * @param c Consumer handle.
+ *
+ * Return: Number of frames dropped due to overflow.
+ */
+unsigned consumer_drops(const struct consumer *c)
+{
+	return atomic_load_explicit(&c->drops, memory_order_relaxed);
+}
+
+/**
+ * consumer_foreach() - Call a function for every running consumer.
+ * @param fn Function to call with the consumer's name and handle.
+ * @param arg Argument passed to fn.
+ *
+ * Consumers can't be stopped while this runs, so fn mustn't block.
+ *
+ * Return: Nothing.
+ */
+void consumer_foreach(void (*fn)(const char *name, const struct consumer *c,
+				 void *arg),
+		      void *arg)
+{
+	struct consumer *c;
+
+	pthread_mutex_lock(&consumers_lock);
+	for (c = consumers; c; c = c->next)
+		fn(c->name, c, arg);
+
+	pthread_mutex_unlock(&consumers_lock);
+}
+
+/**
+ * consumer_stop() - Stop and free a consumer.
+ * @param c Consumer handle.
+ *
+ * The consumer's thread processes every frame already queued before it
+ * exits. The producer must not call consumer_push() concurrently.
+ *
+ * Return: Nothing.
+ */
+void consumer_stop(struct consumer *c)
+{
+	struct consumer **p;
+	struct frame *f;
+
+	pthread_mutex_lock(&consumers_lock);
+	for (p = &consumers; *p != c; p = &(*p)->next)
+		;
+
+	*p = c->next;
+	pthread_mutex_unlock(&consumers_lock);
+
+	atomic_store(&c->closed, true);
+	pthread_mutex_lock(&c->lock);
+	pthread_cond_broadcast(&c->items);
+	pthread_mutex_unlock(&c->lock);
+
+	if (c->fn)
+		pthread_join(c->thread, NULL);
+
+	while ((f = ring_pop(c)))
+		frame_put(f);
+
+	if (c->event_fd != -1)
+		close(c->event_fd);
+
+	pthread_cond_destroy(&c->items);
+	pthread_cond_destroy(&c->space);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
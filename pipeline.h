@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "roi.h"
+
+/*
+ * A refcounted frame. The last frame_put() either returns it to its pool, or
+ * calls its release() callback if it has one. The capture time is on the
+ * CLOCK_MONOTONIC timeline in nanoseconds, or zero if it is unknown. Frames
+ * decoded from a file carry their presentation time instead, and the seek
+ * they were decoded for (see run_playback()). Region
+ * measurements are made once, as a frame enters the pipeline, for every
+ * consumer to share.
+ */
+struct frame {
+	atomic_int refs;
+	uint32_t seq;
+	uint64_t ts_ns;
+	int64_t pts_ms;
+	unsigned gen;
+	uint8_t *data;
+	size_t len;
+	void (*release)(struct frame *f);
+	void *priv;
+	int nr_roi;
+	struct roi_result roi[ROI_MAX];
+};
+
+void frame_get(struct frame *f);
+
+void frame_put(struct frame *f);
+
+struct frame_pool;
+
+struct frame_pool *frame_pool_create(int nr, size_t len);
+
+struct frame *frame_pool_get(struct frame_pool *p);
+
+void frame_pool_destroy(struct frame_pool *p);
+
+/*
+ * What a producer does when a consumer's ring is full.
+ */
+enum ring_policy {
+	RING_DROP_OLDEST,
+	RING_BLOCK,
+};
+
+struct consumer;
+
+struct consumer *consumer_start(const char *name, int depth,
+				enum ring_policy policy,
+				void (*fn)(struct frame *f, void *arg),
+				void *arg);
+
+void consumer_push(struct consumer *c, struct frame *f);
+
+struct frame *consumer_pop(struct consumer *c, int timeout_ms);
+
+struct frame *consumer_pop_latest(struct consumer *c, int timeout_ms);
+
+int consumer_fd(const struct consumer *c);
+
+void consumer_fd_clear(struct consumer *c);
+
+unsigned consumer_queued(const struct consumer *c);
+
+unsigned consumer_drops(const struct consumer *c);
+
+void consumer_foreach(void (*fn)(const char *name, const struct consumer *c,
+				 void *arg),
+		      void *arg);
+
+void consumer_stop(struct consumer *c);
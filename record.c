@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "record.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <signal.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "counters.h"
+#include "latency.h"
+#include "ringfile.h"
+
+struct recorder {
+	struct lavc_ctx *lavc;
+	struct ringfile *ring;
+	struct consumer *encoder;
+	struct frame_pool *pool;
+	struct backlog *backlog;
+	pthread_t thread;
+	atomic_bool stop;
+	int frame_ms;
+	uint64_t epoch_ns;
+	uint64_t first_ns;
+	uint32_t first_pts;
+	uint32_t last_pts;
+	bool started;
+
+	/*
+	 * Everything needed to start the next segment of a segmented
+	 * recording (see next_segment()).
+	 */
+	char *path;
+	int width;
+	int height;
+	int fps;
+	int pix_fmt;
+	struct lavc_enc_opts opts;
+	uint32_t segment_ms;
+	int segment;
+};
+
+/*
+ * Segments after the first are named for the recording with the segment number
+ * before the extension, like "1700000000-raw-001.mkv". Each is finished before
+ * the next is started, so every segment is a complete file of its own.
+ *
+ * With an epoch, it moves on to the start of the segment holding the frame at
+ * pts, so a gap of several segments (say, a quiet spell behind a recording
+ * gate) only starts one new file.
+ */
+static void next_segment(struct recorder *r, uint32_t pts)
+{
+	const char *ext = strrchr(r->path, '.');
+	char path[PATH_MAX];
+	int stem;
+
+	if (!ext || strchr(ext, '/'))
+		ext = r->path + strlen(r->path);
+
+	stem = ext - r->path;
+	snprintf(path, sizeof(path), "%.*s-%03d%s", stem, r->path,
+		 ++r->segment, ext);
+
+	lavc_end_encode(r->lavc);
+	r->lavc = lavc_start_encode(path, r->width, r->height, r->fps,
+				   r->pix_fmt, &r->opts);
+	r->started = false;
+
+	if (r->epoch_ns)
+		r->epoch_ns += (uint64_t)(pts / r->segment_ms) *
+			       r->segment_ms * 1000000ULL;
+}
+
+/*
+ * Frames with a capture time are stamped with it, relative to the first frame
+ * recorded or the epoch (see recorder_set_epoch()), so any capture jitter is
+ * preserved in the file. Otherwise the sequence number implies the nominal
+ * frame rate.
+ */
+static uint32_t frame_pts(struct recorder *r, uint32_t seq, uint64_t ts_ns)
+{
+	uint32_t pts, seg_start;
+
+	if (ts_ns) {
+		if (!r->started)
+			r->first_ns = r->epoch_ns ? r->epoch_ns : ts_ns;
+
+		pts = ts_ns > r->first_ns ? (ts_ns - r->first_ns) / 1000000 : 0;
+	} else {
+		pts = seq * r->frame_ms;
+	}
+
+	/*
+	 * With an epoch, segments start at fixed points on the shared
+	 * timeline, so every camera's segments cover the same time.
+	 */
+	if (r->epoch_ns)
+		seg_start = 0;
+	else
+		seg_start = r->first_pts;
+
+	if (r->started && r->segment_ms && pts - seg_start >= r->segment_ms) {
+		next_segment(r, pts);
+		return frame_pts(r, seq, ts_ns);
+	}
+
+	/*
+	 * The muxer insists on strictly increasing timestamps.
+	 */
+	if (r->started && pts <= r->last_pts)
+		pts = r->last_pts + 1;
+
+	if (!r->started)
+		r->first_pts = pts;
+
+	r->last_pts = pts;
+	r->started = true;
+	return pts;
+}
+
+static void release_frame(void *opaque,
+			  __attribute__((unused)) uint8_t *data)
+{
+	frame_put(opaque);
+}
+
+/*
+ * The encoder reads the frame in place, and holds its own reference until it
+ * is done with it: for camera frames, that means the V4L2 buffer itself goes
+ * straight into libavcodec, and is only requeued once every consumer is done.
+ */
+static void recorder_encode(struct frame *f, void *arg)
+{
+	struct recorder *r = arg;
+	uint64_t start = lat_now();
+	uint32_t pts;
+
+	if (r->ring) {
+		ringfile_write(r->ring, f->seq, f->ts_ns, f->data, f->len);
+		ctr_add(CTR_BYTES_WRITTEN, f->len);
+		goto out;
+	}
+
+	/*
+	 * This may start a new segment, replacing r->lavc.
+	 */
+	pts = frame_pts(r, f->seq, f->ts_ns);
+
+	frame_get(f);
+	if (lavc_encode_ref(r->lavc, pts, f->data, f->len, release_frame, f))
+		errx(1, "can't record");
+
+out:
+	ctr_add(CTR_ENCODE_NS, lat_now() - start);
+	lat_record(LAT_ENCODE, f->ts_ns);
+}
+
+/**
+ * recorder_start() - Begin recording raw video to a file.
+ * @param path Path to file to write encoded output to.
+ * @param width Width of video frame.
+ * @param height Height of video frame.
+ * @param fps Framerate in frames per second.
+ * @param pix_fmt FFMPEG pixel format code.
+ * @param opts Encoder tuning, or NULL for the defaults.
+ * @param threaded Run the encoder in its own thread.
+ *
+ * Return: Recorder handle.
+ */
+struct recorder *recorder_start(const char *path, int width, int height,
+				int fps, int pix_fmt,
+				const struct lavc_enc_opts *opts, bool threaded)
+{
+	struct recorder *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		errx(1, "can't allocate recorder");
+
+	r->lavc = lavc_start_encode(path, width, height, fps, pix_fmt,
+				    opts);
+	r->frame_ms = 1000 / fps;
+
+	if (opts && opts->segment) {
+		r->path = strdup(path);
+		if (!r->path)
+			errx(1, "can't allocate recorder");
+
+		r->width = width;
+		r->height = height;
+		r->fps = fps;
+		r->pix_fmt = pix_fmt;
+		r->opts = *opts;
+		r->segment_ms = opts->segment * 60000U;
+	}
+	if (threaded)
+		r->encoder = consumer_start("recorder", RECORD_DEPTH,
+					    RING_BLOCK, recorder_encode, r);
+
+	return r;
+}
+
+/**
+ * recorder_start_ring() - Begin recording raw video to a ring file.
+ * @param path Path to ring file (see ringfile_create()).
+ * @param width Width of video frame.
+ * @param height Height of video frame.
+ * @param nr Number of frames the ring file holds.
+ * @param threaded Write the ring file from its own thread.
+ *
+ * Return: Recorder handle.
+ */
+struct recorder *recorder_start_ring(const char *path, int width, int height,
+				     int nr, bool threaded)
+{
+	struct recorder *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		errx(1, "can't allocate recorder");
+
+	r->ring = ringfile_create(path, width, height, nr);
+	if (threaded)
+		r->encoder = consumer_start("ring", RECORD_DEPTH, RING_BLOCK,
+					    recorder_encode, r);
+
+	return r;
+}
+
+/*
+ * A backlog holds copies of the last few seconds of frames, so a recording
+ * can start from before the moment it was asked for without the encoder
+ * running all the time. A recorder started from a backlog drains it from the
+ * oldest end in its own thread, while the producer keeps pushing live frames
+ * into it, so flushing the backlog never holds up capture.
+ */
+struct backlog {
+	struct consumer *ring;
+	struct frame_pool *pool;
+	int nr;
+};
+
+/**
+ * backlog_create() - Allocate a backlog of recent frames.
+ * @param nr Number of frames to keep.
+ * @param len Size of each frame.
+ *
+ * Return: Backlog handle.
+ */
+struct backlog *backlog_create(int nr, size_t len)
+{
+	struct backlog *b;
+	int depth = 2;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		errx(1, "can't allocate backlog");
+
+	while (depth <= nr)
+		depth *= 2;
+
+	/*
+	 * The ring holds at most nr frames (see backlog_push()), and the
+	 * recorder and its encoder each hold one more while it is running,
+	 * plus the one being filled.
+	 */
+	b->nr = nr;
+	b->ring = consumer_start("backlog", depth, RING_DROP_OLDEST, NULL,
+				 NULL);
+	b->pool = frame_pool_create(nr + 3, len);
+	return b;
+}
+
+/**
+ * backlog_push() - Keep a copy of a frame in a backlog.
+ * @param b Backlog handle.
+ * @param f Frame to copy.
+ *
+ * The oldest frame is forgotten if the backlog is full: if a recorder is
+ * draining it (see recorder_start_backlog()) and has fallen that far behind,
+ * it is lost from the recording.
+ *
+ * Return: Nothing.
+ */
+void backlog_push(struct backlog *b, struct frame *f)
+{
+	struct frame *copy;
+
+	while (consumer_queued(b->ring) >= (unsigned)b->nr) {
+		struct frame *old = consumer_pop(b->ring, 0);
+
+		if (old)
+			frame_put(old);
+	}
+
+	copy = frame_pool_get(b->pool);
+	if (!copy)
+		errx(1, "backlog frame pool exhausted");
+
+	copy->seq = f->seq;
+	copy->ts_ns = f->ts_ns;
+	memcpy(copy->data, f->data, f->len);
+	copy->len = f->len;
+	consumer_push(b->ring, copy);
+	frame_put(copy);
+}
+
+/**
+ * backlog_destroy() - Free a backlog.
+ * @param b Backlog handle, which no recorder may be draining.
+ *
+ * Return: Nothing.
+ */
+void backlog_destroy(struct backlog *b)
+{
+	consumer_stop(b->ring);
+	frame_pool_destroy(b->pool);
+	free(b);
+}
+
+static void *backlog_thread(void *arg)
+{
+	struct recorder *r = arg;
+	struct frame *f;
+
+	while ((f = consumer_pop(r->backlog->ring, 100)) ||
+	       !atomic_load(&r->stop)) {
+		if (!f)
+			continue;
+
+		recorder_encode(f, r);
+		frame_put(f);
+	}
+
+	return NULL;
+}
+
+/**
+ * recorder_start_backlog() - Begin recording raw video from a backlog.
+ * @param b Backlog to record from (see backlog_create()).
+ * @param path Path to file to write encoded output to.
+ * @param width Width of video frame.
+ * @param height Height of video frame.
+ * @param fps Framerate in frames per second.
+ * @param pix_fmt FFMPEG pixel format code.
+ * @param opts Encoder tuning, or NULL for the defaults.
+ * @param epoch_ns Capture time which is zero in the file, or zero for the
+ *		   oldest frame in the backlog (see recorder_set_epoch()).
+ *
+ * The recording starts with the oldest frame in the backlog, and continues
+ * with every frame pushed to the backlog until recorder_end(): the caller
+ * must not call recorder_push() or recorder_write() on the recorder. Frames
+ * keep their original capture times.
+ *
+ * Return: Recorder handle.
+ */
+struct recorder *recorder_start_backlog(struct backlog *b, const char *path,
+					int width, int height, int fps,
+					int pix_fmt,
+					const struct lavc_enc_opts *opts,
+					uint64_t epoch_ns)
+{
+	struct recorder *r;
+	sigset_t all, old;
+
+	r = recorder_start(path, width, height, fps, pix_fmt, opts, false);
+	r->epoch_ns = epoch_ns;
+	r->backlog = b;
+	atomic_init(&r->stop, false);
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&r->thread, NULL, backlog_thread, r))
+		errx(1, "can't start backlog recorder thread");
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return r;
+}
+
+/**
+ * recorder_set_epoch() - Stamp a recording relative to a fixed time.
+ * @param r Recorder handle, which must not have recorded any frames yet.
+ * @param epoch_ns Capture time (see lat_now()) which is zero in the file.
+ *
+ * Recordings from several cameras started with the same epoch share a common
+ * timeline, so their frames line up when they are played back together. The
+ * epoch must not be after the first frame recorded. Segments after the first
+ * each start one segment length later.
+ *
+ * Return: Nothing.
+ */
+void recorder_set_epoch(struct recorder *r, uint64_t epoch_ns)
+{
+	r->epoch_ns = epoch_ns;
+}
+
+/**
+ * recorder_push() - Record a frame.
+ * @param r Recorder handle.
+ * @param f Frame to record, which the recorder takes a new reference to.
+ *
+ * Return: Nothing.
+ */
+void recorder_push(struct recorder *r, struct frame *f)
+{
+	if (r->encoder) {
+		consumer_push(r->encoder, f);
+		return;
+	}
+
+	recorder_encode(f, r);
+}
+
+/**
+ * recorder_write() - Record a copy of a framebuffer.
+ * @param r Recorder handle.
+ * @param seq Sequence number of frame.
+ * @param ts_ns Capture time of frame, or zero if unknown.
+ * @param data Pointer to raw framebuffer.
+ * @param len Length of framebuffer data.
+ *
+ * Unlike recorder_push(), the caller may reuse data as soon as this returns.
+ *
+ * Return: Nothing.
+ */
+void recorder_write(struct recorder *r, uint32_t seq, uint64_t ts_ns,
+		    const uint8_t *data, size_t len)
+{
+	struct frame *f;
+
+	if (!r->encoder) {
+		uint64_t start = lat_now();
+
+		if (r->ring) {
+			ringfile_write(r->ring, seq, ts_ns, data, len);
+			ctr_add(CTR_BYTES_WRITTEN, len);
+		} else {
+			uint32_t pts = frame_pts(r, seq, ts_ns);
+
+			if (lavc_encode(r->lavc, pts, data, len))
+				errx(1, "can't record");
+		}
+
+		ctr_add(CTR_ENCODE_NS, lat_now() - start);
+		lat_record(LAT_ENCODE, ts_ns);
+		return;
+	}
+
+	if (!r->pool)
+		r->pool = frame_pool_create(RECORD_DEPTH + 2, len);
+
+	/*
+	 * The ring holds at most RECORD_DEPTH frames and blocks when it is
+	 * full, and the encoder holds one more, so there is always a free
+	 * frame by the time we get here.
+	 */
+	f = frame_pool_get(r->pool);
+	if (!f)
+		errx(1, "recorder frame pool exhausted");
+
+	f->seq = seq;
+	f->ts_ns = ts_ns;
+	memcpy(f->data, data, len);
+	consumer_push(r->encoder, f);
+	frame_put(f);
+}
+
+/**
+ * recorder_end() - Finish a recording.
+ * @param r Recorder handle.
+ *
+ * Every frame already pushed is encoded before this returns.
+ *
+ * Return: Nothing.
+ */
+void recorder_end(struct recorder *r)
+{
+	if (r->backlog) {
+		atomic_store(&r->stop, true);
+		pthread_join(r->thread, NULL);
+	}
+
+	if (r->encoder)
+		consumer_stop(r->encoder);
+
+	if (r->ring)
+		ringfile_close(r->ring);
+	else
+		lavc_end_encode(r->lavc);
+
+	if (r->pool)
+		frame_pool_destroy(r->pool);
+
+	free(r->path);
+	free(r);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pipeline.h"
+#include "lavc.h"
+
+/*
+ * Recording never drops frames: if the encoder falls this far behind, the
+ * producer blocks until it catches up. A recorder holds at most one more frame
+ * than this, the one being encoded.
+ */
+#define RECORD_DEPTH 16
+
+struct recorder;
+
+struct recorder *recorder_start(const char *path, int width, int height,
+				int fps, int pix_fmt,
+				const struct lavc_enc_opts *opts,
+				bool threaded);
+
+struct recorder *recorder_start_ring(const char *path, int width, int height,
+				     int nr, bool threaded);
+
+struct backlog;
+
+struct backlog *backlog_create(int nr, size_t len);
+
+void backlog_push(struct backlog *b, struct frame *f);
+
+void backlog_destroy(struct backlog *b);
+
+struct recorder *recorder_start_backlog(struct backlog *b, const char *path,
+					int width, int height, int fps,
+					int pix_fmt,
+					const struct lavc_enc_opts *opts,
+					uint64_t epoch_ns);
+
+void recorder_set_epoch(struct recorder *r, uint64_t epoch_ns);
+
+void recorder_push(struct recorder *r, struct frame *f);
+
+void recorder_write(struct recorder *r, uint32_t seq, uint64_t ts_ns,
+		    const uint8_t *data, size_t len);
+
+void recorder_end(struct recorder *r);
@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ringfile.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RINGFILE_MAGIC "IRCAMRF2"
+#define RINGFILE_PAGE 4096
+
+/*
+ * The file is a page holding this header, a table with one entry per slot,
+ * and then the slots themselves, each holding one frame and starting on a
+ * page boundary. The whole file is allocated when it is created, so writes
+ * through the mapping never need to allocate disk space.
+ *
+ * Frames are numbered from zero in the order they were written, and frame n
+ * lives in slot n % nr. Its table entry's gen is n + 1 while the slot holds
+ * it, and zero while it is being overwritten, so a reader can tell if frame n
+ * is still there, and if it changed while being read.
+ *
+ * The kernel writes the table and the slots back independently, so after a
+ * power loss an entry can be newer than its slot. Each entry has a checksum of
+ * itself and the frame, so such a frame is seen to be torn. Entries may
+ * straddle pages, which the checksum covers too.
+ */
+struct ringfile_hdr {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t frame_len;
+	uint32_t nr;
+	_Atomic uint64_t head;
+};
+
+struct ringfile_slot {
+	_Atomic uint64_t gen;
+	uint32_t seq;
+	uint32_t len;
+	uint64_t ts_ns;
+	uint64_t wall_ns;
+	uint64_t sum;
+};
+
+struct ringfile {
+	struct ringfile_hdr *hdr;
+	struct ringfile_slot *table;
+	uint8_t *slots;
+	size_t stride;
+	size_t size;
+};
+
+static size_t page_round(size_t len)
+{
+	return (len + RINGFILE_PAGE - 1) & ~(size_t)(RINGFILE_PAGE - 1);
+}
+
+static size_t table_off(void)
+{
+	return page_round(sizeof(struct ringfile_hdr));
+}
+
+static size_t slots_off(uint32_t nr)
+{
+	return table_off() + page_round(nr * sizeof(struct ringfile_slot));
+}
+
+static struct ringfile *ringfile_map(int fd, size_t size, int prot)
+{
+	struct ringfile *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		errx(1, "can't allocate ring file");
+
+	r->size = size;
+	r->hdr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (r->hdr == MAP_FAILED)
+		err(1, "can't map ring file");
+
+	r->table = (void *)((uint8_t *)r->hdr + table_off());
+	r->slots = (uint8_t *)r->hdr + slots_off(r->hdr->nr);
+	r->stride = page_round(r->hdr->frame_len);
+	close(fd);
+	return r;
+}
+
+/*
+ * Fletcher's checksum, which is plenty to catch stale or partly written
+ * frames, and costs next to nothing beside the copy.
+ */
+static uint64_t slot_sum(const struct ringfile_slot *s, uint64_t gen,
+			 const uint8_t *data)
+{
+	const uint32_t meta[] = {
+		gen, gen >> 32, s->seq, s->len,
+		s->ts_ns, s->ts_ns >> 32, s->wall_ns, s->wall_ns >> 32,
+	};
+	uint32_t a = 1, b = 0, v;
+	size_t i;
+
+	for (i = 0; i < sizeof(meta) / sizeof(meta[0]); i++) {
+		a += meta[i];
+		b += a;
+	}
+
+	for (i = 0; i + 4 <= s->len; i += 4) {
+		memcpy(&v, data + i, 4);
+		a += v;
+		b += a;
+	}
+
+	if (i < s->len) {
+		v = 0;
+		memcpy(&v, data + i, s->len - i);
+		a += v;
+		b += a;
+	}
+
+	return (uint64_t)b << 32 | a;
+}
+
+/*
+ * Older versions of the file can be replaced.
+ */
+static bool ringfile_magic(const struct ringfile_hdr *h)
+{
+	return !memcmp(h->magic, RINGFILE_MAGIC, sizeof(h->magic) - 1);
+}
+
+static bool ringfile_valid(const struct ringfile_hdr *h, size_t size)
+{
+	if (size < sizeof(*h) || memcmp(h->magic, RINGFILE_MAGIC, 8))
+		return false;
+
+	return h->nr && size == slots_off(h->nr) +
+					h->nr * page_round(h->frame_len);
+}
+
+/**
+ * ringfile_create() - Open a ring file for recording, creating it if needed.
+ * @param path Path to the ring file.
+ * @param width Width of video frame.
+ * @param height Height of video frame.
+ * @param nr Number of frames the file holds.
+ *
+ * If the file already exists with the same geometry, recording carries on after
+ * the frames already in it. An empty file, or a ring file with a different
+ * geometry, is replaced. Any other existing file is left alone, and is fatal.
+ *
+ * Return: Ring file handle.
+ */
+struct ringfile *ringfile_create(const char *path, int width, int height,
+				 int nr)
+{
+	uint32_t frame_len = width * height * 2;
+	struct ringfile_hdr h;
+	size_t size = slots_off(nr) + nr * page_round(frame_len);
+	struct stat st;
+	int fd, r;
+
+	if (nr < 1)
+		errx(1, "bad ring file length %d", nr);
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1 && errno == ENOENT)
+		fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+	if (fd == -1)
+		err(1, "can't open ring file '%s'", path);
+
+	if (fstat(fd, &st))
+		err(1, "can't stat ring file '%s'", path);
+
+	if (st.st_size &&
+	    (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	     !ringfile_magic(&h)))
+		errx(1, "'%s' exists and isn't a ring file", path);
+
+	if ((size_t)st.st_size == size && ringfile_valid(&h, size) &&
+	    h.width == (uint32_t)width && h.height == (uint32_t)height)
+		return ringfile_map(fd, size, PROT_READ | PROT_WRITE);
+
+	/*
+	 * Zeroing the old contents first means no stale slot can look valid.
+	 */
+	if (ftruncate(fd, 0))
+		err(1, "can't truncate ring file '%s'", path);
+
+	r = posix_fallocate(fd, 0, size);
+	if (r) {
+		errno = r;
+		err(1, "can't allocate %zu bytes for ring file '%s'", size,
+		    path);
+	}
+
+	h = (struct ringfile_hdr){
+		.width = width,
+		.height = height,
+		.frame_len = frame_len,
+		.nr = nr,
+	};
+	memcpy(h.magic, RINGFILE_MAGIC, sizeof(h.magic));
+
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+		err(1, "can't write ring file '%s'", path);
+
+	return ringfile_map(fd, size, PROT_READ | PROT_WRITE);
+}
+
+static uint64_t wall_now(void)
+{
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_REALTIME, &t))
+		err(1, "Bad clock_gettime");
+
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/**
+ * ringfile_write() - Record a frame, overwriting the oldest one.
+ * @param r Ring file handle.
+ * @param seq Sequence number of frame.
+ * @param ts_ns Capture time of frame, or zero if unknown.
+ * @param data Pointer to raw framebuffer.
+ * @param len Length of framebuffer data, at most the frame size of the file.
+ *
+ * Only one thread may write to a ring file. Nothing is synced: frames survive
+ * a crash as soon as this returns, and power loss once the kernel has written
+ * them back, which only takes up to /proc/sys/vm/dirty_expire_centisecs.
+ *
+ * Return: Nothing.
+ */
+void ringfile_write(struct ringfile *r, uint32_t seq, uint64_t ts_ns,
+		    const uint8_t *data, size_t len)
+{
+	uint64_t n = atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+	struct ringfile_slot *s = &r->table[n % r->hdr->nr];
+
+	if (len > r->hdr->frame_len)
+		errx(1, "frame too large for ring file");
+
+	atomic_store_explicit(&s->gen, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(r->slots + n % r->hdr->nr * r->stride, data, len);
+	s->seq = seq;
+	s->len = len;
+	s->ts_ns = ts_ns;
+	s->wall_ns = wall_now();
+	s->sum = slot_sum(s, n + 1, data);
+
+	atomic_store_explicit(&s->gen, n + 1, memory_order_release);
+	atomic_store_explicit(&r->hdr->head, n + 1, memory_order_release);
+}
+
+/**
+ * ringfile_open() - Open a ring file for reading.
+ * @param path Path to the ring file.
+ *
+ * The file may be read while another process is still recording into it.
+ *
+ * Return: Ring file handle, or NULL if the file isn't a valid ring file.
+ */
+struct ringfile *ringfile_open(const char *path)
+{
+	struct ringfile_hdr h;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		err(1, "can't open ring file '%s'", path);
+
+	if (fstat(fd, &st))
+		err(1, "can't stat ring file '%s'", path);
+
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    !ringfile_valid(&h, st.st_size)) {
+		close(fd);
+		return NULL;
+	}
+
+	return ringfile_map(fd, st.st_size, PROT_READ);
+}
+
+/**
+ * ringfile_dims() - Get the frame dimensions of a ring file.
+ * @param r Ring file handle.
+ * @param width Output width of video frame.
+ * @param height Output height of video frame.
+ *
+ * Return: Nothing.
+ */
+void ringfile_dims(const struct ringfile *r, int *width, int *height)
+{
+	*width = r->hdr->width;
+	*height = r->hdr->height;
+}
+
+/**
+ * ringfile_head() - Count the frames ever written to a ring file.
+ * @param r Ring file handle.
+ *
+ * Return: Number of the next frame to be written.
+ */
+uint64_t ringfile_head(const struct ringfile *r)
+{
+	return atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+}
+
+/**
+ * ringfile_slots() - Get the number of frames a ring file holds.
+ * @param r Ring file handle.
+ *
+ * Return: Number of slots.
+ */
+int ringfile_slots(const struct ringfile *r)
+{
+	return r->hdr->nr;
+}
+
+/**
+ * ringfile_read() - Copy a frame out of a ring file.
+ * @param r Ring file handle.
+ * @param n Number of the frame (see ringfile_head()).
+ * @param data Output buffer, the frame size of the file.
+ * @param info Output frame metadata.
+ *
+ * Return: 0 on success, or -1 if the frame has been overwritten, or was torn
+ *	   by a crash or power loss while it was being written.
+ */
+int ringfile_read(const struct ringfile *r, uint64_t n, uint8_t *data,
+		  struct ringfile_info *info)
+{
+	const struct ringfile_slot *s = &r->table[n % r->hdr->nr];
+	struct ringfile_slot copy;
+
+	if (atomic_load_explicit(&s->gen, memory_order_acquire) != n + 1)
+		return -1;
+
+	copy.seq = s->seq;
+	copy.len = s->len;
+	copy.ts_ns = s->ts_ns;
+	copy.wall_ns = s->wall_ns;
+	copy.sum = s->sum;
+	if (copy.len > r->hdr->frame_len)
+		return -1;
+
+	memcpy(data, r->slots + n % r->hdr->nr * r->stride, copy.len);
+	memset(data + copy.len, 0, r->hdr->frame_len - copy.len);
+
+	/*
+	 * If the writer lapped us while we were copying, the copy is garbage.
+	 */
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&s->gen, memory_order_relaxed) != n + 1)
+		return -1;
+
+	if (slot_sum(&copy, n + 1, data) != copy.sum)
+		return -1;
+
+	info->seq = copy.seq;
+	info->ts_ns = copy.ts_ns;
+	info->wall_ns = copy.wall_ns;
+	return 0;
+}
+
+/**
+ * ringfile_close() - Close a ring file.
+ * @param r Ring file handle.
+ *
+ * Return: Nothing.
+ */
+void ringfile_close(struct ringfile *r)
+{
+	munmap(r->hdr, r->size);
+	free(r);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A preallocated file holding the last N frames, written through a shared
+ * mapping, so recording costs one memcpy per frame and nothing ever needs to
+ * be finalized. See ringfile.c for the layout.
+ */
+struct ringfile;
+
+struct ringfile_info {
+	uint32_t seq;
+	uint64_t ts_ns;
+	uint64_t wall_ns;
+};
+
+struct ringfile *ringfile_create(const char *path, int width, int height,
+				 int nr);
+
+void ringfile_write(struct ringfile *r, uint32_t seq, uint64_t ts_ns,
+		    const uint8_t *data, size_t len);
+
+struct ringfile *ringfile_open(const char *path);
+
+void ringfile_dims(const struct ringfile *r, int *width, int *height);
+
+uint64_t ringfile_head(const struct ringfile *r);
+
+int ringfile_slots(const struct ringfile *r);
+
+int ringfile_read(const struct ringfile *r, uint64_t n, uint8_t *data,
+		  struct ringfile_info *info);
+
+void ringfile_close(struct ringfile *r);
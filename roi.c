@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "roi.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <err.h>
+
+#include "dev.h"
+
+static int parse_roi_int(const char *spec, const char *val, char **end)
+{
+	long v;
+
+	v = strtol(val, end, 10);
+	if (*end == val || v < 0 || v > UINT16_MAX)
+		errx(1, "bad region '%s'", spec);
+
+	return v;
+}
+
+static int parse_roi_file(struct roi *rois, int nr, const char *path)
+{
+	char line[256];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		err(1, "can't open region file '%s'", path);
+
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line, *end;
+
+		while (isspace((unsigned char)*p))
+			p++;
+
+		end = p + strlen(p);
+		while (end > p && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+
+		if (*p && *p != '#')
+			nr = roi_parse(rois, nr, p);
+	}
+
+	fclose(f);
+	return nr;
+}
+
+/**
+ * roi_parse() - Parse a region of interest.
+ * @param rois Array of ROI_MAX regions to add to.
+ * @param nr Number of regions already in rois.
+ * @param spec "name=x,y" for a spot, "name=x,y,w,h" for a rectangle, or
+ *	       "@path" to read them from a file, one per line.
+ *
+ * Coordinates are in sensor pixels, before any rotation. They can't be checked
+ * against the frame size until the device is known: see roi_check().
+ *
+ * Exits on error.
+ *
+ * Return: The new number of regions in rois.
+ */
+int roi_parse(struct roi *rois, int nr, const char *spec)
+{
+	const char *val = strchr(spec, '=');
+	int fields[4] = { 0, 0, 1, 1 };
+	struct roi *r;
+	char *end;
+	int i;
+
+	if (spec[0] == '@')
+		return parse_roi_file(rois, nr, spec + 1);
+
+	if (!val || val == spec || val - spec >= ROI_NAME_LEN)
+		errx(1, "bad region '%s' (name=x,y[,w,h])", spec);
+
+	if (nr == ROI_MAX)
+		errx(1, "too many regions (at most %d)", ROI_MAX);
+
+	for (i = 0, end = (char *)val; i < 4 && *end; i++) {
+		fields[i] = parse_roi_int(spec, end + 1, &end);
+		if (*end && *end != ',')
+			errx(1, "bad region '%s'", spec);
+	}
+
+	if (*end || (i != 2 && i != 4) || !fields[2] || !fields[3])
+		errx(1, "bad region '%s' (name=x,y[,w,h])", spec);
+
+	r = &rois[nr];
+	memset(r->name, 0, sizeof(r->name));
+	memcpy(r->name, spec, val - spec);
+	r->x = fields[0];
+	r->y = fields[1];
+	r->w = fields[2];
+	r->h = fields[3];
+	return nr + 1;
+}
+
+/**
+ * roi_check() - Make sure regions fit in the frame.
+ * @param rois Regions to check.
+ * @param nr Number of regions.
+ * @param width Width of the frame.
+ * @param height Height of the frame.
+ *
+ * Exits on error.
+ *
+ * Return: Nothing.
+ */
+void roi_check(const struct roi *rois, int nr, int width, int height)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (rois[i].x + rois[i].w > width ||
+		    rois[i].y + rois[i].h > height)
+			errx(1, "region '%s' is outside the %dx%d frame",
+			     rois[i].name, width, height);
+}
+
+static void measure_span(struct roi_result *res, uint64_t *sum,
+			 const uint8_t *line, int start, int end, int row)
+{
+	uint16_t min = res->min, max = res->max;
+	uint64_t s = *sum;
+	int i;
+
+	for (i = start; i < end; i++) {
+		uint16_t v = line[i * 2] | line[i * 2 + 1] << 8;
+
+		s += v;
+		if (v < min)
+			min = v;
+
+		if (v > max) {
+			max = v;
+			res->max_x = i;
+			res->max_y = row;
+		}
+	}
+
+	res->min = min;
+	res->max = max;
+	*sum = s;
+}
+
+/**
+ * roi_measure() - Measure every region of interest in a frame.
+ * @param rois Regions to measure, see roi_check().
+ * @param nr Number of regions, at most ROI_MAX.
+ * @param res Output results, one per region.
+ * @param y16 Y16LE framebuffer.
+ * @param width Width of the frame.
+ *
+ * The frame is walked once, row by row, and each row is scanned for every
+ * region which covers it while it's still in the L1 cache. So overlapping
+ * regions don't cost any more memory bandwidth than one big one, and no pixel
+ * outside every region is ever read.
+ *
+ * A summed-area table would make each mean O(1), but can't find a minimum or
+ * maximum, so every region's pixels are visited anyway.
+ *
+ * Return: Nothing.
+ */
+void roi_measure(const struct roi *rois, int nr, struct roi_result *res,
+		 const uint8_t *y16, int width)
+{
+	uint64_t sum[ROI_MAX];
+	int top = INT32_MAX, bottom = 0;
+	int i, row;
+
+	for (i = 0; i < nr; i++) {
+		const struct roi *r = &rois[i];
+
+		res[i] = (struct roi_result){
+			.x = r->x,
+			.y = r->y,
+			.w = r->w,
+			.h = r->h,
+			.min = UINT16_MAX,
+			.max_x = r->x,
+			.max_y = r->y,
+		};
+		sum[i] = 0;
+
+		if (r->y < top)
+			top = r->y;
+
+		if (r->y + r->h > bottom)
+			bottom = r->y + r->h;
+	}
+
+	for (row = top; row < bottom; row++) {
+		const uint8_t *line = y16 + (size_t)row * width * 2;
+
+		for (i = 0; i < nr; i++) {
+			const struct roi *r = &rois[i];
+
+			if (row < r->y || row >= r->y + r->h)
+				continue;
+
+			measure_span(&res[i], &sum[i], line, r->x, r->x + r->w,
+				     row);
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		uint32_t n = (uint32_t)res[i].w * res[i].h;
+
+		res[i].mean = (sum[i] + n / 2) / n;
+	}
+}
+
+static double raw_to_celsius(uint16_t raw)
+{
+	return (double)raw / cur_profile->raw_per_kelvin - 273.15;
+}
+
+/**
+ * roi_log_header() - Write the column names for roi_log().
+ * @param f Where to write the log.
+ *
+ * Return: Nothing.
+ */
+void roi_log_header(FILE *f)
+{
+	fprintf(f, "camera,seq,ts_ns,roi,x,y,w,h,min_c,max_c,mean_c,"
+		   "max_x,max_y\n");
+}
+
+/**
+ * roi_log() - Write one frame's region measurements as CSV.
+ * @param f Where to write the log.
+ * @param cam Camera number.
+ * @param seq Sequence number of frame.
+ * @param ts_ns Capture time of frame, or zero if unknown.
+ * @param names Regions to take names from, which may be fewer than results.
+ * @param nr_names Number of regions in names.
+ * @param res Results from roi_measure(), or received from a remote.
+ * @param nr Number of results.
+ *
+ * There is one row per region. Regions without a name are called by their
+ * number. The log is flushed after every frame, so it can be read as a live
+ * stream through a pipe. Several threads may log to the same file: each
+ * frame's rows are written together.
+ *
+ * Return: Nothing.
+ */
+void roi_log(FILE *f, int cam, uint32_t seq, uint64_t ts_ns,
+	     const struct roi *names, int nr_names,
+	     const struct roi_result *res, int nr)
+{
+	int i;
+
+	flockfile(f);
+	for (i = 0; i < nr; i++) {
+		const struct roi_result *r = &res[i];
+
+		fprintf(f, "%d,%" PRIu32 ",%" PRIu64 ",", cam, seq, ts_ns);
+		if (i < nr_names)
+			fprintf(f, "%s", names[i].name);
+		else
+			fprintf(f, "%d", i);
+
+		fprintf(f, ",%u,%u,%u,%u,%.2f,%.2f,%.2f,%u,%u\n", r->x, r->y,
+			r->w, r->h, raw_to_celsius(r->min),
+			raw_to_celsius(r->max), raw_to_celsius(r->mean),
+			r->max_x, r->max_y);
+	}
+
+	fflush(f);
+	funlockfile(f);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define ROI_MAX		32
+#define ROI_NAME_LEN	16
+
+/*
+ * A rectangular region of the frame, in sensor coordinates (before any
+ * rotation). A spot is a region one pixel square.
+ */
+struct roi {
+	char name[ROI_NAME_LEN];
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+};
+
+/*
+ * The measurements of one region in one frame. Each carries its region, so
+ * it makes sense on its own, after being sent over the network (see wire.c).
+ * The maximum is at the first pixel with that value, in sensor coordinates.
+ */
+struct roi_result {
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+	uint16_t min;
+	uint16_t max;
+	uint16_t mean;
+	uint16_t max_x;
+	uint16_t max_y;
+};
+
+int roi_parse(struct roi *rois, int nr, const char *spec);
+
+void roi_check(const struct roi *rois, int nr, int width, int height);
+
+void roi_measure(const struct roi *rois, int nr, struct roi_result *res,
+		 const uint8_t *y16, int width);
+
+void roi_log_header(FILE *f);
+
+void roi_log(FILE *f, int cam, uint32_t seq, uint64_t ts_ns,
+	     const struct roi *names, int nr_names,
+	     const struct roi_result *res, int nr);
@@ -36,6 +36,13 @@
 
 #include "dev.h"
 #include "lavc.h"
+#include "record.h"
+#include "palette.h"
+#include "stats.h"
+#include "counters.h"
+#include "latency.h"
+#include "gpu.h"
+#include "pipeline.h"
 
 /*
  * Use SDL_Fontcache for font caching (see README).
@@ -48,11 +55,6 @@ extern const uint8_t builtin_ttf_end;
 static const SDL_Color SDL_COLOR_RED = { 0xFF, 0, 0, 0xFF };
 static const SDL_Color SDL_COLOR_BLUE = { 0, 0, 0xFF, 0xFF };
 
-/*
- * Lookup table for the Turbo colormap (see README).
- */
-#include "turbo.h"
-
 /*
  * 8-bit gamma correction lookup tables are precomputed by mkgamma.py.
  */
@@ -92,8 +94,14 @@ static const struct temp_fixp abszero = {
 	.minor = 10, // b10rev[15],
 };
 
+/*
+ * The fixed point format is 1/64 Kelvin, like the TC001's raw values.
+ */
 static struct temp_fixp raw_to_kelvin(uint16_t raw)
 {
+	if (cur_profile->raw_per_kelvin != 64)
+		raw = (uint32_t)raw * 64 / cur_profile->raw_per_kelvin;
+
 	return (struct temp_fixp){
 		.major = raw >> 6,
 		.minor = raw & 0x003F,
@@ -152,13 +160,78 @@ static struct temp_fixp celsius_to_fahrenheit(struct temp_fixp t)
 	};
 }
 
+/*
+ * Rendering text glyph by glyph through the font cache every frame is too slow
+ * for small machines, so each line of text is rasterized once into its own
+ * texture, which is reused until the line changes. Lines are identified by
+ * their position on the screen. The static help and license screens are each
+ * prerendered into a single texture.
+ *
+ * Everything is rasterized in white at the window's real resolution, and the
+ * text color is applied with a color mod when it is drawn.
+ */
+#define TEXT_SCALE	0.2F
+#define TEXT_LINE	7
+#define NR_TEXT_LINES	((16 + 2 * ROI_MAX) * SDL_MAX_VIEWS)
+#define TEXT_LEN	64
+
+struct text_cache {
+	SDL_Texture *t;
+	SDL_FRect dst;
+	int tw;
+	int th;
+	int x;
+	int y;
+	char txt[TEXT_LEN];
+};
+
+/*
+ * Each camera is drawn in its own tile of the window, two tiles across, with
+ * its own overlay. Everything else is shared between the tiles, including the
+ * view settings, the crosshair, and the font cache.
+ */
+struct sdl_view {
+	SDL_Texture *t;
+	SDL_Point origin;
+	uint32_t frame_paint_seq;
+
+	/*
+	 * What was painted last, so paint_tile() can skip the work that would
+	 * give the same picture again (see there).
+	 */
+	const uint8_t *last_data;
+	uint32_t last_seq;
+	uint64_t last_ts_ns;
+	struct palette_cfg last_cfg;
+	struct frame_stats st;
+	bool last_rotate;
+	bool last_gpu;
+	bool painted;
+	bool stats_valid;
+
+	/*
+	 * Everything the overlay shows, since every tile is redrawn whenever
+	 * any of them changes (see paint_present()).
+	 */
+	uint16_t min;
+	uint16_t max;
+	uint16_t orig_min;
+	uint16_t orig_max;
+	uint16_t ptemp;
+	SDL_Point min_point;
+	SDL_Point max_point;
+	const uint8_t *upload;
+	bool presented;
+	int nr_roi;
+	struct roi_result roi[ROI_MAX];
+};
+
 struct sdl_ctx {
 	SDL_Renderer *r;
-	SDL_Texture *t;
+	struct gpu *gpu;
 	SDL_Window *w;
 	FC_Font *f;
 	const char *fontpath;
-	FILE *fonttmp;
 	bool colormap;
 	bool showtext;
 	bool show_min_max_marker;
@@ -170,38 +243,45 @@ struct sdl_ctx {
 	bool showhelp;
 	bool showlicense;
 	bool showinithelp;
+	bool showcounters;
 	time_t inittsmono;
 	uint16_t scale_max;
 	uint16_t scale_min;
 	SDL_Point crosshair;
 	SDL_Color crosshair_color;
-	struct lavc_ctx *vrecord;
-	uint32_t frame_paint_seq;
+	struct recorder *vrecord;
+	struct palette pal;
+	struct palette nv12_pal;
+	uint8_t *nv12;
 	uint8_t textval;
+	float text_scale;
+	int nr_lines;
+	struct text_cache lines[NR_TEXT_LINES];
+	struct text_cache help;
+	struct text_cache license;
 	bool recording;
 	bool looped;
 	bool paused;
 	bool pb;
-};
-
-static uint8_t getcolor(struct sdl_ctx *c, int color, uint8_t r)
-{
-	if (c->contours > 1) {
-		uint16_t fr = r * c->contours;
-		r = fr & 0xFF;
-	}
-
-	if (c->gammafactor)
-		r = gammalookup[c->gammafactor][r];
+	int speed;
+	bool threaded;
+	const struct lavc_enc_opts *rgb_opts;
+	const struct roi *roi_names;
+	int nr_roi_names;
 
-	if (c->invert)
-		r = ~r;
-
-	if (c->colormap)
-		return turbo_srgb_bytes[r][color];
-
-	return r;
-}
+	/*
+	 * Pipeline counters, and their rates over the last whole second, for
+	 * the overlay.
+	 */
+	time_t ctr_sec;
+	uint64_t ctr_last[NR_COUNTERS];
+	uint64_t ctr_rate[NR_COUNTERS];
+
+	struct sdl_view views[SDL_MAX_VIEWS];
+	int nr_views;
+	SDL_Point origin;
+	bool dirty;
+};
 
 static SDL_Point calc_point_from_buf_offset(const struct sdl_ctx *c,
 					    const int offset)
@@ -222,16 +302,103 @@ static void update_crosshair_color(struct sdl_ctx *c)
 	c->crosshair_color.a = 255;
 }
 
+/*
+ * Rasterize lines of text TEXT_LINE apart into a cached texture, which only
+ * ever grows, so a line which changes length rarely needs a new one.
+ */
+static void render_text(struct sdl_ctx *c, struct text_cache *tc, int x, int y,
+			const char *const *lines, int nr)
+{
+	float lh = FC_GetLineHeight(c->f) * TEXT_SCALE;
+	float s = c->text_scale;
+	Uint8 r, g, b, a;
+	int i, w, h;
+
+	w = 0;
+	for (i = 0; i < nr; i++)
+		if (FC_GetWidth(c->f, "%s", lines[i]) > w)
+			w = FC_GetWidth(c->f, "%s", lines[i]);
+
+	w = w * TEXT_SCALE * s + 1;
+	h = ((nr - 1) * TEXT_LINE + lh) * s + 1;
+
+	if (!tc->t || w > tc->tw || h > tc->th) {
+		if (tc->t)
+			SDL_DestroyTexture(tc->t);
+
+		tc->tw = w > tc->tw ? w : tc->tw;
+		tc->th = h > tc->th ? h : tc->th;
+		tc->t = SDL_CreateTexture(c->r, SDL_PIXELFORMAT_BGRA32,
+					  SDL_TEXTUREACCESS_TARGET, tc->tw,
+					  tc->th);
+		if (!tc->t)
+			errx(1, "can't create text texture: %s",
+			     SDL_GetError());
+
+		SDL_SetTextureBlendMode(tc->t, SDL_BLENDMODE_BLEND);
+	}
+
+	/*
+	 * Clearing to transparent white rather than black keeps the edges of
+	 * the antialiased glyphs from darkening when they're blended twice.
+	 */
+	SDL_SetRenderTarget(c->r, tc->t);
+	SDL_GetRenderDrawColor(c->r, &r, &g, &b, &a);
+	SDL_SetRenderDrawColor(c->r, 255, 255, 255, 0);
+	SDL_RenderClear(c->r);
+	SDL_SetRenderDrawColor(c->r, r, g, b, a);
+
+	for (i = 0; i < nr; i++)
+		FC_DrawScale(c->f, c->r, 0, i * TEXT_LINE * s,
+			     FC_MakeScale(TEXT_SCALE * s, TEXT_SCALE * s), "%s",
+			     lines[i]);
+
+	SDL_SetRenderTarget(c->r, NULL);
+
+	tc->x = x;
+	tc->y = y;
+	tc->dst = (SDL_FRect){ x, y, tc->tw / s, tc->th / s };
+}
+
+static void blit_text(struct sdl_ctx *c, struct text_cache *tc)
+{
+	SDL_SetTextureColorMod(tc->t, c->textval, c->textval, c->textval);
+	SDL_RenderCopyF(c->r, tc->t, NULL, &tc->dst);
+}
+
 static void drawtext(struct sdl_ctx *c, int x, int y, const char *fmt, ...)
 {
-	char txt[1024];
+	const char *lines[1];
+	struct text_cache *tc;
+	char txt[TEXT_LEN];
 	va_list args;
+	int i;
 
 	va_start(args, fmt);
 	vsnprintf(txt, sizeof(txt), fmt, args);
 	va_end(args);
 
-	FC_DrawScale(c->f, c->r, x, y, FC_MakeScale(0.2F, 0.2F), txt);
+	x += c->origin.x;
+	y += c->origin.y;
+	for (i = 0; i < c->nr_lines; i++)
+		if (c->lines[i].x == x && c->lines[i].y == y)
+			break;
+
+	if (i == c->nr_lines) {
+		if (c->nr_lines == NR_TEXT_LINES)
+			errx(1, "too many lines of text");
+
+		c->nr_lines++;
+	}
+
+	tc = &c->lines[i];
+	if (!tc->t || strcmp(tc->txt, txt)) {
+		lines[0] = txt;
+		render_text(c, tc, x, y, lines, 1);
+		strcpy(tc->txt, txt);
+	}
+
+	blit_text(c, tc);
 }
 
 static time_t now_mono(void)
@@ -244,10 +411,51 @@ static time_t now_mono(void)
 	return t.tv_sec;
 }
 
-static void showtexts(struct sdl_ctx *c, struct temp_fixp max,
-		      struct temp_fixp ptemp, struct temp_fixp min,
-		      uint32_t seq)
+static void recorder_queued(const char *name, const struct consumer *q,
+			    void *arg)
 {
+	if (!strcmp(name, "recorder"))
+		*(unsigned *)arg = consumer_queued(q);
+}
+
+/*
+ * Stage times are shown in milliseconds per second, which is also the
+ * fraction of a CPU each stage keeps busy in tenths of a percent.
+ */
+static void showcounters(struct sdl_ctx *c)
+{
+	uint64_t v[NR_COUNTERS], *r = c->ctr_rate;
+	time_t now = now_mono();
+	unsigned queued = 0;
+	int i;
+
+	if (now != c->ctr_sec) {
+		ctr_snapshot(v);
+		for (i = 0; i < NR_COUNTERS; i++)
+			r[i] = (v[i] - c->ctr_last[i]) / (now - c->ctr_sec);
+
+		memcpy(c->ctr_last, v, sizeof(v));
+		c->ctr_sec = now;
+	}
+
+	consumer_foreach(recorder_queued, &queued);
+
+	drawtext(c, 0, 28, "[ST%4u CO%4u PR%4u MS/S]",
+		 (unsigned)(r[CTR_STATS_NS] / 1000000),
+		 (unsigned)(r[CTR_COLORIZE_NS] / 1000000),
+		 (unsigned)(r[CTR_PRESENT_NS] / 1000000));
+
+	drawtext(c, 0, 35, "[EN%4u TX%4u Q%2u %5uKB/S]",
+		 (unsigned)(r[CTR_ENCODE_NS] / 1000000),
+		 (unsigned)(r[CTR_SEND_NS] / 1000000), queued,
+		 (unsigned)(r[CTR_BYTES_WRITTEN] / 1000));
+}
+
+static void showtexts(struct sdl_ctx *c, const struct sdl_view *v,
+		      struct temp_fixp max, struct temp_fixp ptemp,
+		      struct temp_fixp min, uint32_t seq)
+{
+	struct lat_summary lat;
 	char s = 'C';
 
 	if (c->fahren) {
@@ -291,11 +499,32 @@ static void showtexts(struct sdl_ctx *c, struct temp_fixp max,
 	if (c->paused && c->pb)
 		drawtext(c, 46, 21, "[PAUSE]");
 
-	drawtext(c, WIDTH - 40, 1, "[%05" PRIu32 ".%02" PRIu32 "]", seq / 25,
-		 (seq % 25) * 4);
+	if (c->speed != 1 && c->pb)
+		drawtext(c, 78, 21, "[%+dX]", c->speed);
+
+	drawtext(c, WIDTH - 40, 1, "[%05" PRIu32 ".%02" PRIu32 "]", seq / FPS,
+		 (seq % FPS) * 100 / FPS);
 
 	drawtext(c, WIDTH - 45, 8, "% 5" PRId64 " DROPS",
-		 (int64_t)seq - c->frame_paint_seq);
+		 (int64_t)seq - v->frame_paint_seq);
+
+	/*
+	 * Capture to display latency, only known for live camera frames.
+	 */
+	lat_summary(LAT_PRESENT, &lat);
+	if (lat.count)
+		drawtext(c, WIDTH - 45, 15, "%3u/%3u MS", lat.p50 / 1000,
+			 lat.p99 / 1000);
+
+	/*
+	 * Everything below is about the window rather than one camera, so it
+	 * only appears in the first tile.
+	 */
+	if (v != c->views)
+		return;
+
+	if (c->showcounters)
+		showcounters(c);
 
 	if (c->showinithelp) {
 		drawtext(c, 90, 70, "HOLD [H] FOR HELP");
@@ -305,60 +534,85 @@ static void showtexts(struct sdl_ctx *c, struct temp_fixp max,
 	}
 }
 
-static void showlicensetext(struct sdl_ctx *c)
-{
-	drawtext(c, 40, 33, "Linux Infrared Camera Viewer");
-	drawtext(c, 40, 40, "Copyright (C) 2024 Calvin Owens");
-	drawtext(c, 40, 54, "This program is free software: you can");
-	drawtext(c, 40, 61, "redistribute it and/or modify it under the");
-	drawtext(c, 40, 68, "terms of the GNU General Public License as");
-	drawtext(c, 40, 75, "published by the Free Software Foundation,");
-	drawtext(c, 40, 82, "either version 3 of the License, or (at");
-	drawtext(c, 40, 89, "your option) any later version.");
-	drawtext(c, 40, 103, "This program is distributed in the hope that");
-	drawtext(c, 40, 110, "it will be useful, but WITHOUT ANY WARRANTY;");
-	drawtext(c, 40, 117, "without even the implied warranty of");
-	drawtext(c, 40, 124, "MERCHANTABILITY or FITNESS FOR A PARTICULAR");
-	drawtext(c, 40, 131, "PURPOSE. See the GNU General Public License");
-	drawtext(c, 40, 138, "for more details.");
-	drawtext(c, 40, 152, "You should have received a copy of the GNU");
-	drawtext(c, 40, 159, "General Public License along with this");
-	drawtext(c, 40, 166, "program. If not see <www.gnu.org/licenses>.");
-}
-
-static void showhelptext(struct sdl_ctx *c)
-{
-	drawtext(c, 40, 30, "D: MANUAL SCALE");
-	drawtext(c, 40, 37, "E: AUTO SCALE");
-	drawtext(c, 40, 44, "Q/W: MAN SCALE MIN/MAX ++");
-	drawtext(c, 40, 51, "A/S: MAN SCALE MIN/MAX --");
-	drawtext(c, 40, 58, "Z: MIN TO MINIMUM");
-	drawtext(c, 40, 65, "X: MAX TO MAXIMUM");
-	drawtext(c, 40, 72, "R: TOGGLE Y16 RECORD");
-	drawtext(c, 40, 79, "V: TOGGLE RGBA RECORD");
-	drawtext(c, 40, 86, "T: TOGGLE TXT COLOR/ON/OFF");
-	drawtext(c, 40, 93, "M: TOGGLE SHOW MIN/MAX MARKER");
-	drawtext(c, 40, 100, "G: TOGGLE GAMMA CORR");
-	drawtext(c, 40, 107, "Y: TOGGLE CONTOURING");
-	drawtext(c, 40, 114, "F: TOGGLE UNITS F/C");
-	drawtext(c, 40, 121, "I: TOGGLE INVERT");
-	drawtext(c, 40, 128, "U: TOGGLE OUTPUT ROTATION");
-	drawtext(c, 40, 135, "C: TOGGLE GRAYSCALE");
-	drawtext(c, 40, 142, "ARROW KEYS MOVE CROSS");
-	drawtext(c, 40, 149, "SPACEBAR PAUSES PLAYBACK");
-	drawtext(c, 40, 156, "L: SHOW LICENSE DETAILS");
-	drawtext(c, 40, 163, "H: SHOW THIS HELP TEXT");
-}
+static const char *const licensetext[] = {
+	"Linux Infrared Camera Viewer",
+	"Copyright (C) 2024 Calvin Owens",
+	"",
+	"This program is free software: you can",
+	"redistribute it and/or modify it under the",
+	"terms of the GNU General Public License as",
+	"published by the Free Software Foundation,",
+	"either version 3 of the License, or (at",
+	"your option) any later version.",
+	"",
+	"This program is distributed in the hope that",
+	"it will be useful, but WITHOUT ANY WARRANTY;",
+	"without even the implied warranty of",
+	"MERCHANTABILITY or FITNESS FOR A PARTICULAR",
+	"PURPOSE. See the GNU General Public License",
+	"for more details.",
+	"",
+	"You should have received a copy of the GNU",
+	"General Public License along with this",
+	"program. If not see <www.gnu.org/licenses>.",
+};
+
+static const char *const helptext[] = {
+	"D: MANUAL SCALE",
+	"E: AUTO SCALE",
+	"Q/W: MAN SCALE MIN/MAX ++",
+	"A/S: MAN SCALE MIN/MAX --",
+	"Z: MIN TO MINIMUM",
+	"X: MAX TO MAXIMUM",
+	"R: TOGGLE Y16 RECORD",
+	"V: TOGGLE RGBA RECORD",
+	"T: TOGGLE TXT COLOR/ON/OFF",
+	"M: TOGGLE SHOW MIN/MAX MARKER",
+	"G: TOGGLE GAMMA CORR",
+	"Y: TOGGLE CONTOURING",
+	"F: TOGGLE UNITS F/C",
+	"I: TOGGLE INVERT",
+	"U: TOGGLE OUTPUT ROTATION",
+	"C: TOGGLE GRAYSCALE",
+	"P: TOGGLE PIPELINE COUNTERS",
+	"ARROW KEYS MOVE CROSS",
+	"SPACEBAR PAUSES PLAYBACK",
+	",/.: STEP BACK/FWD  [/]: SPEED",
+	"PGUP/PGDN/HOME/END: SEEK",
+	"L: SHOW LICENSE DETAILS",
+	"H: SHOW THIS HELP TEXT",
+};
 
+/*
+ * The built-in font is read straight from the copy linked into the binary
+ * (see builtin.s), so it never touches the filesystem.
+ */
 static void sdl_open_fontcache(struct sdl_ctx *c)
 {
-	if (c->f)
-		FC_FreeFont(c->f);
+	const SDL_Color white = FC_MakeColor(255, 255, 255, 255);
+	Uint8 ok;
+	float sy;
 
 	c->f = FC_CreateFont();
-	FC_LoadFont(c->f, c->r, c->fontpath, 32,
-		    FC_MakeColor(c->textval, c->textval, c->textval, 255),
-		    TTF_STYLE_NORMAL);
+	if (c->fontpath) {
+		ok = FC_LoadFont(c->f, c->r, c->fontpath, 32, white,
+				 TTF_STYLE_NORMAL);
+	} else {
+		const uint8_t *src = &builtin_ttf_start;
+		int len = &builtin_ttf_end - src;
+
+		ok = FC_LoadFont_RW(c->f, c->r, SDL_RWFromConstMem(src, len), 1,
+				    32, white, TTF_STYLE_NORMAL);
+	}
+
+	if (!ok)
+		errx(1, "can't load font, try -f");
+
+	SDL_RenderGetScale(c->r, &c->text_scale, &sy);
+	render_text(c, &c->help, 40, 30, helptext,
+		    sizeof(helptext) / sizeof(helptext[0]));
+	render_text(c, &c->license, 40, 33, licensetext,
+		    sizeof(licensetext) / sizeof(licensetext[0]));
 }
 
 static int sdl_poll_one(struct sdl_ctx *c, SDL_Event *evt, uint16_t min,
@@ -403,11 +657,9 @@ static int sdl_poll_one(struct sdl_ctx *c, SDL_Event *evt, uint16_t min,
 			if (!c->showtext) {
 				c->showtext = 1;
 				c->textval = 255;
-				sdl_open_fontcache(c);
 
 			} else if (c->textval == 255) {
 				c->textval = 0;
-				sdl_open_fontcache(c);
 
 			} else if (c->textval == 0) {
 				c->showtext = 0;
@@ -420,6 +672,10 @@ static int sdl_poll_one(struct sdl_ctx *c, SDL_Event *evt, uint16_t min,
 			c->show_min_max_marker = !c->show_min_max_marker;
 			break;
 
+		case SDL_SCANCODE_P:
+			c->showcounters = !c->showcounters;
+			break;
+
 		case SDL_SCANCODE_F:
 			c->fahren = !c->fahren;
 			break;
@@ -483,14 +739,27 @@ static int sdl_poll_one(struct sdl_ctx *c, SDL_Event *evt, uint16_t min,
 
 		case SDL_SCANCODE_V:
 			if (c->vrecord) {
-				lavc_end_encode(c->vrecord);
+				recorder_end(c->vrecord);
 				c->vrecord = NULL;
 				break;
 			}
 
+			/*
+			 * Hardware encoders take NV12, which is colorized from
+			 * the raw frame separately (see paint_tile()).
+			 */
+			if (c->rgb_opts->hw && !c->nv12) {
+				c->nv12 = malloc(NV12_SIZE);
+				if (!c->nv12)
+					errx(1, "can't allocate NV12 frame");
+			}
+
 			snprintf(path, sizeof(path), "%ld-rgb.mkv", time(NULL));
-			c->vrecord = lavc_start_encode(path, WIDTH, HEIGHT, FPS,
-						       AV_PIX_FMT_BGRA);
+			c->vrecord = recorder_start(path, WIDTH, HEIGHT, FPS,
+						    c->rgb_opts->hw ?
+						    AV_PIX_FMT_NV12 :
+						    AV_PIX_FMT_BGRA,
+						    c->rgb_opts, c->threaded);
 			break;
 
 		case SDL_SCANCODE_Y:
@@ -533,6 +802,38 @@ static int sdl_poll_one(struct sdl_ctx *c, SDL_Event *evt, uint16_t min,
 			c->paused = !c->paused;
 			return TOGGLE_PAUSE;
 
+		case SDL_SCANCODE_COMMA:
+			if (!c->pb)
+				break;
+
+			c->paused = 1;
+			return STEP_BACK;
+
+		case SDL_SCANCODE_PERIOD:
+			if (!c->pb)
+				break;
+
+			c->paused = 1;
+			return STEP_FORWARD;
+
+		case SDL_SCANCODE_LEFTBRACKET:
+			return c->pb ? SPEED_DOWN : NOTHING;
+
+		case SDL_SCANCODE_RIGHTBRACKET:
+			return c->pb ? SPEED_UP : NOTHING;
+
+		case SDL_SCANCODE_PAGEUP:
+			return c->pb ? JUMP_BACK : NOTHING;
+
+		case SDL_SCANCODE_PAGEDOWN:
+			return c->pb ? JUMP_FORWARD : NOTHING;
+
+		case SDL_SCANCODE_HOME:
+			return c->pb ? JUMP_START : NOTHING;
+
+		case SDL_SCANCODE_END:
+			return c->pb ? JUMP_END : NOTHING;
+
 		case SDL_SCANCODE_ESCAPE:
 			return QUIT_PROGRAM;
 		}
@@ -574,180 +875,482 @@ static void paint_colored_marker(const struct sdl_ctx *c,
 			       original_blue_color, original_alpha);
 }
 
+/*
+ * NV12 recordings get their own colorize pass straight from the raw frame, into
+ * a palette of YCbCr entries, rather than converting the BGRA texture.
+ */
+static void record_nv12(struct sdl_ctx *c, const struct palette_cfg *pcfg,
+			uint32_t seq, uint64_t ts_ns, const uint8_t *data,
+			bool valid)
+{
+	struct palette_cfg cfg = *pcfg;
+	uint64_t start;
+
+	if (!valid) {
+		memset(c->nv12, 16, WIDTH * HEIGHT);
+		memset(c->nv12 + WIDTH * HEIGHT, 128, WIDTH * HEIGHT / 2);
+		goto out;
+	}
+
+	start = lat_now();
+	cfg.yuv = true;
+	palette_update(&c->nv12_pal, &cfg);
+	palette_colorize_nv12(&c->nv12_pal, c->nv12, data, WIDTH, HEIGHT,
+			      c->rotate);
+	ctr_add(CTR_COLORIZE_NS, lat_now() - start);
+out:
+	recorder_write(c->vrecord, seq, ts_ns, c->nv12, NV12_SIZE);
+}
+
 /**
- * paint_frame() - Paint a new frame in the SDL window.
+ * paint_tile() - Paint a new frame in one tile of the SDL window.
  * @param c SDL context handle.
+ * @param view Index of the tile, less than the number passed to sdl_open().
  * @param seq Sequence number of frame.
+ * @param ts_ns Capture time of frame (see lat_now()), or zero if unknown.
  * @param data Pointer to raw framebuffer.
  *
- * The framebuffer is assumed to be Y16LE.
+ * The framebuffer is assumed to be Y16LE, and must remain valid until the next
+ * call to paint_present(), which actually shows it.
  *
- * Return: A paint_frame_action to be taken by the caller.
+ * Return: 0 on success, -1 on error.
  */
-int paint_frame(struct sdl_ctx *c, uint32_t seq, const uint8_t *data)
-{
-	uint16_t min = UINT16_MAX, max = 0, ptemp;
-	SDL_Point min_point = { 0, 0 };
-	SDL_Point max_point = { 0, 0 };
-	uint16_t orig_min, orig_max;
-	uint32_t multinv;
-	uint32_t output_index;
-	int ret = NOTHING;
+int paint_tile(struct sdl_ctx *c, int view, uint32_t seq, uint64_t ts_ns,
+	       const uint8_t *data)
+{
+	struct sdl_view *v = &c->views[view];
+	struct palette_cfg pcfg;
+	bool manual, fresh, recolor, gpu;
+	uint64_t start;
 	int pitch, i;
 	uint8_t *memptr;
-	SDL_Event evt;
 	SDL_Rect rect;
 
+	/*
+	 * A paused playback hands us the same frame over and over. Nothing is
+	 * recomputed unless the frame, the view settings, or the overlay have
+	 * changed since it was last painted, and if none of them have, the
+	 * window isn't even redrawn.
+	 */
+	fresh = !v->painted || data != v->last_data || seq != v->last_seq ||
+		ts_ns != v->last_ts_ns;
+
+	if (fresh)
+		v->stats_valid = false;
+
+	if (!(c->pb && c->paused)) {
+		v->frame_paint_seq++;
+		c->dirty = true;
+	}
+
 	// Get temperature at crosshair
 	i = c->crosshair.y * WIDTH * 2 + c->crosshair.x * 2;
 	if (c->rotate) {
 		// Mirror crosshair if output is rotated
 		i = WIDTH * HEIGHT * 2 - i;
 	}
-	ptemp = data[i] | data[i + 1] << 8;
+	v->ptemp = data[i] | data[i + 1] << 8;
 
-	for (i = 0; i < WIDTH * HEIGHT * 2; i += 2) {
-		uint16_t v = data[i] | data[i + 1] << 8;
-		if (v > max) {
-			max = v;
-			max_point = calc_point_from_buf_offset(c, i);
-		}
-		if (v < min) {
-			min = v;
-			min_point = calc_point_from_buf_offset(c, i);
-		}
+	/*
+	 * With a manual scale, the statistics are only used by the overlay.
+	 */
+	manual = c->scale_max || c->scale_min;
+	if (!v->stats_valid && (!manual || c->showtext)) {
+		start = lat_now();
+		frame_stats(&v->st, data, WIDTH * HEIGHT);
+		ctr_add(CTR_STATS_NS, lat_now() - start);
+		lat_record(LAT_STATS, ts_ns);
+		v->stats_valid = true;
 	}
 
+	v->min = v->orig_min = v->st.min;
+	v->max = v->orig_max = v->st.max;
+	v->min_point = calc_point_from_buf_offset(c, v->st.min_idx * 2);
+	v->max_point = calc_point_from_buf_offset(c, v->st.max_idx * 2);
+	v->last_seq = seq;
+
 	rect.y = 0;
 	rect.x = 0;
 	rect.w = WIDTH;
 	rect.h = HEIGHT;
 
-	if (SDL_LockTexture(c->t, &rect, (void **)&memptr, &pitch))
-		return -1;
+	if (manual) {
+		v->max = c->scale_max;
+		v->min = c->scale_min;
+	}
 
-	if (c->showinithelp && now_mono() - c->inittsmono > 5)
-		c->showinithelp = false;
+	pcfg = (struct palette_cfg){
+		.min = v->min,
+		.max = v->max,
+		.gammafactor = c->gammafactor,
+		.contours = c->contours,
+		.invert = c->invert,
+		.colormap = c->colormap,
+	};
 
-	orig_max = max;
-	orig_min = min;
+	/*
+	 * RGB recordings need the colorized frame in memory, so they always
+	 * use the CPU path, and record every frame even while paused.
+	 */
+	gpu = c->gpu && !c->vrecord;
+	recolor = fresh || c->vrecord || gpu != v->last_gpu ||
+		  c->rotate != v->last_rotate ||
+		  !palette_cfg_equal(&pcfg, &v->last_cfg);
+
+	if (!recolor)
+		return 0;
+
+	v->last_data = data;
+	v->last_ts_ns = ts_ns;
+	v->last_cfg = pcfg;
+	v->last_rotate = c->rotate;
+	v->last_gpu = gpu;
+	v->painted = true;
+	v->presented = false;
+	c->dirty = true;
 
-	if (c->scale_max || c->scale_min) {
-		max = c->scale_max;
-		min = c->scale_min;
+	/*
+	 * The GPU colorizes straight into the window, so that happens when
+	 * the window is redrawn.
+	 */
+	if (gpu) {
+		v->upload = data;
+		return 0;
 	}
 
-	if (min >= max) {
+	if (SDL_LockTexture(v->t, &rect, (void **)&memptr, &pitch))
+		return -1;
+
+	if (v->min >= v->max) {
 		memset(memptr, 0, WIDTH * HEIGHT * 4);
 		goto skippaint;
 	}
 
-	/*
-	 * We need to compute:
-	 *
-	 *			  V - min
-	 *			 ---------
-	 *			 max - min
-	 *
-	 * ...for each distinct pixel value V. Because the denominator is the
-	 * same for every pixel, we can calculate the multiplicative inverse of
-	 * (max - min) with a single division, and subsequently use hardware
-	 * multiplication to compute the ratio for each pixel.
-	 */
+	start = lat_now();
+	palette_update(&c->pal, &pcfg);
+	palette_colorize(&c->pal, (uint32_t *)memptr, data, WIDTH * HEIGHT,
+			 c->rotate);
+	ctr_add(CTR_COLORIZE_NS, lat_now() - start);
+	lat_record(LAT_COLORIZE, ts_ns);
 
-	multinv = (1UL << 24) / ((uint32_t)max - min);
-	for (i = 0; i < WIDTH * HEIGHT * 2; i += 2) {
-		uint32_t raw = (uint32_t)data[i] | data[i + 1] << 8;
-		uint8_t pval;
+skippaint:
+	if (c->vrecord && !view && c->rgb_opts->hw) {
+		record_nv12(c, &pcfg, seq, ts_ns, data, v->min < v->max);
+	} else if (c->vrecord && !view) {
+		recorder_write(c->vrecord, seq, ts_ns, memptr, VSIZE);
+	}
 
-		if (raw <= min)
-			pval = 0;
-		else if (raw >= max)
-			pval = 255;
-		else
-			pval = (multinv * (raw - min)) >> 16;
+	SDL_UnlockTexture(v->t);
+	return 0;
+}
+
+static void temp_str(const struct sdl_ctx *c, char *buf, size_t len,
+		     uint16_t raw)
+{
+	struct temp_fixp t = raw_to_celsius(raw);
+
+	if (c->fahren)
+		t = celsius_to_fahrenheit(t);
+
+	snprintf(buf, len, "%s%u.%02u", t.sign ? "-" : "", t.major,
+		 b10lookup[t.minor]);
+}
 
+/*
+ * Each region is outlined and labelled with its name, mean, and maximum, and
+ * the hottest pixel in it is marked. Spots only show their value.
+ */
+static void paint_rois(struct sdl_ctx *c, const struct sdl_view *v)
+{
+	char name[ROI_NAME_LEN], mean[16], max[16];
+	SDL_Color orig;
+	SDL_Rect rect;
+	SDL_Point p;
+	int i, ty;
+
+	for (i = 0; i < v->nr_roi; i++) {
+		const struct roi_result *r = &v->roi[i];
+
+		rect = (SDL_Rect){ r->x, r->y, r->w, r->h };
+		p = (SDL_Point){ r->max_x, r->max_y };
 		if (c->rotate) {
-			// Rotating the output by 180° is equivalent to iterating through the flattened RGBA array backwards,
-			// but still filling BGRA values in the same order (== subtract a constant of 4).
-			output_index = (WIDTH * HEIGHT - i / 2) * 4 - 4;
-		} else {
-			output_index = i / 2 * 4;
+			rect.x = WIDTH - r->x - r->w;
+			rect.y = HEIGHT - r->y - r->h;
+			p = (SDL_Point){ WIDTH - 1 - r->max_x,
+					 HEIGHT - 1 - r->max_y };
+		}
+
+		if (i < c->nr_roi_names)
+			strcpy(name, c->roi_names[i].name);
+		else
+			snprintf(name, sizeof(name), "#%d", i);
+
+		temp_str(c, mean, sizeof(mean), r->mean);
+		temp_str(c, max, sizeof(max), r->max);
+
+		ty = rect.y >= TEXT_LINE ? rect.y - TEXT_LINE :
+					   rect.y + rect.h + 1;
+
+		if (r->w == 1 && r->h == 1) {
+			drawtext(c, rect.x + 3, ty, "%s %s%c", name, mean,
+				 c->fahren ? 'F' : 'C');
+			p = (SDL_Point){ v->origin.x + rect.x,
+					 v->origin.y + rect.y };
+			paint_colored_marker(c, &p, 1, &c->crosshair_color);
+			continue;
 		}
 
-		memptr[output_index] = getcolor(c, BLUE, pval);
-		memptr[output_index + 1] = getcolor(c, GREEN, pval);
-		memptr[output_index + 2] = getcolor(c, RED, pval);
-		memptr[output_index + 3] = 255;
+		drawtext(c, rect.x, ty, "%s %s/%s%c", name, mean, max,
+			 c->fahren ? 'F' : 'C');
+
+		rect.x += v->origin.x;
+		rect.y += v->origin.y;
+		SDL_GetRenderDrawColor(c->r, &orig.r, &orig.g, &orig.b,
+				       &orig.a);
+		SDL_SetRenderDrawColor(c->r, c->crosshair_color.r,
+				       c->crosshair_color.g,
+				       c->crosshair_color.b, 255);
+		SDL_RenderDrawRect(c->r, &rect);
+		SDL_SetRenderDrawColor(c->r, orig.r, orig.g, orig.b, orig.a);
+
+		p.x += v->origin.x;
+		p.y += v->origin.y;
+		paint_colored_marker(c, &p, 1, &SDL_COLOR_RED);
 	}
+}
 
-skippaint:
-	if (c->vrecord)
-		if (lavc_encode(c->vrecord, seq, memptr, VSIZE))
-			err(1, "can't vrecord");
+/**
+ * sdl_roi_names() - Name the regions of interest shown in the overlay.
+ * @param c SDL context handle.
+ * @param rois Regions, which must outlive the context.
+ * @param nr Number of regions.
+ *
+ * Regions without a name, like those received from a remote with a different
+ * list, are shown by their number.
+ *
+ * Return: Nothing.
+ */
+void sdl_roi_names(struct sdl_ctx *c, const struct roi *rois, int nr)
+{
+	c->roi_names = rois;
+	c->nr_roi_names = nr;
+}
 
-	SDL_UnlockTexture(c->t);
-	SDL_RenderCopy(c->r, c->t, &rect, &rect);
+/**
+ * sdl_set_roi() - Give the overlay the region measurements for a tile.
+ * @param c SDL context handle.
+ * @param view Index of the tile.
+ * @param res Measurements of the frame about to be painted in the tile.
+ * @param nr Number of measurements, at most ROI_MAX.
+ *
+ * Call this before paint_tile() with each frame.
+ *
+ * Return: Nothing.
+ */
+void sdl_set_roi(struct sdl_ctx *c, int view, const struct roi_result *res,
+		 int nr)
+{
+	struct sdl_view *v = &c->views[view];
 
-	if (!(c->pb && c->paused))
-		c->frame_paint_seq++;
+	if (nr != v->nr_roi || memcmp(res, v->roi, nr * sizeof(*res)))
+		c->dirty = true;
+
+	memcpy(v->roi, res, nr * sizeof(*res));
+	v->nr_roi = nr;
+}
+
+static void paint_view(struct sdl_ctx *c, struct sdl_view *v)
+{
+	SDL_Rect dst = { v->origin.x, v->origin.y, WIDTH, HEIGHT };
+	SDL_Point p;
+	uint64_t start;
+
+	c->origin = v->origin;
+	if (v->last_gpu) {
+		start = lat_now();
+		palette_update_pal8(&c->pal, &v->last_cfg);
+		gpu_paint(c->gpu, v->upload, c->pal.pal8, v->min, v->max,
+			  c->rotate);
+		ctr_add(CTR_COLORIZE_NS, lat_now() - start);
+		if (v->upload)
+			lat_record(LAT_COLORIZE, v->last_ts_ns);
+
+		v->upload = NULL;
+	} else {
+		SDL_RenderCopy(c->r, v->t, NULL, &dst);
+	}
 
 	if (c->showtext) {
-		showtexts(c, raw_to_celsius(orig_max), raw_to_celsius(ptemp),
-			  raw_to_celsius(orig_min), seq);
+		showtexts(c, v, raw_to_celsius(v->orig_max),
+			  raw_to_celsius(v->ptemp), raw_to_celsius(v->orig_min),
+			  v->last_seq);
 
-		paint_colored_marker(c, &c->crosshair, 2, &c->crosshair_color);
+		p = (SDL_Point){ v->origin.x + c->crosshair.x,
+				 v->origin.y + c->crosshair.y };
+		paint_colored_marker(c, &p, 2, &c->crosshair_color);
 
 		if (c->show_min_max_marker && !c->paused) {
-			paint_colored_marker(c, &min_point, 1, &SDL_COLOR_BLUE);
-			paint_colored_marker(c, &max_point, 1, &SDL_COLOR_RED);
+			p = (SDL_Point){ v->origin.x + v->min_point.x,
+					 v->origin.y + v->min_point.y };
+			paint_colored_marker(c, &p, 1, &SDL_COLOR_BLUE);
+
+			p = (SDL_Point){ v->origin.x + v->max_point.x,
+					 v->origin.y + v->max_point.y };
+			paint_colored_marker(c, &p, 1, &SDL_COLOR_RED);
 		}
+
+		paint_rois(c, v);
 	}
 
+	c->origin = (SDL_Point){ 0, 0 };
+}
+
+static void present(struct sdl_ctx *c)
+{
+	uint64_t start;
+	int i;
+
+	if (c->showinithelp && now_mono() - c->inittsmono > 5) {
+		c->showinithelp = false;
+		c->dirty = true;
+	}
+
+	if (!c->dirty)
+		return;
+
+	start = lat_now();
+
+	/*
+	 * With more than one tile, some of the window can be left uncovered.
+	 */
+	if (c->nr_views > 1)
+		SDL_RenderClear(c->r);
+
+	for (i = 0; i < c->nr_views; i++)
+		if (c->views[i].painted)
+			paint_view(c, &c->views[i]);
+
 	if (c->showhelp)
-		showhelptext(c);
+		blit_text(c, &c->help);
 	else if (c->showlicense)
-		showlicensetext(c);
+		blit_text(c, &c->license);
 
 	SDL_RenderPresent(c->r);
+	ctr_add(CTR_PRESENT_NS, lat_now() - start);
 
-	while (SDL_PollEvent(&evt) && ret == NOTHING)
-		ret = sdl_poll_one(c, &evt, min, max);
+	for (i = 0; i < c->nr_views; i++) {
+		if (c->views[i].painted && !c->views[i].presented)
+			lat_record(LAT_PRESENT, c->views[i].last_ts_ns);
+
+		c->views[i].presented = true;
+	}
+
+	c->dirty = false;
+}
+
+static int poll_events(struct sdl_ctx *c)
+{
+	int ret = NOTHING;
+	SDL_Event evt;
+
+	/*
+	 * Any event might change the overlay, or mean the window needs to be
+	 * redrawn, so the window is always redrawn after one.
+	 */
+	while (ret == NOTHING && SDL_PollEvent(&evt)) {
+		ret = sdl_poll_one(c, &evt, c->views[0].min, c->views[0].max);
+		c->dirty = true;
+	}
 
 	return ret;
 }
 
+/**
+ * paint_present() - Redraw the SDL window, and handle any input.
+ * @param c SDL context handle.
+ *
+ * Every tile shows the last frame given to paint_tile() for it, or nothing
+ * if there hasn't been one yet.
+ *
+ * Return: A paint_frame_action to be taken by the caller.
+ */
+int paint_present(struct sdl_ctx *c)
+{
+	present(c);
+	return poll_events(c);
+}
+
+/**
+ * sdl_poll() - Handle input between frames.
+ * @param c SDL context handle.
+ *
+ * Pending events are handled, and the window redrawn with the last frames if
+ * any of them changed it, so the overlay responds without waiting for the
+ * next frame. Changes to the colour scale take effect with the next frame.
+ *
+ * Return: A paint_frame_action to be taken by the caller.
+ */
+int sdl_poll(struct sdl_ctx *c)
+{
+	int ret = poll_events(c);
+
+	present(c);
+	return ret;
+}
+
+/**
+ * paint_frame() - Paint a new frame in the SDL window.
+ * @param c SDL context handle.
+ * @param seq Sequence number of frame.
+ * @param ts_ns Capture time of frame (see lat_now()), or zero if unknown.
+ * @param data Pointer to raw framebuffer.
+ *
+ * The framebuffer is assumed to be Y16LE. This is paint_tile() for the first
+ * tile, followed by paint_present().
+ *
+ * Return: A paint_frame_action to be taken by the caller.
+ */
+int paint_frame(struct sdl_ctx *c, uint32_t seq, uint64_t ts_ns,
+		const uint8_t *data)
+{
+	if (paint_tile(c, 0, seq, ts_ns, data))
+		return -1;
+
+	return paint_present(c);
+}
+
 /**
  * sdl_open() - Create a new SDL window.
  * @param upscaled_width Real pixel width of window on desktop.
  * @param upscaled_height Real pixel height of window on desktop.
  * @param pb True for playback mode.
- * @param fontpath Path to font for rendering text.
+ * @param fontpath Path to font for rendering text, or NULL for the built-in
+ *		  font.
+ * @param hidehelp Don't show the initial help message.
+ * @param threaded Run RGB recording encoders in their own threads.
+ * @param rgb_opts Encoder tuning for RGB recordings.
+ * @param gpu Colorize frames on the GPU (see gpu.c) if possible.
+ * @param nr_views Number of tiles in the window, up to SDL_MAX_VIEWS.
+ *
+ * With more than one tile, the window is as tall as it needs to be to fit them
+ * at upscaled_width, and frames are always colorized on the CPU.
  *
  * Return: SDL context handle on success, NULL on error.
  */
 struct sdl_ctx *sdl_open(int upscaled_width, int upscaled_height, bool pb,
-			 const char *fontpath, bool hidehelp)
+			 const char *fontpath, bool hidehelp, bool threaded,
+			 const struct lavc_enc_opts *rgb_opts, bool gpu,
+			 int nr_views)
 {
 	const char *window_name = "Linux V4L2/SDL2 IR Camera Viewer";
-	FILE *font_tmpfile = NULL;
+	int i, cols = nr_views > 1 ? 2 : 1;
+	int rows = (nr_views + cols - 1) / cols;
 	struct sdl_ctx *c;
-	char tmp[32];
-
-	if (!fontpath) {
-		const uint8_t *src = &builtin_ttf_start;
-		size_t len = &builtin_ttf_end - src;
 
-		font_tmpfile = tmpfile();
-		if (fwrite(src, 1, len, font_tmpfile) != len)
-			err(1, "can't initialize built-in font, try -f");
+	if (nr_views < 1 || nr_views > SDL_MAX_VIEWS)
+		errx(1, "can't show %d views in one window", nr_views);
 
-		snprintf(tmp, sizeof(tmp), "/proc/self/fd/%d",
-			 fileno(font_tmpfile));
-		fontpath = tmp;
-	}
-
-	if (access(fontpath, R_OK))
+	if (fontpath && access(fontpath, R_OK))
 		err(1, "can't read '%s': pass a path to a valid font with '-f'",
 		    fontpath);
 
@@ -757,6 +1360,11 @@ struct sdl_ctx *sdl_open(int upscaled_width, int upscaled_height, bool pb,
 
 	c->inittsmono = now_mono();
 	c->pb = pb;
+	c->speed = 1;
+	c->ctr_sec = c->inittsmono;
+	ctr_snapshot(c->ctr_last);
+	c->threaded = threaded;
+	c->rgb_opts = rgb_opts;
 	c->colormap = 1;
 	c->showtext = 1;
 	c->fahren = 1;
@@ -765,25 +1373,49 @@ struct sdl_ctx *sdl_open(int upscaled_width, int upscaled_height, bool pb,
 	c->crosshair.x = WIDTH / 2;
 	c->crosshair.y = HEIGHT / 2;
 	update_crosshair_color(c);
-	c->fontpath = strdup(fontpath);
-	c->fonttmp = font_tmpfile;
+	if (fontpath)
+		c->fontpath = strdup(fontpath);
 
 	if (!hidehelp)
 		c->showinithelp = true;
 
+	if (nr_views > 1) {
+		upscaled_height = (int64_t)upscaled_width * rows * HEIGHT /
+				  (cols * WIDTH);
+		gpu = false;
+	}
+
+	c->nr_views = nr_views;
+	for (i = 0; i < nr_views; i++)
+		c->views[i].origin = (SDL_Point){ i % cols * WIDTH,
+						  i / cols * HEIGHT };
+
 	c->w = SDL_CreateWindow(window_name, 0, 0, upscaled_width,
 				upscaled_height, SDL_WINDOW_SHOWN);
 
-	c->r = SDL_CreateRenderer(c->w, -1, 0);
-	SDL_RenderSetLogicalSize(c->r, WIDTH, HEIGHT);
+	if (gpu) {
+		c->r = gpu_create_renderer(c->w);
+		if (c->r)
+			c->gpu = gpu_open(c->r);
+
+		if (!c->gpu)
+			warnx("can't use the GPU, colorizing on the CPU");
+	}
+
+	if (!c->r)
+		c->r = SDL_CreateRenderer(c->w, -1, 0);
+
+	SDL_RenderSetLogicalSize(c->r, cols * WIDTH, rows * HEIGHT);
 	SDL_ShowCursor(SDL_DISABLE);
 
 	/*
 	 * Everything is flexible about field order except FFV1, which only
 	 * supports BGR. So we just use BGR everywhere...
 	 */
-	c->t = SDL_CreateTexture(c->r, SDL_PIXELFORMAT_BGRA32,
-				 SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
+	for (i = 0; i < nr_views; i++)
+		c->views[i].t = SDL_CreateTexture(c->r, SDL_PIXELFORMAT_BGRA32,
+						  SDL_TEXTUREACCESS_STREAMING,
+						  WIDTH, HEIGHT);
 
 	TTF_Init();
 	sdl_open_fontcache(c);
@@ -798,7 +1430,20 @@ struct sdl_ctx *sdl_open(int upscaled_width, int upscaled_height, bool pb,
  */
 void sdl_close(struct sdl_ctx *c)
 {
-	SDL_DestroyTexture(c->t);
+	int i;
+
+	if (c->gpu)
+		gpu_close(c->gpu);
+
+	for (i = 0; i < c->nr_lines; i++)
+		SDL_DestroyTexture(c->lines[i].t);
+
+	SDL_DestroyTexture(c->help.t);
+	SDL_DestroyTexture(c->license.t);
+	for (i = 0; i < c->nr_views; i++)
+		SDL_DestroyTexture(c->views[i].t);
+
+	free(c->nv12);
 	SDL_DestroyRenderer(c->r);
 	SDL_DestroyWindow(c->w);
 	SDL_Quit();
@@ -806,12 +1451,36 @@ void sdl_close(struct sdl_ctx *c)
 	free((void *)c->fontpath);
 	TTF_Quit();
 
-	if (c->fonttmp)
-		fclose(c->fonttmp);
-
 	free(c);
 }
 
+/**
+ * sdl_playback_speed() - Tell SDL the playback speed to display.
+ * @param c SDL context handle.
+ * @param speed Multiple of real time, negative when playing backwards.
+ *
+ * Return: Nothing.
+ */
+void sdl_playback_speed(struct sdl_ctx *c, int speed)
+{
+	c->speed = speed;
+}
+
+/**
+ * sdl_view_range() - Get the colour scale range the user fixed, if any.
+ * @param c SDL context handle.
+ * @param min Output lowest raw value on the scale.
+ * @param max Output highest raw value on the scale.
+ *
+ * Return: True if the range is fixed, false if it follows each frame.
+ */
+bool sdl_view_range(struct sdl_ctx *c, uint16_t *min, uint16_t *max)
+{
+	*min = c->scale_min;
+	*max = c->scale_max;
+	return c->scale_min || c->scale_max;
+}
+
 /**
  * sdl_loop() - Indicate to SDL the playback has looped.
  * @param c SDL context handle.
@@ -823,11 +1492,14 @@ void sdl_close(struct sdl_ctx *c)
  */
 void sdl_loop(struct sdl_ctx *c)
 {
+	int i;
+
 	c->looped = 1;
-	c->frame_paint_seq = 0;
+	for (i = 0; i < c->nr_views; i++)
+		c->views[i].frame_paint_seq = 0;
 
 	if (c->vrecord) {
-		lavc_end_encode(c->vrecord);
+		recorder_end(c->vrecord);
 		c->vrecord = NULL;
 	}
 }
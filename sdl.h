@@ -20,21 +20,56 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "roi.h"
+
+/*
+ * The most cameras which can be shown in one window.
+ */
+#define SDL_MAX_VIEWS 4
+
 struct sdl_ctx;
+struct lavc_enc_opts;
 
 enum paint_frame_action {
 	NOTHING,
 	TOGGLE_Y16_RECORD,
 	TOGGLE_PAUSE,
+	STEP_FORWARD,
+	STEP_BACK,
+	SPEED_UP,
+	SPEED_DOWN,
+	JUMP_FORWARD,
+	JUMP_BACK,
+	JUMP_START,
+	JUMP_END,
 	QUIT_PROGRAM,
 };
 
 #ifndef IRCAM_NOSDL
 
 struct sdl_ctx *sdl_open(int upscaled_width, int upscaled_height, bool pb,
-			 const char *fontpath, bool hidehelp);
+			 const char *fontpath, bool hidehelp, bool threaded,
+			 const struct lavc_enc_opts *rgb_opts, bool gpu,
+			 int nr_views);
+
+int paint_tile(struct sdl_ctx *c, int view, uint32_t seq, uint64_t ts_ns,
+	       const uint8_t *data);
+
+void sdl_roi_names(struct sdl_ctx *c, const struct roi *rois, int nr);
+
+void sdl_set_roi(struct sdl_ctx *c, int view, const struct roi_result *res,
+		 int nr);
+
+int paint_present(struct sdl_ctx *c);
+
+int sdl_poll(struct sdl_ctx *c);
 
-int paint_frame(struct sdl_ctx *c, uint32_t seq, const uint8_t *data);
+int paint_frame(struct sdl_ctx *c, uint32_t seq, uint64_t ts_ns,
+		const uint8_t *data);
+
+void sdl_playback_speed(struct sdl_ctx *c, int speed);
+
+bool sdl_view_range(struct sdl_ctx *c, uint16_t *min, uint16_t *max);
 
 void sdl_loop(struct sdl_ctx *c);
 
@@ -47,16 +82,54 @@ struct sdl_ctx {
 };
 
 static struct sdl_ctx *sdl_open(int upscaled_width, int upscaled_height,
-				bool pb, const char *fontpath, bool hidehelp)
+				bool pb, const char *fontpath, bool hidehelp,
+				bool threaded,
+				const struct lavc_enc_opts *rgb_opts, bool gpu,
+				int nr_views)
 {
 	return (void *)0xdecafbadULL;
 }
 
-static int paint_frame(struct sdl_ctx *c, uint32_t seq, const uint8_t *data)
+static int paint_tile(struct sdl_ctx *c, int view, uint32_t seq,
+		      uint64_t ts_ns, const uint8_t *data)
+{
+	return 0;
+}
+
+static void sdl_roi_names(struct sdl_ctx *c, const struct roi *rois, int nr)
+{
+}
+
+static void sdl_set_roi(struct sdl_ctx *c, int view,
+			const struct roi_result *res, int nr)
+{
+}
+
+static int paint_present(struct sdl_ctx *c)
 {
 	return NOTHING;
 }
 
+static int sdl_poll(struct sdl_ctx *c)
+{
+	return NOTHING;
+}
+
+static int paint_frame(struct sdl_ctx *c, uint32_t seq, uint64_t ts_ns,
+		       const uint8_t *data)
+{
+	return NOTHING;
+}
+
+static void sdl_playback_speed(struct sdl_ctx *c, int speed)
+{
+}
+
+static bool sdl_view_range(struct sdl_ctx *c, uint16_t *min, uint16_t *max)
+{
+	return false;
+}
+
 static void sdl_loop(struct sdl_ctx *c)
 {
 }
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STATS_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define STATS_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * All the vector kernels work in two passes: first they find the minimum and
+ * maximum values with a branchless vertical reduction, then they find the
+ * first pixel with each of those values. The second pass usually terminates
+ * early, and only falls back to scalar code for the vectors which actually
+ * contain a match. The scalar kernel does it in one pass.
+ */
+
+static uint16_t get16(const uint8_t *data, int i)
+{
+	return data[i * 2] | data[i * 2 + 1] << 8;
+}
+
+static void minmax_scalar(const uint8_t *data, int start, int end,
+			  uint16_t *minp, uint16_t *maxp)
+{
+	uint16_t min = *minp, max = *maxp;
+	int i;
+
+	for (i = start; i < end; i++) {
+		uint16_t v = get16(data, i);
+
+		if (v > max)
+			max = v;
+		if (v < min)
+			min = v;
+	}
+
+	*minp = min;
+	*maxp = max;
+}
+
+/*
+ * Fill in whichever of min_idx/max_idx are still unset from pixels in the
+ * range [start, end). Returns true when both are set.
+ */
+static bool find_scalar(struct frame_stats *s, const uint8_t *data, int start,
+			int end)
+{
+	int i;
+
+	for (i = start; i < end; i++) {
+		uint16_t v = get16(data, i);
+
+		if (s->min_idx == -1 && v == s->min)
+			s->min_idx = i;
+		if (s->max_idx == -1 && v == s->max)
+			s->max_idx = i;
+	}
+
+	return s->min_idx != -1 && s->max_idx != -1;
+}
+
+static void stats_scalar(struct frame_stats *s, const uint8_t *data,
+			 int nr_pixels)
+{
+	uint16_t min = UINT16_MAX, max = 0;
+	int min_idx = 0, max_idx = 0;
+	int i;
+
+	for (i = 0; i < nr_pixels; i++) {
+		uint16_t v = get16(data, i);
+
+		if (v > max) {
+			max = v;
+			max_idx = i;
+		}
+		if (v < min) {
+			min = v;
+			min_idx = i;
+		}
+	}
+
+	s->min = min;
+	s->max = max;
+	s->min_idx = min_idx;
+	s->max_idx = max_idx;
+}
+
+#ifdef STATS_X86
+
+/*
+ * SSE2 has no unsigned 16-bit min/max, so flip the sign bit and use the
+ * signed versions.
+ */
+__attribute__((target("sse2"))) static void
+stats_sse2(struct frame_stats *s, const uint8_t *data, int nr_pixels)
+{
+	const __m128i bias = _mm_set1_epi16((short)0x8000);
+	__m128i vmin0 = _mm_set1_epi16(INT16_MAX);
+	__m128i vmax0 = _mm_set1_epi16(INT16_MIN);
+	__m128i vmin1 = vmin0, vmax1 = vmax0;
+	__m128i vmn, vmx;
+	int i;
+
+	for (i = 0; i + 16 <= nr_pixels; i += 16) {
+		const __m128i *p = (const __m128i *)(data + i * 2);
+		__m128i v0 = _mm_xor_si128(_mm_loadu_si128(p), bias);
+		__m128i v1 = _mm_xor_si128(_mm_loadu_si128(p + 1), bias);
+
+		vmin0 = _mm_min_epi16(vmin0, v0);
+		vmax0 = _mm_max_epi16(vmax0, v0);
+		vmin1 = _mm_min_epi16(vmin1, v1);
+		vmax1 = _mm_max_epi16(vmax1, v1);
+	}
+
+	vmin0 = _mm_min_epi16(vmin0, vmin1);
+	vmin0 = _mm_min_epi16(vmin0, _mm_shuffle_epi32(vmin0, 0x4E));
+	vmin0 = _mm_min_epi16(vmin0, _mm_shuffle_epi32(vmin0, 0xB1));
+	vmin0 = _mm_min_epi16(vmin0, _mm_shufflelo_epi16(vmin0, 0xB1));
+	vmax0 = _mm_max_epi16(vmax0, vmax1);
+	vmax0 = _mm_max_epi16(vmax0, _mm_shuffle_epi32(vmax0, 0x4E));
+	vmax0 = _mm_max_epi16(vmax0, _mm_shuffle_epi32(vmax0, 0xB1));
+	vmax0 = _mm_max_epi16(vmax0, _mm_shufflelo_epi16(vmax0, 0xB1));
+
+	s->min = (uint16_t)_mm_extract_epi16(vmin0, 0) ^ 0x8000;
+	s->max = (uint16_t)_mm_extract_epi16(vmax0, 0) ^ 0x8000;
+	minmax_scalar(data, i, nr_pixels, &s->min, &s->max);
+
+	s->min_idx = -1;
+	s->max_idx = -1;
+	vmn = _mm_set1_epi16((short)s->min);
+	vmx = _mm_set1_epi16((short)s->max);
+
+	for (i = 0; i + 8 <= nr_pixels; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i * 2));
+		__m128i eq = _mm_or_si128(_mm_cmpeq_epi16(v, vmn),
+					  _mm_cmpeq_epi16(v, vmx));
+
+		if (_mm_movemask_epi8(eq) && find_scalar(s, data, i, i + 8))
+			return;
+	}
+
+	find_scalar(s, data, i, nr_pixels);
+}
+
+__attribute__((target("avx2"))) static void
+stats_avx2(struct frame_stats *s, const uint8_t *data, int nr_pixels)
+{
+	__m256i vmin0 = _mm256_set1_epi16((short)UINT16_MAX);
+	__m256i vmax0 = _mm256_setzero_si256();
+	__m256i vmin1 = vmin0, vmax1 = vmax0;
+	__m256i vmn, vmx;
+	__m128i m;
+	int i;
+
+	for (i = 0; i + 32 <= nr_pixels; i += 32) {
+		const __m256i *p = (const __m256i *)(data + i * 2);
+		__m256i v0 = _mm256_loadu_si256(p);
+		__m256i v1 = _mm256_loadu_si256(p + 1);
+
+		vmin0 = _mm256_min_epu16(vmin0, v0);
+		vmax0 = _mm256_max_epu16(vmax0, v0);
+		vmin1 = _mm256_min_epu16(vmin1, v1);
+		vmax1 = _mm256_max_epu16(vmax1, v1);
+	}
+
+	vmin0 = _mm256_min_epu16(vmin0, vmin1);
+	vmax0 = _mm256_max_epu16(vmax0, vmax1);
+
+	/*
+	 * PHMINPOSUW does the horizontal part: invert to get the maximum.
+	 */
+	m = _mm_min_epu16(_mm256_castsi256_si128(vmin0),
+			  _mm256_extracti128_si256(vmin0, 1));
+	s->min = (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(m));
+
+	m = _mm_max_epu16(_mm256_castsi256_si128(vmax0),
+			  _mm256_extracti128_si256(vmax0, 1));
+	m = _mm_xor_si128(m, _mm_set1_epi16(-1));
+	s->max = ~(uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(m));
+	minmax_scalar(data, i, nr_pixels, &s->min, &s->max);
+
+	s->min_idx = -1;
+	s->max_idx = -1;
+	vmn = _mm256_set1_epi16((short)s->min);
+	vmx = _mm256_set1_epi16((short)s->max);
+
+	for (i = 0; i + 16 <= nr_pixels; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i * 2));
+		__m256i eq = _mm256_or_si256(_mm256_cmpeq_epi16(v, vmn),
+					     _mm256_cmpeq_epi16(v, vmx));
+
+		if (_mm256_movemask_epi8(eq) && find_scalar(s, data, i, i + 16))
+			return;
+	}
+
+	find_scalar(s, data, i, nr_pixels);
+}
+
+#endif /* STATS_X86 */
+
+#ifdef STATS_NEON
+
+static uint16_t neon_hmin(uint16x8_t v)
+{
+#ifdef __aarch64__
+	return vminvq_u16(v);
+#else
+	uint16x4_t m = vmin_u16(vget_low_u16(v), vget_high_u16(v));
+
+	m = vpmin_u16(m, m);
+	m = vpmin_u16(m, m);
+	return vget_lane_u16(m, 0);
+#endif
+}
+
+static uint16_t neon_hmax(uint16x8_t v)
+{
+#ifdef __aarch64__
+	return vmaxvq_u16(v);
+#else
+	uint16x4_t m = vmax_u16(vget_low_u16(v), vget_high_u16(v));
+
+	m = vpmax_u16(m, m);
+	m = vpmax_u16(m, m);
+	return vget_lane_u16(m, 0);
+#endif
+}
+
+static void stats_neon(struct frame_stats *s, const uint8_t *data,
+		       int nr_pixels)
+{
+	uint16x8_t vmin0 = vdupq_n_u16(UINT16_MAX);
+	uint16x8_t vmax0 = vdupq_n_u16(0);
+	uint16x8_t vmin1 = vmin0, vmax1 = vmax0;
+	uint16x8_t vmn, vmx;
+	int i;
+
+	for (i = 0; i + 16 <= nr_pixels; i += 16) {
+		const uint8_t *p = data + i * 2;
+		uint16x8_t v0 = vreinterpretq_u16_u8(vld1q_u8(p));
+		uint16x8_t v1 = vreinterpretq_u16_u8(vld1q_u8(p + 16));
+
+		vmin0 = vminq_u16(vmin0, v0);
+		vmax0 = vmaxq_u16(vmax0, v0);
+		vmin1 = vminq_u16(vmin1, v1);
+		vmax1 = vmaxq_u16(vmax1, v1);
+	}
+
+	s->min = neon_hmin(vminq_u16(vmin0, vmin1));
+	s->max = neon_hmax(vmaxq_u16(vmax0, vmax1));
+	minmax_scalar(data, i, nr_pixels, &s->min, &s->max);
+
+	s->min_idx = -1;
+	s->max_idx = -1;
+	vmn = vdupq_n_u16(s->min);
+	vmx = vdupq_n_u16(s->max);
+
+	for (i = 0; i + 8 <= nr_pixels; i += 8) {
+		uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(data + i * 2));
+		uint16x8_t eq = vorrq_u16(vceqq_u16(v, vmn), vceqq_u16(v, vmx));
+
+		if (neon_hmax(eq) && find_scalar(s, data, i, i + 8))
+			return;
+	}
+
+	find_scalar(s, data, i, nr_pixels);
+}
+
+#endif /* STATS_NEON */
+
+static void (*stats_kernel)(struct frame_stats *s, const uint8_t *data,
+			    int nr_pixels) = stats_scalar;
+
+/**
+ * stats_init() - Select the fastest frame_stats() kernel for this CPU.
+ *
+ * Call this once at startup, before any calls to frame_stats().
+ *
+ * Return: Name of the selected kernel.
+ */
+const char *stats_init(void)
+{
+#ifdef STATS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		stats_kernel = stats_avx2;
+		return "avx2";
+	}
+
+	if (__builtin_cpu_supports("sse2")) {
+		stats_kernel = stats_sse2;
+		return "sse2";
+	}
+#endif
+
+#ifdef STATS_NEON
+	stats_kernel = stats_neon;
+	return "neon";
+#endif
+
+	stats_kernel = stats_scalar;
+	return "scalar";
+}
+
+/**
+ * frame_stats() - Find the minimum and maximum values in a frame.
+ * @param s Output statistics.
+ * @param data Pointer to raw Y16LE framebuffer.
+ * @param nr_pixels Number of pixels in the framebuffer.
+ *
+ * The min_idx and max_idx outputs are the pixel indices of the first pixel
+ * with the minimum and maximum value, respectively.
+ *
+ * Return: Nothing.
+ */
+void frame_stats(struct frame_stats *s, const uint8_t *data, int nr_pixels)
+{
+	stats_kernel(s, data, nr_pixels);
+}
@@ -0,0 +1,464 @@
+/*
+ * Benchmarks for the per-frame hot paths
+ * Copyright (C) 2024 Calvin Owens <calvin@wbinvd.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Usage: ./util/bench [raw-recording.mkv]
+ *
+ * Runs frame_stats(), roi_measure(), palette_update(), palette_colorize(),
+ * palette_colorize_nv12(), and the FFV1 encoder and decoder over synthetic Y16
+ * frames, and over the first frames of a raw recording if one is given.
+ * Results are printed as CSV on stdout, one row per kernel and setting, with
+ * comment lines describing the machine.
+ *
+ * Cycles are counted with perf_event_open(): if that isn't allowed (see
+ * /proc/sys/kernel/perf_event_paranoid), the cycles column is left empty.
+ * The counter is opened before anything else starts, and is inherited, so the
+ * codecs' own threads are counted too.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+
+#include "../dev.h"
+#include "../lavc.h"
+#include "../palette.h"
+#include "../roi.h"
+#include "../stats.h"
+
+#define NR_PIXELS (WIDTH * HEIGHT)
+#define NR_SYNTH 64
+#define NR_FILE 256
+#define NR_CODEC 250
+#define MIN_NS 500000000ULL
+
+struct input {
+	const char *name;
+	uint8_t *frames;
+	int nr;
+};
+
+static int cycles_fd = -1;
+
+static void cycles_open(void)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(attr),
+		.config = PERF_COUNT_HW_CPU_CYCLES,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+		.inherit = 1,
+	};
+
+	cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cycles_now(void)
+{
+	uint64_t v;
+
+	if (cycles_fd == -1 || read(cycles_fd, &v, sizeof(v)) != sizeof(v))
+		return 0;
+
+	return v;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t))
+		err(1, "Bad clock_gettime");
+
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+struct sample {
+	uint64_t ns;
+	uint64_t cycles;
+};
+
+static void sample_start(struct sample *s)
+{
+	s->cycles = cycles_now();
+	s->ns = now_ns();
+}
+
+static void sample_end(struct sample *s)
+{
+	s->ns = now_ns() - s->ns;
+	s->cycles = cycles_now() - s->cycles;
+}
+
+/*
+ * The settings are the colormap, gamma, contours, and rotate columns, which
+ * are empty for the kernels they don't apply to.
+ */
+static void report(const char *kernel, const struct input *in,
+		   const char *settings, int frames, const struct sample *s)
+{
+	double ns = (double)s->ns / frames;
+
+	printf("%s,%s,%s,%d,%.0f,", kernel, in->name, settings, frames, ns);
+	if (cycles_fd != -1)
+		printf("%.3f", (double)s->cycles / frames / NR_PIXELS);
+
+	printf(",%.1f\n", ISIZE / ns * 1000.0);
+	fflush(stdout);
+}
+
+/*
+ * A smooth scene around room temperature with a warm blob drifting across it,
+ * plus a little sensor noise, so the codecs see something like real footage.
+ */
+static void make_synthetic(struct input *in)
+{
+	uint32_t lcg = 12345;
+	int f, x, y;
+
+	in->name = "synthetic";
+	in->nr = NR_SYNTH;
+	in->frames = malloc((size_t)NR_SYNTH * ISIZE);
+	if (!in->frames)
+		errx(1, "can't allocate frames");
+
+	for (f = 0; f < NR_SYNTH; f++) {
+		uint8_t *d = in->frames + (size_t)f * ISIZE;
+		int bx = f * WIDTH / NR_SYNTH, by = HEIGHT / 2;
+
+		for (y = 0; y < HEIGHT; y++) {
+			for (x = 0; x < WIDTH; x++) {
+				int dx = x - bx, dy = y - by;
+				int r2 = dx * dx + dy * dy;
+				uint16_t v = 295 * 64 + y * 4;
+
+				if (r2 < 40 * 40)
+					v += (40 * 40 - r2) / 2;
+
+				lcg = lcg * 1103515245 + 12345;
+				v += (lcg >> 16) % 5;
+
+				d[(y * WIDTH + x) * 2] = v;
+				d[(y * WIDTH + x) * 2 + 1] = v >> 8;
+			}
+		}
+	}
+}
+
+static bool load_recording(struct input *in, const char *path)
+{
+	struct lavc_ctx *c;
+	const uint8_t *d;
+	int idx;
+
+	in->name = "recording";
+	in->frames = malloc((size_t)NR_FILE * ISIZE);
+	if (!in->frames)
+		errx(1, "can't allocate frames");
+
+	c = lavc_start_decode(path);
+	for (in->nr = 0; in->nr < NR_FILE; in->nr++) {
+		d = lavc_decode(c, &idx);
+		if (!d)
+			break;
+
+		memcpy(in->frames + (size_t)in->nr * ISIZE, d, ISIZE);
+	}
+
+	lavc_end_decode(c);
+	return in->nr > 0;
+}
+
+static const uint8_t *frame(const struct input *in, int i)
+{
+	return in->frames + (size_t)(i % in->nr) * ISIZE;
+}
+
+static void bench_stats(const struct input *in)
+{
+	struct frame_stats st;
+	struct sample s;
+	int i = 0;
+
+	sample_start(&s);
+	do {
+		frame_stats(&st, frame(in, i++), NR_PIXELS);
+	} while (now_ns() - s.ns < MIN_NS || i < in->nr);
+	sample_end(&s);
+
+	report("stats", in, ",,,", i, &s);
+}
+
+/*
+ * A QA-like layout: a grid of overlapping rectangles over the whole frame,
+ * plus a few spots.
+ */
+static void bench_roi(const struct input *in)
+{
+	struct roi_result res[ROI_MAX];
+	struct roi rois[ROI_MAX];
+	struct sample s;
+	int nr = 0, i;
+
+	for (i = 0; i < 16; i++) {
+		rois[nr] = (struct roi){
+			.x = i % 4 * WIDTH / 5,
+			.y = i / 4 * HEIGHT / 5,
+			.w = WIDTH * 2 / 5,
+			.h = HEIGHT * 2 / 5,
+		};
+		nr++;
+	}
+
+	for (i = 0; i < 4; i++) {
+		rois[nr] = (struct roi){
+			.x = (i + 1) * WIDTH / 5,
+			.y = HEIGHT / 2,
+			.w = 1,
+			.h = 1,
+		};
+		nr++;
+	}
+
+	i = 0;
+	sample_start(&s);
+	do {
+		roi_measure(rois, nr, res, frame(in, i++), WIDTH);
+	} while (now_ns() - s.ns < MIN_NS || i < in->nr);
+	sample_end(&s);
+
+	report("roi", in, ",,,", i, &s);
+}
+
+/*
+ * AUTO mode: the range follows each frame, so every frame changes part of the
+ * palette.
+ */
+static void bench_palette(const struct input *in, struct palette *p)
+{
+	struct palette_cfg cfg = { .contours = 1, .colormap = true };
+	struct frame_stats *st;
+	struct sample s;
+	int i = 0;
+
+	st = calloc(in->nr, sizeof(*st));
+	if (!st)
+		errx(1, "can't allocate stats");
+
+	for (i = 0; i < in->nr; i++)
+		frame_stats(&st[i], frame(in, i), NR_PIXELS);
+
+	p->valid = false;
+	i = 0;
+	sample_start(&s);
+	do {
+		cfg.min = st[i % in->nr].min;
+		cfg.max = st[i % in->nr].max;
+		if (cfg.min >= cfg.max)
+			cfg.max = cfg.min + 1;
+
+		palette_update(p, &cfg);
+		i++;
+	} while (now_ns() - s.ns < MIN_NS || i < in->nr);
+	sample_end(&s);
+
+	report("palette_auto", in, "1,1.00,1,", i, &s);
+	free(st);
+}
+
+static void bench_colorize(const struct input *in, struct palette *p,
+			   uint32_t *dst)
+{
+	struct frame_stats st;
+	int n;
+
+	frame_stats(&st, frame(in, 0), NR_PIXELS);
+
+	/*
+	 * Every combination of the settings which change the work per pixel.
+	 */
+	for (n = 0; n < 16; n++) {
+		const char *gamma = n & 4 ? "0.50" : "1.00";
+		struct palette_cfg cfg = {
+			.min = st.min,
+			.max = st.max > st.min ? st.max : st.min + 1,
+			.gammafactor = palette_parse_gamma(gamma),
+			.contours = n & 2 ? 4 : 1,
+			.colormap = n & 8,
+		};
+		bool rotate = n & 1;
+		char settings[32];
+		struct sample s;
+		int i = 0;
+
+		palette_update(p, &cfg);
+		sample_start(&s);
+		do {
+			palette_colorize(p, dst, frame(in, i++), NR_PIXELS,
+					 rotate);
+		} while (now_ns() - s.ns < MIN_NS || i < in->nr);
+		sample_end(&s);
+
+		snprintf(settings, sizeof(settings), "%d,%s,%d,%d",
+			 cfg.colormap, gamma, cfg.contours, rotate);
+		report("colorize", in, settings, i, &s);
+	}
+}
+
+/*
+ * The colorize pass for hardware encoders (see the "hw" encoder profile).
+ */
+static void bench_colorize_nv12(const struct input *in, struct palette *p,
+				uint32_t *dst)
+{
+	struct frame_stats st;
+	struct palette_cfg cfg;
+	struct sample s;
+	int i = 0;
+
+	frame_stats(&st, frame(in, 0), NR_PIXELS);
+	cfg = (struct palette_cfg){
+		.min = st.min,
+		.max = st.max > st.min ? st.max : st.min + 1,
+		.contours = 1,
+		.colormap = true,
+		.yuv = true,
+	};
+
+	palette_update(p, &cfg);
+	sample_start(&s);
+	do {
+		palette_colorize_nv12(p, (uint8_t *)dst, frame(in, i++), WIDTH,
+				      HEIGHT, false);
+	} while (now_ns() - s.ns < MIN_NS || i < in->nr);
+	sample_end(&s);
+
+	report("colorize_nv12", in, "1,1.00,1,0", i, &s);
+}
+
+/*
+ * The codecs are timed over a fixed number of frames, including flushing the
+ * encoder and opening the decoder, so they see the whole cost of a file.
+ */
+static void bench_codec(const struct input *in, const char *profile)
+{
+	char path[] = "/tmp/ircam-bench-XXXXXX.mkv";
+	char kernel[64], idxpath[sizeof(path) + 4];
+	struct lavc_enc_opts opts;
+	struct lavc_ctx *c;
+	struct sample s;
+	int fd, i, idx;
+
+	fd = mkstemps(path, 4);
+	if (fd == -1)
+		err(1, "can't create temporary file");
+
+	close(fd);
+	lavc_parse_enc_opts(&opts, profile);
+
+	sample_start(&s);
+	c = lavc_start_encode(path, WIDTH, HEIGHT, FPS, AV_PIX_FMT_GRAY16LE,
+			      &opts);
+	for (i = 0; i < NR_CODEC; i++)
+		if (lavc_encode(c, i * (1000 / FPS), frame(in, i), ISIZE))
+			errx(1, "can't encode");
+
+	lavc_end_encode(c);
+	sample_end(&s);
+
+	snprintf(kernel, sizeof(kernel), "encode_%s", profile);
+	report(kernel, in, ",,,", NR_CODEC, &s);
+
+	i = 0;
+	sample_start(&s);
+	c = lavc_start_decode(path);
+	while (lavc_decode(c, &idx))
+		i++;
+
+	lavc_end_decode(c);
+	sample_end(&s);
+
+	snprintf(kernel, sizeof(kernel), "decode_%s", profile);
+	report(kernel, in, ",,,", i, &s);
+
+	snprintf(idxpath, sizeof(idxpath), "%s.idx", path);
+	unlink(idxpath);
+	unlink(path);
+}
+
+static void bench_input(const struct input *in, struct palette *p,
+			uint32_t *dst)
+{
+	bench_stats(in);
+	bench_roi(in);
+	bench_palette(in, p);
+	bench_colorize(in, p, dst);
+	bench_colorize_nv12(in, p, dst);
+	bench_codec(in, "default");
+	bench_codec(in, "fast");
+	bench_codec(in, "small");
+}
+
+int main(int argc, char **argv)
+{
+	struct input synth, rec;
+	struct utsname u;
+	struct palette *p;
+	uint32_t *dst;
+
+	p = calloc(1, sizeof(*p));
+	dst = malloc(VSIZE);
+	if (!p || !dst)
+		errx(1, "can't allocate buffers");
+
+	cycles_open();
+	uname(&u);
+	printf("# machine=%s release=%s stats=%s cpus=%ld cycles=%s\n",
+	       u.machine, u.release, stats_init(),
+	       sysconf(_SC_NPROCESSORS_ONLN),
+	       cycles_fd == -1 ? "unavailable" : "perf");
+	printf("kernel,input,colormap,gamma,contours,rotate,frames,"
+	       "ns_per_frame,cycles_per_pixel,mb_per_s\n");
+
+	make_synthetic(&synth);
+	bench_input(&synth, p, dst);
+
+	if (argc > 1) {
+		if (!load_recording(&rec, argv[1]))
+			errx(1, "no frames in '%s'", argv[1]);
+
+		bench_input(&rec, p, dst);
+		free(rec.frames);
+	}
+
+	free(synth.frames);
+	free(dst);
+	free(p);
+	return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Convert a window of a black box ring file to FFV1
+ * Copyright (C) 2024 Calvin Owens <calvin@wbinvd.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted, provided that the
+ * above copyright notice and this permission notice appear in all
+ * copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Usage: ./util/ring2mkv [-e profile] ring-file out.mkv [from [to]]
+ *
+ * Writes the frames in a ring file recorded with "--ring-file" to a raw
+ * recording which can be played back with "ircam -p". The window is given as
+ * unix times, or as negative numbers of seconds before the newest frame in the
+ * file, and defaults to every frame in it. The profile is the same as the
+ * "--raw-encoder" option of ircam. The ring file may still be being
+ * recorded into: frames which are overwritten before they are read are
+ * skipped.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../dev.h"
+#include "../lavc.h"
+#include "../record.h"
+#include "../ringfile.h"
+
+static uint64_t parse_time(const char *s, uint64_t newest_ns)
+{
+	char *end;
+	double v;
+
+	v = strtod(s, &end);
+	if (*end || end == s)
+		errx(1, "bad time '%s'", s);
+
+	if (v < 0)
+		return newest_ns + v * 1e9;
+
+	return v * 1e9;
+}
+
+static __attribute__((noreturn)) void usage(void)
+{
+	errx(1, "usage: ring2mkv [-e profile[,key=val...]] ring-file out.mkv "
+		"[from [to]]");
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t head, n, from = 0, to = UINT64_MAX;
+	unsigned written = 0, skipped = 0;
+	struct lavc_enc_opts opts;
+	struct ringfile_info info;
+	struct recorder *rec;
+	struct ringfile *ring;
+	int width, height, opt;
+	uint8_t *data;
+
+	lavc_parse_enc_opts(&opts, "default");
+	while ((opt = getopt(argc, argv, "e:")) != -1) {
+		if (opt != 'e')
+			usage();
+
+		lavc_parse_enc_opts(&opts, optarg);
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 2 || argc > 4)
+		usage();
+
+	ring = ringfile_open(argv[0]);
+	if (!ring)
+		errx(1, "'%s' isn't a ring file", argv[0]);
+
+	ringfile_dims(ring, &width, &height);
+	cur_profile = dev_profile_for_size(width, height);
+	data = malloc((size_t)width * height * 2);
+	if (!data)
+		errx(1, "can't allocate frame");
+
+	head = ringfile_head(ring);
+	if (!head || ringfile_read(ring, head - 1, data, &info))
+		errx(1, "no frames in '%s'", argv[0]);
+
+	if (argc > 2)
+		from = parse_time(argv[2], info.wall_ns);
+
+	if (argc > 3)
+		to = parse_time(argv[3], info.wall_ns);
+
+	rec = recorder_start(argv[1], width, height, FPS, AV_PIX_FMT_GRAY16LE,
+			     &opts, false);
+
+	n = head > (uint64_t)ringfile_slots(ring) ?
+		    head - ringfile_slots(ring) :
+		    0;
+	for (; n < head; n++) {
+		if (ringfile_read(ring, n, data, &info)) {
+			skipped++;
+			continue;
+		}
+
+		if (info.wall_ns < from || info.wall_ns > to)
+			continue;
+
+		/*
+		 * The ring file may span restarts of the camera or the whole
+		 * machine, so only the wall clock time is comparable between
+		 * all of its frames.
+		 */
+		recorder_write(rec, info.seq, info.wall_ns, data,
+			       (size_t)width * height * 2);
+		written++;
+	}
+
+	recorder_end(rec);
+	ringfile_close(ring);
+	free(data);
+
+	fprintf(stderr, "wrote %u frames, skipped %u overwritten or torn\n",
+		written, skipped);
+	return written ? 0 : 1;
+}
@@ -27,16 +27,22 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
 
 #define MAXBUFS 64
+#define DMA_HEAP_PATH "/dev/dma_heap/system"
 
 struct v4l2_dev {
 	struct v4l2_capability cap;
 	int v4l2_fd;
+	enum v4l2_memory memory;
+	unsigned sizeimage;
 
 	int nr_buffers;
 	unsigned buffer_lens[MAXBUFS];
 	void *mmaps[MAXBUFS];
+	int dmabufs[MAXBUFS];
 };
 
 static int v4l2_set_format(struct v4l2_dev *dev,
@@ -47,7 +53,11 @@ static int v4l2_set_format(struct v4l2_dev *dev,
 		.fmt.pix = *pix,
 	};
 
-	return ioctl(dev->v4l2_fd, VIDIOC_S_FMT, &fmt);
+	if (ioctl(dev->v4l2_fd, VIDIOC_S_FMT, &fmt))
+		return -1;
+
+	dev->sizeimage = fmt.fmt.pix.sizeimage;
+	return 0;
 }
 
 static int v4l2_set_rate(struct v4l2_dev *dev, const struct v4l2_fract *fp)
@@ -62,13 +72,79 @@ static int v4l2_set_rate(struct v4l2_dev *dev, const struct v4l2_fract *fp)
 	return ioctl(dev->v4l2_fd, VIDIOC_S_PARM, &parm);
 }
 
-static void v4l2_init_stream(struct v4l2_dev *dev)
+/*
+ * For USERPTR and DMABUF streaming we supply the buffers ourselves, rounded up
+ * to a whole number of pages.
+ */
+static unsigned user_buffer_len(const struct v4l2_dev *dev)
+{
+	unsigned page = sysconf(_SC_PAGESIZE);
+
+	return (dev->sizeimage + page - 1) / page * page;
+}
+
+static void map_buffer(struct v4l2_dev *dev, struct v4l2_buffer *buf)
+{
+	struct dma_heap_allocation_data alloc = {
+		.fd_flags = O_RDWR | O_CLOEXEC,
+	};
+	int i = buf->index;
+	int heap;
+
+	switch (dev->memory) {
+	case V4L2_MEMORY_MMAP:
+		if (ioctl(dev->v4l2_fd, VIDIOC_QUERYBUF, buf))
+			err(1, "VIDIOC_QUERYBUF");
+
+		dev->buffer_lens[i] = buf->length;
+		dev->mmaps[i] = mmap(NULL, buf->length, PROT_READ | PROT_WRITE,
+				     MAP_SHARED, dev->v4l2_fd, buf->m.offset);
+		break;
+
+	case V4L2_MEMORY_USERPTR:
+		dev->buffer_lens[i] = user_buffer_len(dev);
+		dev->mmaps[i] = mmap(NULL, dev->buffer_lens[i],
+				     PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		buf->m.userptr = (unsigned long)dev->mmaps[i];
+		buf->length = dev->buffer_lens[i];
+		break;
+
+	case V4L2_MEMORY_DMABUF:
+		heap = open(DMA_HEAP_PATH, O_RDWR | O_CLOEXEC);
+		if (heap == -1)
+			err(1, "can't open %s", DMA_HEAP_PATH);
+
+		alloc.len = user_buffer_len(dev);
+		if (ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc))
+			err(1, "DMA_HEAP_IOCTL_ALLOC");
+
+		close(heap);
+		dev->dmabufs[i] = alloc.fd;
+		dev->buffer_lens[i] = alloc.len;
+		dev->mmaps[i] = mmap(NULL, alloc.len, PROT_READ | PROT_WRITE,
+				     MAP_SHARED, alloc.fd, 0);
+
+		buf->m.fd = alloc.fd;
+		buf->length = alloc.len;
+		break;
+
+	default:
+		errx(1, "bad V4L2 memory type %d", dev->memory);
+	}
+
+	if (dev->mmaps[i] == MAP_FAILED)
+		err(1, "can't mmap buffer %d", i);
+}
+
+static void v4l2_init_stream(struct v4l2_dev *dev, int nr_buffers)
 {
 	struct v4l2_buffer bufs[MAXBUFS];
 	struct v4l2_requestbuffers req = {
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory = V4L2_MEMORY_MMAP,
-		.count = MAXBUFS,
+		.memory = dev->memory,
+		.count = nr_buffers,
 	};
 	int i;
 
@@ -92,20 +168,11 @@ static void v4l2_init_stream(struct v4l2_dev *dev)
 		bufs[i] = (struct v4l2_buffer){
 			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 			.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC,
-			.memory = V4L2_MEMORY_MMAP,
+			.memory = dev->memory,
 			.index = i,
 		};
 
-		if (ioctl(dev->v4l2_fd, VIDIOC_QUERYBUF, &bufs[i]))
-			err(1, "VIDIOC_QUERYBUF");
-
-		dev->buffer_lens[i] = bufs[i].length;
-		dev->mmaps[i] = mmap(NULL, bufs[i].length,
-				     PROT_READ | PROT_WRITE, MAP_SHARED,
-				     dev->v4l2_fd, bufs[i].m.offset);
-
-		if (dev->mmaps[i] == MAP_FAILED)
-			err(1, "can't mmap buffer %d", i);
+		map_buffer(dev, &bufs[i]);
 	}
 
 	for (i = 0; i < dev->nr_buffers; i++)
@@ -117,6 +184,45 @@ static void v4l2_init_stream(struct v4l2_dev *dev)
 		err(1, "VIDIOC_STREAMON");
 }
 
+/**
+ * v4l2_frame_sizes() - List the frame sizes a device supports.
+ * @param path Path of device to query (ex. "/dev/video0").
+ * @param fmt The V4L2 pixel format to query (ex. V4L2_PIX_FMT_YUYV).
+ * @param sizes Output array of frame sizes.
+ * @param max Length of the sizes array.
+ *
+ * Devices with stepwise or continuous sizes report their largest size.
+ *
+ * Return: Number of sizes written to the array.
+ */
+int v4l2_frame_sizes(const char *path, uint32_t fmt,
+		     struct v4l2_frmsize_discrete *sizes, int max)
+{
+	struct v4l2_frmsizeenum fs = {
+		.pixel_format = fmt,
+	};
+	int fd, nr = 0;
+
+	fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd == -1)
+		err(1, "can't open V4L2 dev %s", path);
+
+	while (nr < max && !ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fs)) {
+		if (fs.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			sizes[nr++] = fs.discrete;
+		} else {
+			sizes[nr].width = fs.stepwise.max_width;
+			sizes[nr++].height = fs.stepwise.max_height;
+			break;
+		}
+
+		fs.index++;
+	}
+
+	close(fd);
+	return nr;
+}
+
 /**
  * v4l2_open() - Open a video device and begin streaming.
  * @param path Path of device to open (ex. "/dev/video0").
@@ -124,6 +230,11 @@ static void v4l2_init_stream(struct v4l2_dev *dev)
  * @param width Frame width in pixels.
  * @param height Frame height in pixels.
  * @param fps Framerate, hz.
+ * @param nr_buffers Number of buffers to ask the driver for, or 0 for as many
+ *		     as possible. The driver may adjust this.
+ * @param memory How buffers are allocated: V4L2_MEMORY_MMAP for the driver's
+ *		 own buffers, V4L2_MEMORY_USERPTR for anonymous memory, or
+ *		 V4L2_MEMORY_DMABUF for buffers from the system DMA heap.
  *
  * See /usr/include/linux/videodev2.h for a list of V4L2 pixel format
  * codes.
@@ -131,7 +242,8 @@ static void v4l2_init_stream(struct v4l2_dev *dev)
  * Return: Running device handle if successful, NULL on failure.
  */
 struct v4l2_dev *v4l2_open(const char *path, uint32_t fmt, int width,
-			   int height, int fps)
+			   int height, int fps, int nr_buffers,
+			   enum v4l2_memory memory)
 {
 	struct v4l2_dev *dev;
 	struct v4l2_pix_format pix = {
@@ -144,10 +256,15 @@ struct v4l2_dev *v4l2_open(const char *path, uint32_t fmt, int width,
 		.denominator = fps,
 	};
 
+	if (nr_buffers <= 0 || nr_buffers > MAXBUFS)
+		nr_buffers = MAXBUFS;
+
 	dev = calloc(1, sizeof(*dev));
 	if (!dev)
 		errx(1, "no memory for v4l2_dev");
 
+	dev->memory = memory;
+
 	dev->v4l2_fd = open(path, O_RDWR | O_NONBLOCK);
 	if (dev->v4l2_fd == -1)
 		err(1, "can't open V4L2 dev %s", path);
@@ -158,10 +275,28 @@ struct v4l2_dev *v4l2_open(const char *path, uint32_t fmt, int width,
 	if (v4l2_set_rate(dev, &fp))
 		err(1, "VIDIOC_S_PARM");
 
-	v4l2_init_stream(dev);
+	v4l2_init_stream(dev, nr_buffers);
 	return dev;
 }
 
+/*
+ * The CPU must bracket its accesses to a DMABUF buffer, so any caches can be
+ * maintained around the device's writes.
+ */
+static void dmabuf_sync(const struct v4l2_dev *dev,
+			const struct v4l2_buffer *buf, uint64_t flags)
+{
+	struct dma_buf_sync sync = {
+		.flags = flags | DMA_BUF_SYNC_READ,
+	};
+
+	if (dev->memory != V4L2_MEMORY_DMABUF)
+		return;
+
+	if (ioctl(dev->dmabufs[buf->index], DMA_BUF_IOCTL_SYNC, &sync))
+		err(1, "DMA_BUF_IOCTL_SYNC");
+}
+
 /**
  * v4l2_get_buffer() - Get a framebuffer from a running V4L2 device.
  * @param dev Running V4L2 device handle.
@@ -180,11 +315,13 @@ int v4l2_get_buffer(struct v4l2_dev *dev, struct v4l2_buffer *buf)
 	do {
 		*buf = (struct v4l2_buffer){
 			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			.memory = V4L2_MEMORY_MMAP,
+			.memory = dev->memory,
 		};
 
-		if (ioctl(dev->v4l2_fd, VIDIOC_DQBUF, buf) == 0)
+		if (ioctl(dev->v4l2_fd, VIDIOC_DQBUF, buf) == 0) {
+			dmabuf_sync(dev, buf, DMA_BUF_SYNC_START);
 			return 0;
+		}
 
 		if (errno != EAGAIN)
 			break;
@@ -202,7 +339,7 @@ int v4l2_get_buffer(struct v4l2_dev *dev, struct v4l2_buffer *buf)
  * @param dev Running V4L2 device handle.
  * @param buf V4L2 buffer with desired frame.
  *
- * Return: Pointer to the backing V4L2_MEMORY_MMAP framebuffer.
+ * Return: Pointer to the backing framebuffer.
  *
  * The address returned by this function is only valid until
  * v4l2_put_buffer() is called on the buffer handle.
@@ -213,19 +350,61 @@ const uint8_t *v4l2_buf_mmap(const struct v4l2_dev *dev,
 	return dev->mmaps[buf->index];
 }
 
+/**
+ * v4l2_nr_buffers() - Get the number of buffers the kernel allocated.
+ * @param dev Running V4L2 device handle.
+ *
+ * Return: Number of buffers, which is also one more than the highest index a
+ *	   buffer returned by v4l2_get_buffer() can have.
+ */
+int v4l2_nr_buffers(const struct v4l2_dev *dev)
+{
+	return dev->nr_buffers;
+}
+
+/**
+ * v4l2_fd() - Get the file descriptor of a V4L2 device.
+ * @param dev Running V4L2 device handle.
+ *
+ * The descriptor is non-blocking, and is readable when v4l2_get_buffer() has
+ * a buffer to return without waiting.
+ *
+ * Return: File descriptor, owned by the device handle.
+ */
+int v4l2_fd(const struct v4l2_dev *dev)
+{
+	return dev->v4l2_fd;
+}
+
 /**
  * v4l2_put_buffer() - Free a V4L2 framebuffer.
  * @param dev Running V4L2 device handle.
  * @param buf Buffer handle to free.
  *
  * Return the buffer's resources to the kernel, so they can be used to
- * return a future frame.
+ * return a future frame. This may be called from any thread.
  *
  * Return: Nothing.
  */
 void v4l2_put_buffer(struct v4l2_dev *dev, const struct v4l2_buffer *buf)
 {
-	if (ioctl(dev->v4l2_fd, VIDIOC_QBUF, buf))
+	struct v4l2_buffer qbuf = *buf;
+
+	dmabuf_sync(dev, buf, DMA_BUF_SYNC_END);
+
+	switch (dev->memory) {
+	case V4L2_MEMORY_USERPTR:
+		qbuf.m.userptr = (unsigned long)dev->mmaps[buf->index];
+		qbuf.length = dev->buffer_lens[buf->index];
+		break;
+
+	case V4L2_MEMORY_DMABUF:
+		qbuf.m.fd = dev->dmabufs[buf->index];
+		qbuf.length = dev->buffer_lens[buf->index];
+		break;
+	}
+
+	if (ioctl(dev->v4l2_fd, VIDIOC_QBUF, &qbuf))
 		err(1, "VIDIOC_QBUF");
 }
 
@@ -243,8 +422,11 @@ void v4l2_close(struct v4l2_dev *dev)
 	if (ioctl(dev->v4l2_fd, VIDIOC_STREAMOFF, &i))
 		err(1, "VIDIOC_STREAMOFF");
 
-	for (i = 0; i < dev->nr_buffers; i++)
+	for (i = 0; i < dev->nr_buffers; i++) {
 		munmap(dev->mmaps[i], dev->buffer_lens[i]);
+		if (dev->memory == V4L2_MEMORY_DMABUF)
+			close(dev->dmabufs[i]);
+	}
 
 	close(dev->v4l2_fd);
 	free(dev);
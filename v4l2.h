@@ -22,13 +22,21 @@
 
 struct v4l2_dev;
 
-struct v4l2_dev *v4l2_open(const char *path, uint32_t fmt, int w, int h, int f);
+int v4l2_frame_sizes(const char *path, uint32_t fmt,
+		     struct v4l2_frmsize_discrete *sizes, int max);
+
+struct v4l2_dev *v4l2_open(const char *path, uint32_t fmt, int w, int h, int f,
+			   int nr_buffers, enum v4l2_memory memory);
 
 int v4l2_get_buffer(struct v4l2_dev *dev, struct v4l2_buffer *buf);
 
 const uint8_t *v4l2_buf_mmap(const struct v4l2_dev *dev,
 			     const struct v4l2_buffer *buf);
 
+int v4l2_nr_buffers(const struct v4l2_dev *dev);
+
+int v4l2_fd(const struct v4l2_dev *dev);
+
 void v4l2_put_buffer(struct v4l2_dev *dev, const struct v4l2_buffer *buf);
 
 void v4l2_close(struct v4l2_dev *dev);
@@ -0,0 +1,1166 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "wire.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * Header layout on the wire, all fields little-endian:
+ *
+ *	 0	magic "IRCW"
+ *	 4	u8 version
+ *	 5	u8 payload type
+ *	 6	u16 width
+ *	 8	u16 height
+ *	10	u16 number of region records
+ *	12	u32 sequence number
+ *	16	u64 capture timestamp, CLOCK_MONOTONIC nanoseconds on the sender
+ *	24	u32 payload length in bytes
+ *	28	u16 x of the image's top left corner on the sensor
+ *	30	u16 y of the image's top left corner on the sensor
+ *	32	u8 decimation factor
+ *	33	u8 reserved, zero
+ *	34	u16 quantization minimum (WIRE_Q8 only)
+ *	36	u16 quantization maximum (WIRE_Q8 only)
+ *
+ * The width and height are those of the image in the payload, which is only
+ * smaller than the sensor for clients which asked for a cheaper view of it
+ * (see struct wire_view): each of its pixels covers decimation squared sensor
+ * pixels, starting at x, y. A WIRE_Q8 payload is one byte per pixel, scaled
+ * linearly so 0 is the minimum and 255 the maximum.
+ *
+ * The magic lets a receiver which somehow lost its place find the start of
+ * the next frame, rather than staying out of sync forever.
+ *
+ * The region records come between the header and the payload, so receivers
+ * get the sender's measurements (see roi.c) without redoing them. Each is nine
+ * u16 fields, in the order of struct roi_result: x, y, w, h, min, max, mean,
+ * max_x, max_y.
+ */
+#define HDR_LEN 38
+#define ROI_REC_LEN 18
+#define ROI_BLOCK_MAX (ROI_MAX * ROI_REC_LEN)
+static const uint8_t wire_magic[4] = { 'I', 'R', 'C', 'W' };
+
+/*
+ * WIRE_RICE payloads: each pixel is predicted by its left neighbour, or by the
+ * pixel above it at the start of a row. The residual is zigzag mapped to an
+ * unsigned value and Golomb-Rice coded, with the parameter adapted to the
+ * running mean as in LOCO-I. Quotients of RICE_LIMIT or more are escaped, and
+ * the value follows verbatim in ESC_BITS bits. Bits are packed MSB first.
+ */
+#define RICE_LIMIT	24
+#define ESC_BITS	17
+#define RICE_MAX_BITS	(RICE_LIMIT + 1 + ESC_BITS)
+#define RICE_RESET	64
+
+#define DECIMATE_MAX	8
+
+struct wire {
+	enum wire_payload payload;
+	int width;
+	int height;
+	size_t max_len;
+	uint8_t *buf;
+	uint8_t *img;
+	bool warned;
+	bool synced;
+	int mismatches;
+
+	unsigned max_frags;
+	bool *frags;
+	uint32_t frag_id;
+	unsigned frag_nr;
+	uint32_t frag_len;
+	unsigned frag_have;
+	uint32_t last_id;
+	bool have_last;
+};
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return get_le16(p) | (uint32_t)get_le16(p + 2) << 16;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+struct rice_state {
+	unsigned a;
+	unsigned n;
+};
+
+static int rice_k(const struct rice_state *s)
+{
+	int k = 0;
+
+	while ((s->n << k) < s->a && k < 16)
+		k++;
+
+	return k;
+}
+
+static void rice_update(struct rice_state *s, unsigned u)
+{
+	s->a += u;
+	if (++s->n == RICE_RESET) {
+		s->a >>= 1;
+		s->n >>= 1;
+	}
+}
+
+static unsigned zigzag(int v)
+{
+	return v < 0 ? -2U * v - 1 : 2U * v;
+}
+
+static int unzigzag(unsigned u)
+{
+	return u & 1 ? -(int)(u >> 1) - 1 : (int)(u >> 1);
+}
+
+static int predict(const uint8_t *px, int i, int width)
+{
+	if (i % width)
+		return get_le16(px + (i - 1) * 2);
+
+	if (i)
+		return get_le16(px + (i - width) * 2);
+
+	return 0;
+}
+
+struct bitw {
+	uint8_t *p;
+	uint64_t acc;
+	int n;
+};
+
+static void bitw_put(struct bitw *b, uint32_t v, int bits)
+{
+	b->acc = b->acc << bits | v;
+	b->n += bits;
+	while (b->n >= 8) {
+		b->n -= 8;
+		*b->p++ = b->acc >> b->n;
+	}
+}
+
+static size_t rice_encode(uint8_t *dst, const uint8_t *y16, int width,
+			  int height)
+{
+	struct rice_state s = { .a = 16, .n = 1 };
+	struct bitw b = { .p = dst };
+	int i, nr = width * height;
+
+	for (i = 0; i < nr; i++) {
+		int v = get_le16(y16 + i * 2);
+		unsigned u = zigzag(v - predict(y16, i, width));
+		int k = rice_k(&s);
+		unsigned q = u >> k;
+
+		if (q < RICE_LIMIT) {
+			bitw_put(&b, (1U << (q + 1)) - 2, q + 1);
+			bitw_put(&b, u & ((1U << k) - 1), k);
+		} else {
+			bitw_put(&b, (1U << (RICE_LIMIT + 1)) - 2,
+				 RICE_LIMIT + 1);
+			bitw_put(&b, u, ESC_BITS);
+		}
+
+		rice_update(&s, u);
+	}
+
+	if (b.n)
+		bitw_put(&b, 0, 8 - b.n);
+
+	return b.p - dst;
+}
+
+struct bitr {
+	const uint8_t *p;
+	const uint8_t *end;
+	uint64_t acc;
+	int n;
+};
+
+static void bitr_refill(struct bitr *b)
+{
+	while (b->n <= 56 && b->p < b->end) {
+		b->acc |= (uint64_t)*b->p++ << (56 - b->n);
+		b->n += 8;
+	}
+}
+
+static uint32_t bitr_get(struct bitr *b, int bits)
+{
+	uint32_t v;
+
+	if (!bits)
+		return 0;
+
+	v = b->acc >> (64 - bits);
+	b->acc <<= bits;
+	b->n -= bits;
+	return v;
+}
+
+static int rice_decode(uint8_t *y16, int width, int height,
+		       const uint8_t *src, size_t len)
+{
+	struct rice_state s = { .a = 16, .n = 1 };
+	struct bitr b = { .p = src, .end = src + len };
+	int i, nr = width * height;
+
+	for (i = 0; i < nr; i++) {
+		int k = rice_k(&s);
+		unsigned q, u;
+		int v;
+
+		bitr_refill(&b);
+
+		/*
+		 * The zero terminating the unary quotient must be within the
+		 * bits we have, and so must whatever follows it.
+		 */
+		q = b.acc == ~0ULL ? 64 : __builtin_clzll(~b.acc);
+		if (q > RICE_LIMIT || (int)q + 1 > b.n)
+			return -1;
+
+		bitr_get(&b, q + 1);
+		if (q < RICE_LIMIT) {
+			if (k > b.n)
+				return -1;
+
+			u = q << k | bitr_get(&b, k);
+		} else {
+			if (ESC_BITS > b.n)
+				return -1;
+
+			u = bitr_get(&b, ESC_BITS);
+		}
+
+		v = predict(y16, i, width) + unzigzag(u);
+		if (v < 0 || v > UINT16_MAX)
+			return -1;
+
+		put_le16(y16 + i * 2, v);
+		rice_update(&s, u);
+	}
+
+	return 0;
+}
+
+/**
+ * wire_new() - Create a wire protocol handle.
+ * @param payload How frames sent with this handle are encoded.
+ * @param width Width of frames.
+ * @param height Height of frames.
+ *
+ * The payload type only matters for sending: the receiver is told how each
+ * frame was encoded by its header.
+ *
+ * Return: Wire handle.
+ */
+struct wire *wire_new(enum wire_payload payload, int width, int height)
+{
+	struct wire *w;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		errx(1, "can't allocate wire");
+
+	w->payload = payload;
+	w->width = width;
+	w->height = height;
+	w->max_len = ((size_t)width * height * RICE_MAX_BITS + 7) / 8;
+
+	w->buf = malloc(HDR_LEN + ROI_BLOCK_MAX + w->max_len);
+	w->img = malloc((size_t)width * height * 2);
+	if (!w->buf || !w->img)
+		errx(1, "can't allocate wire buffer");
+
+	return w;
+}
+
+/**
+ * wire_parse_payload() - Parse the name of a payload type.
+ * @param name Either "raw" or "rice".
+ *
+ * Exits on error.
+ *
+ * Return: The matching enum wire_payload.
+ */
+int wire_parse_payload(const char *name)
+{
+	if (!strcmp(name, "raw"))
+		return WIRE_RAW;
+
+	if (!strcmp(name, "rice"))
+		return WIRE_RICE;
+
+	errx(1, "bad wire payload '%s' (raw, rice)", name);
+}
+
+/**
+ * wire_max_len() - Get the largest possible encoded frame size.
+ * @param w Wire handle.
+ *
+ * Return: Size in bytes, including the header and region records.
+ */
+size_t wire_max_len(const struct wire *w)
+{
+	return HDR_LEN + ROI_BLOCK_MAX + w->max_len;
+}
+
+/**
+ * wire_parse_view() - Parse a view specification.
+ * @param v View to update.
+ * @param spec Comma separated list of key=value pairs: "crop" (x:y:w:h in
+ *	       sensor pixels), "decimate" (1 to 8), "rate" (send every Nth
+ *	       frame), and "q8" (0 or 1).
+ *
+ * Exits on error.
+ *
+ * Return: Nothing.
+ */
+void wire_parse_view(struct wire_view *v, const char *spec)
+{
+	char *tmp, *tok, *save;
+
+	tmp = strdup(spec);
+	if (!tmp)
+		errx(1, "no memory for view");
+
+	for (tok = strtok_r(tmp, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+		unsigned x, y, w, h;
+		char *end, junk;
+		long n;
+
+		if (!val)
+			errx(1, "view option '%s' needs a value", tok);
+
+		*val++ = '\0';
+		if (!strcmp(tok, "crop")) {
+			if (sscanf(val, "%u:%u:%u:%u%c", &x, &y, &w, &h,
+				   &junk) != 4 || !w || !h ||
+			    x > UINT16_MAX || y > UINT16_MAX ||
+			    w > UINT16_MAX || h > UINT16_MAX)
+				errx(1, "bad crop '%s' (x:y:w:h)", val);
+
+			v->x = x;
+			v->y = y;
+			v->w = w;
+			v->h = h;
+			continue;
+		}
+
+		n = strtol(val, &end, 0);
+		if (*end || end == val || n < 0)
+			errx(1, "bad value '%s' for view option '%s'", val,
+			     tok);
+
+		if (!strcmp(tok, "decimate") && n >= 1 && n <= DECIMATE_MAX)
+			v->decimate = n;
+		else if (!strcmp(tok, "rate") && n >= 1 && n <= UINT16_MAX)
+			v->rate = n;
+		else if (!strcmp(tok, "q8") && n <= 1)
+			v->q8 = n;
+		else
+			errx(1, "bad view option '%s=%s'", tok, val);
+	}
+
+	free(tmp);
+}
+
+static uint8_t *put_ctl(uint8_t *p, int type, int code, int32_t value)
+{
+	const struct wire_ctl ctl = {
+		.type = htole16(type),
+		.code = htole16(code),
+		.value = htole32(value),
+	};
+
+	memcpy(p, &ctl, sizeof(ctl));
+	return p + sizeof(ctl);
+}
+
+/**
+ * wire_view_msg() - Encode a request for a view of the stream.
+ * @param dst Output buffer of at least WIRE_VIEW_MSG_LEN bytes.
+ * @param v View to ask for.
+ *
+ * The whole view is sent every time, so the server never has to remember
+ * where an earlier request left off.
+ *
+ * Return: Number of bytes written to dst.
+ */
+size_t wire_view_msg(uint8_t *dst, const struct wire_view *v)
+{
+	uint8_t *p = dst;
+
+	p = put_ctl(p, WIRE_CTL_CROP, 0, v->x);
+	p = put_ctl(p, WIRE_CTL_CROP, 1, v->y);
+	p = put_ctl(p, WIRE_CTL_CROP, 2, v->w);
+	p = put_ctl(p, WIRE_CTL_CROP, 3, v->h);
+	p = put_ctl(p, WIRE_CTL_DECIMATE, 0, v->decimate);
+	p = put_ctl(p, WIRE_CTL_RATE, 0, v->rate);
+	p = put_ctl(p, WIRE_CTL_QUANT, 0, v->q8);
+	p = put_ctl(p, WIRE_CTL_QUANT, 1, v->qmin);
+	p = put_ctl(p, WIRE_CTL_QUANT, 2, v->qmax);
+	p = put_ctl(p, WIRE_CTL_COMMIT, 0, 0);
+
+	return p - dst;
+}
+
+/**
+ * wire_ctl_apply() - Apply a control event from a client to its view.
+ * @param v View being built, which starts out as the client's current one.
+ * @param ctl Control event as received.
+ *
+ * Return: 1 if the view is complete and should take effect, 0 if more events
+ * are to come, or -1 if the event is invalid.
+ */
+int wire_ctl_apply(struct wire_view *v, const struct wire_ctl *ctl)
+{
+	unsigned code = le16toh(ctl->code);
+	int32_t value = le32toh(ctl->value);
+
+	if (value < 0 || value > UINT16_MAX)
+		return -1;
+
+	switch (le16toh(ctl->type)) {
+	case WIRE_CTL_COMMIT:
+		if (v->q8 && v->qmax < v->qmin)
+			return -1;
+
+		return 1;
+	case WIRE_CTL_CROP:
+		if (code == 0)
+			v->x = value;
+		else if (code == 1)
+			v->y = value;
+		else if (code == 2)
+			v->w = value;
+		else if (code == 3)
+			v->h = value;
+		else
+			return -1;
+
+		return 0;
+	case WIRE_CTL_DECIMATE:
+		if (code || value > DECIMATE_MAX)
+			return -1;
+
+		v->decimate = value;
+		return 0;
+	case WIRE_CTL_RATE:
+		if (code)
+			return -1;
+
+		v->rate = value;
+		return 0;
+	case WIRE_CTL_QUANT:
+		if (code == 0 && value <= 1)
+			v->q8 = value;
+		else if (code == 1)
+			v->qmin = value;
+		else if (code == 2)
+			v->qmax = value;
+		else
+			return -1;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static void put_roi(uint8_t *p, const struct roi_result *r)
+{
+	const uint16_t v[9] = { r->x, r->y, r->w, r->h, r->min, r->max,
+				r->mean, r->max_x, r->max_y };
+	int i;
+
+	for (i = 0; i < 9; i++)
+		put_le16(p + i * 2, v[i]);
+}
+
+static void get_roi(const uint8_t *p, struct roi_result *r)
+{
+	*r = (struct roi_result){
+		.x = get_le16(p),
+		.y = get_le16(p + 2),
+		.w = get_le16(p + 4),
+		.h = get_le16(p + 6),
+		.min = get_le16(p + 8),
+		.max = get_le16(p + 10),
+		.mean = get_le16(p + 12),
+		.max_x = get_le16(p + 14),
+		.max_y = get_le16(p + 16),
+	};
+}
+
+/*
+ * Where a view falls on the sensor. Crops are clipped to the sensor, and the
+ * decimation factor is reduced if the crop is too small for it.
+ */
+struct view_rect {
+	int x;
+	int y;
+	int w;
+	int h;
+	int dec;
+};
+
+static void view_rect(const struct wire *w, const struct wire_view *v,
+		      struct view_rect *r)
+{
+	r->x = v->x < w->width ? v->x : 0;
+	r->y = v->y < w->height ? v->y : 0;
+	r->w = v->w && v->w <= w->width - r->x ? v->w : w->width - r->x;
+	r->h = v->h && v->h <= w->height - r->y ? v->h : w->height - r->y;
+	r->dec = v->decimate ? v->decimate : 1;
+	if (r->dec > r->w || r->dec > r->h)
+		r->dec = 1;
+}
+
+/*
+ * Produce the view's image in w->img: each pixel is the mean of a square of
+ * sensor pixels, so noise goes down along with the resolution.
+ */
+static void decimate(struct wire *w, const uint8_t *y16,
+		     const struct view_rect *r, int ow, int oh)
+{
+	size_t stride = (size_t)w->width * 2;
+	unsigned n = r->dec * r->dec;
+	int ox, oy, dx, dy;
+
+	for (oy = 0; oy < oh; oy++) {
+		const uint8_t *row = y16 + (r->y + oy * r->dec) * stride +
+				     r->x * 2;
+
+		for (ox = 0; ox < ow; ox++) {
+			const uint8_t *p = row + ox * r->dec * 2;
+			unsigned sum = 0;
+
+			for (dy = 0; dy < r->dec; dy++)
+				for (dx = 0; dx < r->dec; dx++)
+					sum += get_le16(p + dy * stride +
+							dx * 2);
+
+			put_le16(w->img + ((size_t)oy * ow + ox) * 2,
+				 (sum + n / 2) / n);
+		}
+	}
+}
+
+static void quantize(uint8_t *dst, const uint8_t *y16, int nr, uint16_t *qmin,
+		     uint16_t *qmax)
+{
+	unsigned range;
+	int i;
+
+	if (!*qmin && !*qmax) {
+		*qmin = UINT16_MAX;
+		for (i = 0; i < nr; i++) {
+			uint16_t v = get_le16(y16 + i * 2);
+
+			*qmin = v < *qmin ? v : *qmin;
+			*qmax = v > *qmax ? v : *qmax;
+		}
+	}
+
+	range = *qmax > *qmin ? *qmax - *qmin : 1;
+	for (i = 0; i < nr; i++) {
+		int v = get_le16(y16 + i * 2) - *qmin;
+
+		if (v <= 0)
+			dst[i] = 0;
+		else if ((unsigned)v >= range)
+			dst[i] = 255;
+		else
+			dst[i] = (v * 255 + range / 2) / range;
+	}
+}
+
+/**
+ * wire_encode() - Encode a frame for the wire.
+ * @param w Wire handle.
+ * @param dst Output buffer of at least wire_max_len() bytes.
+ * @param seq Sequence number of frame.
+ * @param ts_ns Capture time of frame.
+ * @param y16 Y16LE framebuffer.
+ * @param roi Region measurements for the frame, see roi_measure().
+ * @param nr_roi Number of region measurements, at most ROI_MAX.
+ * @param v View of the frame to send, or NULL for all of it.
+ *
+ * The region measurements are always of the full resolution frame, whatever
+ * the view.
+ *
+ * Return: Number of bytes written to dst.
+ */
+size_t wire_encode(struct wire *w, uint8_t *dst, uint32_t seq, uint64_t ts_ns,
+		   const uint8_t *y16, const struct roi_result *roi,
+		   int nr_roi, const struct wire_view *v)
+{
+	static const struct wire_view full;
+	size_t off = HDR_LEN + (size_t)nr_roi * ROI_REC_LEN;
+	enum wire_payload payload = w->payload;
+	const uint8_t *img = y16;
+	uint16_t qmin = 0, qmax = 0;
+	struct view_rect r;
+	size_t raw_len, len = 0;
+	int i, ow, oh;
+
+	view_rect(w, v ? v : &full, &r);
+	ow = r.w / r.dec;
+	oh = r.h / r.dec;
+	raw_len = (size_t)ow * oh * 2;
+
+	if (ow != w->width || oh != w->height) {
+		decimate(w, y16, &r, ow, oh);
+		img = w->img;
+	}
+
+	for (i = 0; i < nr_roi; i++)
+		put_roi(dst + HDR_LEN + i * ROI_REC_LEN, &roi[i]);
+
+	if (v && v->q8) {
+		payload = WIRE_Q8;
+		qmin = v->qmin;
+		qmax = v->qmax;
+		len = (size_t)ow * oh;
+		quantize(dst + off, img, len, &qmin, &qmax);
+	} else if (payload == WIRE_RICE) {
+		len = rice_encode(dst + off, img, ow, oh);
+	}
+
+	/*
+	 * Noise doesn't compress: never send more than the raw frame.
+	 */
+	if (payload == WIRE_RAW || (payload == WIRE_RICE && len >= raw_len)) {
+		payload = WIRE_RAW;
+		len = raw_len;
+		memcpy(dst + off, img, len);
+	}
+
+	memcpy(dst, wire_magic, sizeof(wire_magic));
+	dst[4] = WIRE_VERSION;
+	dst[5] = payload;
+	put_le16(dst + 6, ow);
+	put_le16(dst + 8, oh);
+	put_le16(dst + 10, nr_roi);
+	put_le32(dst + 12, seq);
+	put_le64(dst + 16, ts_ns);
+	put_le32(dst + 24, len);
+	put_le16(dst + 28, r.x);
+	put_le16(dst + 30, r.y);
+	dst[32] = r.dec;
+	dst[33] = 0;
+	put_le16(dst + 34, qmin);
+	put_le16(dst + 36, qmax);
+
+	return off + len;
+}
+
+static int read_full(int fd, uint8_t *dst, size_t len)
+{
+	size_t off = 0;
+
+	while (off < len) {
+		ssize_t ret = read(fd, dst + off, len - off);
+
+		if (ret <= 0)
+			return -1;
+
+		off += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * A header with the right magic, but which we can't accept. While resyncing,
+ * that is most likely the magic turning up by chance inside a payload, so it
+ * is only fatal for the first header in a stream, or several in a row.
+ */
+#define HDR_MISMATCH	-2
+#define MISMATCH_MAX	4
+
+static bool hdr_fits(const struct wire *w, const uint8_t *h)
+{
+	int dec = h[32];
+
+	return get_le16(h + 28) + get_le16(h + 6) * dec <= w->width &&
+	       get_le16(h + 30) + get_le16(h + 8) * dec <= w->height;
+}
+
+static int check_hdr(const struct wire *w, const uint8_t *h)
+{
+	int dec = h[32];
+
+	if (memcmp(h, wire_magic, sizeof(wire_magic)))
+		return -1;
+
+	if (h[4] != WIRE_VERSION)
+		return HDR_MISMATCH;
+
+	if (!dec || dec > DECIMATE_MAX || !get_le16(h + 6) ||
+	    !get_le16(h + 8))
+		return -1;
+
+	if (!hdr_fits(w, h))
+		return HDR_MISMATCH;
+
+	if (h[5] != WIRE_RAW && h[5] != WIRE_RICE && h[5] != WIRE_Q8)
+		return -1;
+
+	if (get_le32(h + 24) > w->max_len || get_le16(h + 10) > ROI_MAX)
+		return -1;
+
+	return 0;
+}
+
+static void hdr_mismatch(struct wire *w, const uint8_t *h)
+{
+	if (w->synced && ++w->mismatches < MISMATCH_MAX)
+		return;
+
+	if (h[4] != WIRE_VERSION)
+		errx(1, "remote speaks wire protocol v%d, we speak v%d", h[4],
+		     WIRE_VERSION);
+
+	errx(1, "remote sends %dx%d frames, expected at most %dx%d",
+	     get_le16(h + 6) * h[32], get_le16(h + 8) * h[32], w->width,
+	     w->height);
+}
+
+static void hdr_ok(struct wire *w)
+{
+	w->synced = true;
+	w->mismatches = 0;
+}
+
+static void parse_hdr(const uint8_t *h, struct wire_hdr *hdr)
+{
+	*hdr = (struct wire_hdr){
+		.version = h[4],
+		.payload = h[5],
+		.width = get_le16(h + 6),
+		.height = get_le16(h + 8),
+		.nr_roi = get_le16(h + 10),
+		.seq = get_le32(h + 12),
+		.ts_ns = get_le64(h + 16),
+		.len = get_le32(h + 24),
+		.x = get_le16(h + 28),
+		.y = get_le16(h + 30),
+		.decimate = h[32],
+		.qmin = get_le16(h + 34),
+		.qmax = get_le16(h + 36),
+	};
+}
+
+static void dequantize(uint8_t *y16, const uint8_t *src, int nr,
+		       const struct wire_hdr *hdr)
+{
+	unsigned range = hdr->qmax > hdr->qmin ? hdr->qmax - hdr->qmin : 0;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		put_le16(y16 + i * 2,
+			 hdr->qmin + (src[i] * range + 127) / 255);
+}
+
+/*
+ * Scale a view back up to the size of the sensor, so the viewer never needs
+ * to know the difference. The area outside a crop is filled with the coldest
+ * pixel inside it, so it doesn't affect the colour scale.
+ */
+static void expand(const struct wire *w, const struct wire_hdr *hdr,
+		   const uint8_t *img, uint8_t *y16)
+{
+	int nr = hdr->width * hdr->height;
+	uint16_t fill = UINT16_MAX;
+	int i, x, y;
+
+	for (i = 0; i < nr; i++) {
+		uint16_t v = get_le16(img + i * 2);
+
+		fill = v < fill ? v : fill;
+	}
+
+	for (y = 0; y < w->height; y++) {
+		int sy = (y - hdr->y) / hdr->decimate;
+		bool row = y >= hdr->y && sy < hdr->height;
+
+		for (x = 0; x < w->width; x++) {
+			int sx = (x - hdr->x) / hdr->decimate;
+			uint16_t v = fill;
+
+			if (row && x >= hdr->x && sx < hdr->width)
+				v = get_le16(img + (sy * hdr->width + sx) * 2);
+
+			put_le16(y16 + ((size_t)y * w->width + x) * 2, v);
+		}
+	}
+}
+
+/*
+ * The source is everything after the header: the region records, then the
+ * payload. Views smaller than the sensor are decoded into w->img first.
+ */
+static int decode_payload(const struct wire *w, const struct wire_hdr *hdr,
+			  const uint8_t *src, uint8_t *y16,
+			  struct roi_result *roi)
+{
+	uint32_t nr = (uint32_t)hdr->width * hdr->height;
+	uint8_t *img = y16;
+	int i;
+
+	for (i = 0; roi && i < hdr->nr_roi; i++)
+		get_roi(src + i * ROI_REC_LEN, &roi[i]);
+
+	src += hdr->nr_roi * ROI_REC_LEN;
+	if (hdr->width != w->width || hdr->height != w->height ||
+	    hdr->payload == WIRE_Q8)
+		img = w->img;
+
+	switch (hdr->payload) {
+	case WIRE_RICE:
+		if (rice_decode(img, hdr->width, hdr->height, src, hdr->len))
+			return -1;
+
+		break;
+	case WIRE_Q8:
+		if (hdr->len != nr)
+			return -1;
+
+		dequantize(img, src, nr, hdr);
+		break;
+	default:
+		if (hdr->len != nr * 2)
+			return -1;
+
+		memcpy(img, src, hdr->len);
+	}
+
+	if (img != y16)
+		expand(w, hdr, img, y16);
+
+	return 0;
+}
+
+/**
+ * wire_recv() - Read and decode the next frame from a stream socket.
+ * @param w Wire handle.
+ * @param fd Socket to read from.
+ * @param hdr Output header of the frame.
+ * @param y16 Output Y16LE framebuffer.
+ * @param roi Output array of ROI_MAX region measurements, see hdr->nr_roi, or
+ *	      NULL to ignore them.
+ *
+ * Corrupt frames are skipped. If the stream gets out of sync, it is scanned
+ * for the start of the next valid frame header.
+ *
+ * Return: 0 on success, -1 on EOF or error.
+ */
+int wire_recv(struct wire *w, int fd, struct wire_hdr *hdr, uint8_t *y16,
+	      struct roi_result *roi)
+{
+	uint8_t *h = w->buf;
+	int ret;
+
+	if (read_full(fd, h, HDR_LEN))
+		return -1;
+
+	while (1) {
+		while ((ret = check_hdr(w, h))) {
+			if (ret == HDR_MISMATCH)
+				hdr_mismatch(w, h);
+
+			if (!w->warned) {
+				warnx("lost sync with remote, resyncing");
+				w->warned = true;
+			}
+
+			memmove(h, h + 1, HDR_LEN - 1);
+			if (read_full(fd, h + HDR_LEN - 1, 1))
+				return -1;
+		}
+
+		hdr_ok(w);
+		parse_hdr(h, hdr);
+		if (read_full(fd, h + HDR_LEN,
+			      hdr->nr_roi * ROI_REC_LEN + hdr->len))
+			return -1;
+
+		if (!decode_payload(w, hdr, h + HDR_LEN, y16, roi))
+			return 0;
+
+		warnx("dropping corrupt frame %u", hdr->seq);
+		if (read_full(fd, h, HDR_LEN))
+			return -1;
+	}
+}
+
+/*
+ * Over UDP, each encoded frame (header and payload, exactly as it would be
+ * sent over TCP) is split into fragments small enough to never be split again
+ * by IP, even on an IPv6 link with the minimum 1280 byte MTU. Each fragment
+ * carries this header, all fields little-endian:
+ *
+ *	 0	magic "IRCF"
+ *	 4	u32 frame ID (the sequence number)
+ *	 8	u16 fragment index
+ *	10	u16 number of fragments in the frame
+ *	12	u32 total length of the frame
+ *
+ * A receiver only ever reassembles the newest frame it has seen: as soon as a
+ * fragment of a newer frame arrives, any incomplete older frame is dropped,
+ * since waiting for a retransmission which will never come is pointless.
+ */
+#define FRAG_HDR_LEN	16
+#define FRAG_DATA_LEN	1200
+#define FRAG_BATCH	32
+#define FRAG_RESTART	1000
+static const uint8_t frag_magic[4] = { 'I', 'R', 'C', 'F' };
+
+/**
+ * wire_send_dgram() - Send an encoded frame as a burst of UDP datagrams.
+ * @param fd Connected datagram socket.
+ * @param msg Encoded frame, see wire_encode().
+ * @param len Length of encoded frame.
+ * @param id Frame ID, which must increase with each frame.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int wire_send_dgram(int fd, const uint8_t *msg, size_t len, uint32_t id)
+{
+	uint8_t hdrs[FRAG_BATCH][FRAG_HDR_LEN];
+	struct iovec iovs[FRAG_BATCH][2];
+	struct mmsghdr mmsgs[FRAG_BATCH];
+	unsigned nr = (len + FRAG_DATA_LEN - 1) / FRAG_DATA_LEN;
+	unsigned i = 0;
+
+	while (i < nr) {
+		unsigned j, batch = nr - i < FRAG_BATCH ? nr - i : FRAG_BATCH;
+		int ret;
+
+		for (j = 0; j < batch; j++) {
+			size_t off = (size_t)(i + j) * FRAG_DATA_LEN;
+			uint8_t *h = hdrs[j];
+
+			memcpy(h, frag_magic, sizeof(frag_magic));
+			put_le32(h + 4, id);
+			put_le16(h + 8, i + j);
+			put_le16(h + 10, nr);
+			put_le32(h + 12, len);
+
+			iovs[j][0] = (struct iovec){ h, FRAG_HDR_LEN };
+			iovs[j][1] = (struct iovec){
+				(uint8_t *)msg + off,
+				len - off < FRAG_DATA_LEN ? len - off :
+							    FRAG_DATA_LEN,
+			};
+			mmsgs[j] = (struct mmsghdr){
+				.msg_hdr = {
+					.msg_iov = iovs[j],
+					.msg_iovlen = 2,
+				},
+			};
+		}
+
+		ret = sendmmsg(fd, mmsgs, batch, 0);
+		if (ret == -1) {
+			/*
+			 * Nobody listening on a unicast destination yet: that's
+			 * not an error for a datagram stream.
+			 */
+			if (errno == ECONNREFUSED || errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		i += ret;
+	}
+
+	return 0;
+}
+
+/**
+ * wire_recv_dgram() - Receive and decode the next complete frame over UDP.
+ * @param w Wire handle.
+ * @param fd Bound datagram socket.
+ * @param hdr Output header of the frame.
+ * @param y16 Output Y16LE framebuffer.
+ * @param roi Output array of ROI_MAX region measurements, or NULL.
+ *
+ * Frames with missing fragments are silently dropped: the gap in the sequence
+ * numbers shows up as drops.
+ *
+ * Return: 0 on success, -1 on error, if interrupted, or once the socket has
+ * been shut down.
+ */
+int wire_recv_dgram(struct wire *w, int fd, struct wire_hdr *hdr, uint8_t *y16,
+		    struct roi_result *roi)
+{
+	uint8_t pkt[FRAG_HDR_LEN + FRAG_DATA_LEN];
+
+	if (!w->frags) {
+		w->max_frags = (wire_max_len(w) + FRAG_DATA_LEN - 1) /
+			       FRAG_DATA_LEN;
+		w->frags = calloc(w->max_frags, sizeof(*w->frags));
+		if (!w->frags)
+			errx(1, "can't allocate fragment map");
+	}
+
+	while (1) {
+		unsigned idx, nr;
+		uint32_t id, len;
+		ssize_t ret;
+
+		/*
+		 * No fragment is ever empty, so a zero length read means the
+		 * socket was shut down.
+		 */
+		ret = recv(fd, pkt, sizeof(pkt), 0);
+		if (ret <= 0)
+			return -1;
+
+		if (ret <= FRAG_HDR_LEN || memcmp(pkt, frag_magic, 4))
+			continue;
+
+		id = get_le32(pkt + 4);
+		idx = get_le16(pkt + 8);
+		nr = get_le16(pkt + 10);
+		len = get_le32(pkt + 12);
+
+		if (!nr || nr > w->max_frags || idx >= nr ||
+		    len > wire_max_len(w) || len <= HDR_LEN ||
+		    (len + FRAG_DATA_LEN - 1) / FRAG_DATA_LEN != nr)
+			continue;
+
+		/*
+		 * A sender which restarts starts counting again from zero, so
+		 * an ID far in the past means a new stream, not a late packet.
+		 */
+		if (w->have_last && (int32_t)(id - w->last_id) < -FRAG_RESTART)
+			w->have_last = false;
+
+		if (w->have_last && (int32_t)(id - w->last_id) <= 0)
+			continue;
+
+		if (w->frag_nr && (int32_t)(id - w->frag_id) < 0)
+			continue;
+
+		if (!w->frag_nr || id != w->frag_id) {
+			memset(w->frags, 0, w->max_frags * sizeof(*w->frags));
+			w->frag_id = id;
+			w->frag_nr = nr;
+			w->frag_len = len;
+			w->frag_have = 0;
+		}
+
+		if (nr != w->frag_nr || len != w->frag_len || w->frags[idx])
+			continue;
+
+		if ((size_t)ret - FRAG_HDR_LEN !=
+		    (idx == nr - 1 ? len - idx * FRAG_DATA_LEN : FRAG_DATA_LEN))
+			continue;
+
+		memcpy(w->buf + idx * FRAG_DATA_LEN, pkt + FRAG_HDR_LEN,
+		       ret - FRAG_HDR_LEN);
+		w->frags[idx] = true;
+		if (++w->frag_have < nr)
+			continue;
+
+		/*
+		 * Never accept this ID again, even if a fragment is duplicated.
+		 */
+		w->last_id = id;
+		w->have_last = true;
+		w->frag_nr = 0;
+
+		ret = check_hdr(w, w->buf);
+		if (ret == HDR_MISMATCH)
+			hdr_mismatch(w, w->buf);
+
+		if (ret)
+			continue;
+
+		hdr_ok(w);
+		parse_hdr(w->buf, hdr);
+		if (hdr->len + hdr->nr_roi * ROI_REC_LEN != len - HDR_LEN)
+			continue;
+
+		if (!decode_payload(w, hdr, w->buf + HDR_LEN, y16, roi))
+			return 0;
+	}
+}
+
+/**
+ * wire_free() - Free a wire protocol handle.
+ * @param w Wire handle.
+ *
+ * Return: Nothing.
+ */
+void wire_free(struct wire *w)
+{
+	free(w->frags);
+	free(w->img);
+	free(w->buf);
+	free(w);
+}
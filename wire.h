@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "roi.h"
+
+#define WIRE_VERSION 3
+
+/*
+ * How the image in a wire frame is encoded. WIRE_Q8 is only ever sent to
+ * clients which ask for it, see struct wire_view.
+ */
+enum wire_payload {
+	WIRE_RAW = 0,
+	WIRE_RICE = 1,
+	WIRE_Q8 = 2,
+};
+
+/*
+ * Every frame on the wire is preceded by this header, which is serialized
+ * little-endian with no padding (see wire.c).
+ */
+struct wire_hdr {
+	uint8_t version;
+	uint8_t payload;
+	uint16_t width;
+	uint16_t height;
+	uint16_t nr_roi;
+	uint32_t seq;
+	uint64_t ts_ns;
+	uint32_t len;
+	uint16_t x;
+	uint16_t y;
+	uint8_t decimate;
+	uint16_t qmin;
+	uint16_t qmax;
+};
+
+/*
+ * A cheaper variant of the stream, which a client can ask the server for: a
+ * crop of the sensor (a zero width or height means all of it), every Nth
+ * pixel in each direction averaged down to one, every Nth frame, and 8-bit
+ * quantization between qmin and qmax (or the variant's own minimum and maximum
+ * if both are zero). The all-zeroes view is the full stream.
+ *
+ * Every field is a u16, so views can be compared with memcmp().
+ */
+struct wire_view {
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+	uint16_t decimate;
+	uint16_t rate;
+	uint16_t q8;
+	uint16_t qmin;
+	uint16_t qmax;
+};
+
+/*
+ * Clients ask for a view with a series of these control events, serialized
+ * little-endian with no padding, ending with WIRE_CTL_COMMIT.
+ */
+enum wire_ctl_type {
+	WIRE_CTL_COMMIT = 0,
+	WIRE_CTL_CROP = 1,
+	WIRE_CTL_DECIMATE = 2,
+	WIRE_CTL_RATE = 3,
+	WIRE_CTL_QUANT = 4,
+};
+
+struct wire_ctl {
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+} __attribute__((packed));
+
+#define WIRE_VIEW_MSG_LEN (10 * sizeof(struct wire_ctl))
+
+struct wire;
+
+struct wire *wire_new(enum wire_payload payload, int width, int height);
+
+int wire_parse_payload(const char *name);
+
+size_t wire_encode(struct wire *w, uint8_t *dst, uint32_t seq, uint64_t ts_ns,
+		   const uint8_t *y16, const struct roi_result *roi,
+		   int nr_roi, const struct wire_view *v);
+
+int wire_recv(struct wire *w, int fd, struct wire_hdr *hdr, uint8_t *y16,
+	      struct roi_result *roi);
+
+int wire_send_dgram(int fd, const uint8_t *msg, size_t len, uint32_t id);
+
+int wire_recv_dgram(struct wire *w, int fd, struct wire_hdr *hdr, uint8_t *y16,
+		    struct roi_result *roi);
+
+size_t wire_max_len(const struct wire *w);
+
+void wire_parse_view(struct wire_view *v, const char *spec);
+
+size_t wire_view_msg(uint8_t *dst, const struct wire_view *v);
+
+int wire_ctl_apply(struct wire_view *v, const struct wire_ctl *ctl);
+
+void wire_free(struct wire *w);
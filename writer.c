@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2023 Calvin Owens <jcalvinowens@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "writer.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+
+/*
+ * Data is gathered into CHUNK_SIZE buffers, which a thread writes out in the
+ * order they were filled. The producer only blocks if all NR_CHUNKS are
+ * waiting to be written, so a few seconds of storage stalls never reach it.
+ *
+ * The file is preallocated EXTENT_SIZE at a time. Writeback of each chunk is
+ * started as soon as it is written, and waited for one chunk later, so the
+ * page cache never holds more than a couple of chunks of dirty data: the
+ * stalls are short, and they all happen in the writer thread.
+ */
+#define CHUNK_SIZE	(1 << 20)
+#define NR_CHUNKS	8
+#define EXTENT_SIZE	(64 << 20)
+
+struct chunk {
+	uint8_t *data;
+	size_t len;
+	int64_t off;
+};
+
+struct writer {
+	char *path;
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct chunk chunks[NR_CHUNKS];
+	unsigned head;
+	unsigned tail;
+	bool closed;
+
+	/*
+	 * Only used by the producer: the chunk being filled is the one at
+	 * head, and pos is where the next write will land in the file.
+	 */
+	int64_t pos;
+	int64_t size;
+
+	/*
+	 * Only used by the writer thread.
+	 */
+	int64_t allocated;
+	int64_t synced_off;
+	int64_t synced_len;
+};
+
+static void write_chunk(struct writer *w, const struct chunk *c)
+{
+	size_t done = 0;
+
+	if (c->off + (int64_t)c->len > w->allocated) {
+		/*
+		 * Not every filesystem can preallocate, which is fine.
+		 */
+		fallocate(w->fd, FALLOC_FL_KEEP_SIZE, w->allocated,
+			  EXTENT_SIZE);
+		w->allocated += EXTENT_SIZE;
+	}
+
+	while (done < c->len) {
+		ssize_t ret;
+
+		ret = pwrite(w->fd, c->data + done, c->len - done,
+			     c->off + done);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			err(1, "can't write '%s'", w->path);
+		}
+
+		done += ret;
+	}
+
+	/*
+	 * Wait for the last chunk to reach the disk, and drop it from the
+	 * page cache since recordings aren't read back, then start this one.
+	 */
+	if (w->synced_len) {
+		sync_file_range(w->fd, w->synced_off, w->synced_len,
+				SYNC_FILE_RANGE_WAIT_BEFORE |
+					SYNC_FILE_RANGE_WRITE |
+					SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(w->fd, w->synced_off, w->synced_len,
+			      POSIX_FADV_DONTNEED);
+	}
+
+	sync_file_range(w->fd, c->off, c->len, SYNC_FILE_RANGE_WRITE);
+	w->synced_off = c->off;
+	w->synced_len = c->len;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		struct chunk *c;
+
+		while (w->tail == w->head && !w->closed)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		if (w->tail == w->head)
+			break;
+
+		c = &w->chunks[w->tail % NR_CHUNKS];
+		pthread_mutex_unlock(&w->lock);
+
+		write_chunk(w, c);
+
+		pthread_mutex_lock(&w->lock);
+		w->tail++;
+		pthread_cond_broadcast(&w->cond);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/*
+ * Queue the chunk being filled, if there is anything in it, and wait for a
+ * free one to fill next.
+ */
+static void submit(struct writer *w)
+{
+	struct chunk *c;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->chunks[w->head % NR_CHUNKS].len) {
+		w->head++;
+		pthread_cond_broadcast(&w->cond);
+	}
+
+	while (w->head - w->tail == NR_CHUNKS)
+		pthread_cond_wait(&w->cond, &w->lock);
+
+	pthread_mutex_unlock(&w->lock);
+
+	c = &w->chunks[w->head % NR_CHUNKS];
+	c->len = 0;
+	c->off = w->pos;
+}
+
+/**
+ * writer_open() - Create a file written asynchronously by its own thread.
+ * @param path Path to the file.
+ *
+ * Return: Writer handle.
+ */
+struct writer *writer_open(const char *path)
+{
+	sigset_t all, old;
+	struct writer *w;
+	int i;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		errx(1, "can't allocate writer");
+
+	w->path = strdup(path);
+	if (!w->path)
+		errx(1, "can't allocate writer");
+
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w->fd == -1)
+		err(1, "can't open record file '%s'", path);
+
+	for (i = 0; i < NR_CHUNKS; i++)
+		if (posix_memalign((void **)&w->chunks[i].data, 4096,
+				   CHUNK_SIZE))
+			errx(1, "can't allocate writer buffers");
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&w->thread, NULL, writer_thread, w))
+		errx(1, "can't start writer thread");
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return w;
+}
+
+/**
+ * writer_write() - Write data at the current position.
+ * @param w Writer handle.
+ * @param data Data to write.
+ * @param len Length of data.
+ *
+ * This only blocks if the writer thread is far behind.
+ *
+ * Return: Nothing.
+ */
+void writer_write(struct writer *w, const uint8_t *data, size_t len)
+{
+	struct chunk *c = &w->chunks[w->head % NR_CHUNKS];
+
+	/*
+	 * Each chunk covers a contiguous range of the file, so a write after
+	 * a seek needs a new one.
+	 */
+	if (c->off + (int64_t)c->len != w->pos) {
+		submit(w);
+		c = &w->chunks[w->head % NR_CHUNKS];
+	}
+
+	while (len) {
+		size_t n = CHUNK_SIZE - c->len;
+
+		if (n > len)
+			n = len;
+
+		memcpy(c->data + c->len, data, n);
+		c->len += n;
+		w->pos += n;
+		data += n;
+		len -= n;
+
+		if (c->len == CHUNK_SIZE) {
+			submit(w);
+			c = &w->chunks[w->head % NR_CHUNKS];
+		}
+	}
+
+	if (w->pos > w->size)
+		w->size = w->pos;
+}
+
+/**
+ * writer_seek() - Move the position the next write will land at.
+ * @param w Writer handle.
+ * @param off Offset.
+ * @param whence SEEK_SET, SEEK_CUR, or SEEK_END.
+ *
+ * Return: New position, or -1 if it would be negative.
+ */
+int64_t writer_seek(struct writer *w, int64_t off, int whence)
+{
+	if (whence == SEEK_CUR)
+		off += w->pos;
+	else if (whence == SEEK_END)
+		off += w->size;
+
+	if (off < 0)
+		return -1;
+
+	w->pos = off;
+	return off;
+}
+
+/**
+ * writer_size() - Get the size of the file being written.
+ * @param w Writer handle.
+ *
+ * Return: Size of the file once everything written so far reaches it.
+ */
+int64_t writer_size(const struct writer *w)
+{
+	return w->size;
+}
+
+/**
+ * writer_close() - Finish writing a file.
+ * @param w Writer handle.
+ *
+ * Everything written reaches the file before this returns, and any space
+ * preallocated past its end is released.
+ *
+ * Return: Nothing.
+ */
+void writer_close(struct writer *w)
+{
+	int i;
+
+	submit(w);
+
+	pthread_mutex_lock(&w->lock);
+	w->closed = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	if (ftruncate(w->fd, w->size))
+		err(1, "can't truncate '%s'", w->path);
+
+	if (close(w->fd))
+		err(1, "can't close '%s'", w->path);
+
+	for (i = 0; i < NR_CHUNKS; i++)
+		free(w->chunks[i].data);
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w->path);
+	free(w);
+}